@@ -0,0 +1,86 @@
+/**
+ * @file kdf_bench.c
+ * @brief Measures password hashing throughput: scrypt hashes per second per core.
+ *
+ * First times kdf_scrypt() directly on one thread for a range of costs, then
+ * drives the KDF pool the way the blocking server modes do (many submitters,
+ * each waiting for its job) with one KDF thread per CPU, which includes the
+ * queueing and batching overhead.
+ *
+ * Build and run from the repository root:
+ *   gcc -O2 -Wall -pthread -o kdf_bench bench/kdf_bench.c -lz -lcrypto && ./kdf_bench
+ */
+
+#define HTTP_NO_MAIN
+#include "../http.c"
+
+#define SUBMITTERS 32
+
+double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int pool_jobs_each;
+
+void *submitter(void *arg) {
+    struct kdf_job job;
+    int i;
+
+    (void)arg;
+    for (i = 0; i < pool_jobs_each; i++) {
+        memset(&job, 0, sizeof(job));
+        job.op = KDF_HASH;
+        strcpy(job.password, "correct horse battery staple");
+        while (!kdf_submit(&job)) usleep(1000); // Over the admission limit: back off
+        if (!job.ok) {
+            fprintf(stderr, "hashing failed\n");
+            exit(1);
+        }
+    }
+    return NULL;
+}
+
+int main(void) {
+    unsigned char salt[KDF_SALT_LEN] = "0123456789abcdef";
+    char out[HASH_LEN];
+    int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int ln;
+
+    printf("scrypt r=8 p=1, one thread\n");
+    printf("%-6s %8s %10s %12s\n", "log2N", "mem MiB", "ms/hash", "hashes/s");
+    for (ln = 10; ln <= 17; ln++) {
+        int iters = ln <= 13 ? 64 : ln <= 15 ? 16 : 4;
+        double t0 = now_ns(), ms;
+        int i;
+
+        for (i = 0; i < iters; i++) {
+            if (!kdf_scrypt("correct horse battery staple", salt, ln, 8, 1, out, sizeof(out))) {
+                fprintf(stderr, "scrypt failed at log2N=%d\n", ln);
+                return 1;
+            }
+        }
+        ms = (now_ns() - t0) / 1e6 / iters;
+        printf("%-6d %8d %10.2f %12.1f\n", ln, (128 * 8 << ln) >> 20, ms, 1000 / ms);
+    }
+
+    config.kdf_threads = ncpu;
+    printf("\nKDF pool, %d thread(s), %d waiting submitters\n", ncpu, SUBMITTERS);
+    printf("%-6s %12s %16s\n", "log2N", "hashes/s", "hashes/s/core");
+    for (ln = 12; ln <= 15; ln++) {
+        pthread_t tids[SUBMITTERS];
+        double t0, secs;
+        int i;
+
+        config.kdf_cost = ln;
+        pool_jobs_each = (ln <= 13 ? 64 : 16) * ncpu / SUBMITTERS + 1;
+        t0 = now_ns();
+        for (i = 0; i < SUBMITTERS; i++) pthread_create(&tids[i], NULL, submitter, NULL);
+        for (i = 0; i < SUBMITTERS; i++) pthread_join(tids[i], NULL);
+        secs = (now_ns() - t0) / 1e9;
+        printf("%-6d %12.1f %16.1f\n", ln, SUBMITTERS * pool_jobs_each / secs,
+               SUBMITTERS * pool_jobs_each / secs / ncpu);
+    }
+    return 0;
+}
@@ -0,0 +1,540 @@
+/**
+ * @file loadgen.c
+ * @brief HTTP load generator for the server: closed-loop and open-loop load,
+ *        latency percentiles without coordinated omission, JSON results.
+ *
+ * Closed loop (-R 0, the default): every connection sends its next request
+ * as soon as the previous response is complete, so the offered load adapts
+ * to the server. Open loop (-R <rate>): requests are due at a constant total
+ * rate, spread evenly over the connections. Latency is measured from the
+ * time a request was due, not from when it could finally be sent, so a
+ * stalled server shows up in the percentiles instead of just slowing the
+ * load down (no coordinated omission).
+ *
+ * Latencies go into a log-linear histogram (128 buckets per power of two,
+ * under 1% error, as HdrHistogram with 2 significant digits) per thread,
+ * merged at the end. Each scenario prints one JSON object on a line.
+ *
+ * Scenarios use the bundled assets:
+ *   small  GET /index.html
+ *   image  GET /img/test.jpg
+ *   media  GET /video/test.mp4
+ *   form   POST / with a urlencoded name and message (appends to form_data.txt)
+ *   all    each of the above in turn
+ *
+ * Build and run from the repository root, with the server listening:
+ *   gcc -O2 -Wall -pthread -o loadgen bench/loadgen.c && ./loadgen -p 8080 -s all -c 64 -d 10
+ * bench/loadgen_suite.sh runs every scenario against every server mode.
+ */
+
+#define _GNU_SOURCE // epoll_pwait2()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#define MAX_THREADS 64
+#define MAX_TAGS 16
+#define HEAD_MAX 8192            // Longest response head accepted
+#define RECV_CHUNK (64 * 1024)   // Bytes read per recv()
+#define HIST_SUB_BITS 7          // 128 buckets per power of two
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP 40          // Latencies up to ~18 minutes in ns
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 2) * HIST_SUB)
+
+struct scenario {
+    const char *name;
+    const char *method;
+    const char *path;
+    const char *body; // NULL for GET
+};
+
+static const struct scenario scenarios[] = {
+    {"small", "GET", "/index.html", NULL},
+    {"image", "GET", "/img/test.jpg", NULL},
+    {"media", "GET", "/video/test.mp4", NULL},
+    {"form", "POST", "/", "name=loadgen&message=Hello%2C+world%21+This+is+a+load+test+message."},
+};
+#define NSCENARIOS (int)(sizeof(scenarios) / sizeof(scenarios[0]))
+
+// Log-linear latency histogram in nanoseconds.
+struct histogram {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+enum conn_phase {
+    PH_CLOSED,     // Needs a new connection
+    PH_CONNECTING, // Non-blocking connect() in progress
+    PH_IDLE,       // Connected, nothing in flight
+    PH_SENDING,    // Writing the request
+    PH_RECEIVING   // Reading the response
+};
+
+struct client_conn {
+    int fd;
+    enum conn_phase phase;
+    size_t out_off;
+    uint64_t due;        // When the request in flight (or the next one) is due
+    char head[HEAD_MAX];
+    size_t head_len;
+    int have_head;
+    int status;
+    long long body_left;
+    int close_after;     // Server said Connection: close
+};
+
+// Settings shared by all threads.
+struct run {
+    struct sockaddr_in addr;
+    const struct scenario *sc;
+    char *request;
+    size_t request_len;
+    int connections;
+    int threads;
+    double rate;         // Requests per second in total, 0 for a closed loop
+    uint64_t start;      // Warmup starts
+    uint64_t measure;    // Measurement starts
+    uint64_t end;
+};
+
+// What one thread saw during the measurement.
+struct thread_result {
+    struct run *run;
+    int first, count;    // Connections this thread drives
+    uint64_t requests;
+    uint64_t bytes;
+    uint64_t status[6];  // By class, [0] for anything odd
+    uint64_t errors;     // Connection failures and broken responses
+    uint64_t connects;
+    struct histogram hist;
+};
+
+uint64_t clock_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static unsigned hist_bucket(uint64_t v) {
+    unsigned e;
+
+    if (v < HIST_SUB) return v;
+    e = 63 - __builtin_clzll(v);
+    if (e > HIST_MAX_EXP) return HIST_BUCKETS - 1;
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB + ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/**
+ * The highest value that falls into a bucket, which is what a percentile
+ * is reported as (never lower than the true value).
+ */
+static uint64_t hist_bucket_top(unsigned i) {
+    unsigned g = i / HIST_SUB, m = i % HIST_SUB;
+
+    if (g == 0) return i;
+    return ((uint64_t)(HIST_SUB + m + 1) << (g - 1)) - 1;
+}
+
+static void hist_record(struct histogram *h, uint64_t v) {
+    h->buckets[hist_bucket(v)]++;
+    h->count++;
+    if (v > h->max) h->max = v;
+}
+
+static uint64_t hist_percentile(const struct histogram *h, double p) {
+    uint64_t want = (uint64_t)(p / 100.0 * h->count + 0.5), seen = 0;
+    unsigned i;
+
+    if (h->count == 0) return 0;
+    if (want < 1) want = 1;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= want) return hist_bucket_top(i) < h->max ? hist_bucket_top(i) : h->max;
+    }
+    return h->max;
+}
+
+/**
+ * Starts a non-blocking connection and registers it for all events.
+ */
+static void conn_open(struct thread_result *t, int ep, struct client_conn *c) {
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLET };
+    int one = 1;
+
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) {
+        perror("socket() failed");
+        exit(1);
+    }
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c->phase = PH_CONNECTING;
+    c->have_head = 0;
+    c->head_len = 0;
+    if (connect(c->fd, (struct sockaddr *)&t->run->addr, sizeof(t->run->addr)) < 0 && errno != EINPROGRESS) {
+        t->errors++;
+        close(c->fd);
+        c->fd = -1;
+        c->phase = PH_CLOSED;
+        return;
+    }
+    t->connects++;
+    ev.data.ptr = c;
+    epoll_ctl(ep, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+static void conn_close(struct client_conn *c) {
+    if (c->fd >= 0) close(c->fd);
+    c->fd = -1;
+    c->phase = PH_CLOSED;
+}
+
+/**
+ * Parses a complete response head: status code, Content-Length and whether
+ * the server will close the connection afterwards.
+ * @return 1 on success, 0 if the head is malformed.
+ */
+static int parse_head(struct client_conn *c) {
+    const char *p = c->head, *end = c->head + c->head_len;
+
+    if (c->head_len < 12 || memcmp(p, "HTTP/1.", 7) != 0) return 0;
+    c->status = atoi(p + 9);
+    c->body_left = -1;
+    c->close_after = memcmp(p, "HTTP/1.0", 8) == 0;
+    while ((p = memchr(p, '\n', end - p)) != NULL && ++p < end) {
+        if (strncasecmp(p, "Content-Length:", 15) == 0) c->body_left = atoll(p + 15);
+        else if (strncasecmp(p, "Connection:", 11) == 0) c->close_after = strncasecmp(p + 12, "close", 5) == 0;
+    }
+    return c->body_left >= 0;
+}
+
+/**
+ * Sends as much of the request as the socket takes.
+ * @return 1 when it is all sent, 0 if the socket is full, -1 on error.
+ */
+static int conn_send(struct run *run, struct client_conn *c) {
+    while (c->out_off < run->request_len) {
+        ssize_t n = send(c->fd, run->request + c->out_off, run->request_len - c->out_off, MSG_NOSIGNAL);
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN ? 0 : -1;
+        }
+        c->out_off += n;
+    }
+    return 1;
+}
+
+/**
+ * Reads the response as far as the socket allows.
+ * @return 1 when it is complete, 0 if more is to come, -1 on error or EOF.
+ */
+static int conn_recv(struct thread_result *t, struct client_conn *c, char *scratch) {
+    while (1) {
+        ssize_t n;
+
+        if (!c->have_head) {
+            char *eoh;
+
+            n = recv(c->fd, c->head + c->head_len, sizeof(c->head) - 1 - c->head_len, MSG_PEEK);
+            if (n == 0) return -1;
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return errno == EAGAIN ? 0 : -1;
+            }
+            c->head[c->head_len + n] = '\0';
+            eoh = strstr(c->head, "\r\n\r\n");
+            // Consume only the head, leaving the body for the bulk reads below.
+            n = eoh ? (eoh + 4 - c->head) - (ssize_t)c->head_len : n;
+            if (recv(c->fd, c->head + c->head_len, n, 0) != n) return -1;
+            c->head_len += n;
+            if (!eoh) {
+                if (c->head_len >= sizeof(c->head) - 1) return -1;
+                continue;
+            }
+            c->head[c->head_len] = '\0';
+            if (!parse_head(c)) return -1;
+            c->have_head = 1;
+            t->bytes += c->head_len;
+        }
+        if (c->body_left == 0) return 1;
+        n = recv(c->fd, scratch, c->body_left < RECV_CHUNK ? c->body_left : RECV_CHUNK, 0);
+        if (n == 0) return -1;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN ? 0 : -1;
+        }
+        c->body_left -= n;
+        t->bytes += n;
+    }
+}
+
+/**
+ * Puts the next request on an idle connection if it is due.
+ */
+static void conn_start(struct run *run, struct client_conn *c, uint64_t now) {
+    if (run->rate > 0 && now < c->due) return;
+    if (run->rate == 0) c->due = now; // Closed loop: latency runs from the actual send
+    c->phase = PH_SENDING;
+    c->out_off = 0;
+    c->have_head = 0;
+    c->head_len = 0;
+}
+
+/**
+ * Drives one connection as far as it can go right now.
+ */
+static void conn_advance(struct thread_result *t, int ep, struct client_conn *c, char *scratch, uint64_t now) {
+    struct run *run = t->run;
+    int r;
+
+    while (1) {
+        switch (c->phase) {
+        case PH_CLOSED:
+            if (now >= run->end) return;
+            conn_open(t, ep, c);
+            if (c->phase == PH_CLOSED) return;
+            continue;
+        case PH_CONNECTING: {
+            int err = 0;
+            socklen_t len = sizeof(err);
+
+            if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err == EINPROGRESS) return;
+            if (err) {
+                t->errors++;
+                conn_close(c);
+                return; // Retried on the next tick
+            }
+            c->phase = PH_IDLE;
+            continue;
+        }
+        case PH_IDLE:
+            if (now >= run->end) return;
+            conn_start(run, c, now);
+            if (c->phase == PH_IDLE) return;
+            continue;
+        case PH_SENDING:
+            r = conn_send(run, c);
+            if (r == 0) return;
+            if (r < 0) {
+                if (now >= run->measure) t->errors++;
+                conn_close(c);
+                continue;
+            }
+            c->phase = PH_RECEIVING;
+            continue;
+        case PH_RECEIVING:
+            r = conn_recv(t, c, scratch);
+            if (r == 0) return;
+            now = clock_ns();
+            if (r < 0) {
+                if (now >= run->measure) t->errors++;
+                conn_close(c);
+                continue;
+            }
+            if (c->due >= run->measure && c->due < run->end) {
+                hist_record(&t->hist, now - c->due);
+                t->requests++;
+                t->status[c->status >= 100 && c->status < 600 ? c->status / 100 : 0]++;
+            }
+            if (run->rate > 0) c->due += (uint64_t)(1e9 * run->connections / run->rate);
+            if (c->close_after) conn_close(c);
+            else c->phase = PH_IDLE;
+            continue;
+        }
+    }
+}
+
+void *load_thread(void *arg) {
+    struct thread_result *t = arg;
+    struct run *run = t->run;
+    struct epoll_event events[256];
+    struct client_conn *conns = calloc(t->count, sizeof(*conns));
+    char *scratch = malloc(RECV_CHUNK);
+    int ep = epoll_create1(EPOLL_CLOEXEC), i;
+
+    if (conns == NULL || scratch == NULL || ep < 0) {
+        fprintf(stderr, "loadgen: out of resources\n");
+        exit(1);
+    }
+    for (i = 0; i < t->count; i++) {
+        conns[i].fd = -1;
+        // Stagger open-loop connections so the requests arrive evenly, not in waves.
+        if (run->rate > 0) conns[i].due = run->start + (uint64_t)(1e9 * (t->first + i) / run->rate);
+    }
+
+    while (1) {
+        uint64_t now = clock_ns(), next = run->end;
+        struct timespec timeout;
+        int n;
+
+        if (now >= run->end) break;
+        for (i = 0; i < t->count; i++) {
+            struct client_conn *c = &conns[i];
+
+            if (c->phase == PH_CLOSED || c->phase == PH_IDLE) conn_advance(t, ep, c, scratch, now);
+            if (c->phase == PH_IDLE && c->due < next) next = c->due;
+            if (c->phase == PH_CLOSED) next = now + 1000000; // Reconnect after 1 ms
+        }
+        now = clock_ns();
+        timeout.tv_sec = next > now ? (next - now) / 1000000000u : 0;
+        timeout.tv_nsec = next > now ? (next - now) % 1000000000u : 0;
+        n = epoll_pwait2(ep, events, 256, &timeout, NULL);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_pwait2() failed");
+            exit(1);
+        }
+        now = clock_ns();
+        for (i = 0; i < n; i++) conn_advance(t, ep, events[i].data.ptr, scratch, now);
+    }
+    for (i = 0; i < t->count; i++) conn_close(&conns[i]);
+    close(ep);
+    free(conns);
+    free(scratch);
+    return NULL;
+}
+
+/**
+ * Runs one scenario and prints its result as a JSON line.
+ */
+static void run_scenario(struct run *run, const struct scenario *sc, double warmup, double duration, char **tags,
+                         int ntags) {
+    static const double percentiles[] = {50, 90, 99, 99.9, 99.99};
+    static const char *const pnames[] = {"p50", "p90", "p99", "p99_9", "p99_99"};
+    struct thread_result *res = calloc(run->threads, sizeof(*res));
+    pthread_t tids[MAX_THREADS];
+    struct thread_result total;
+    char request[1024];
+    int i, j, first = 0;
+
+    if (res == NULL) {
+        fprintf(stderr, "loadgen: out of memory\n");
+        exit(1);
+    }
+    run->sc = sc;
+    if (sc->body) {
+        run->request_len = snprintf(request, sizeof(request),
+                                    "%s %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: loadgen\r\n"
+                                    "Content-Type: application/x-www-form-urlencoded\r\nContent-Length: %zu\r\n\r\n%s",
+                                    sc->method, sc->path, inet_ntoa(run->addr.sin_addr), strlen(sc->body), sc->body);
+    } else {
+        run->request_len = snprintf(request, sizeof(request), "%s %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: loadgen\r\n\r\n",
+                                    sc->method, sc->path, inet_ntoa(run->addr.sin_addr));
+    }
+    run->request = request;
+    run->start = clock_ns();
+    run->measure = run->start + (uint64_t)(warmup * 1e9);
+    run->end = run->measure + (uint64_t)(duration * 1e9);
+
+    for (i = 0; i < run->threads; i++) {
+        res[i].run = run;
+        res[i].first = first;
+        res[i].count = run->connections / run->threads + (i < run->connections % run->threads);
+        first += res[i].count;
+        if (pthread_create(&tids[i], NULL, load_thread, &res[i]) != 0) {
+            fprintf(stderr, "loadgen: pthread_create() failed\n");
+            exit(1);
+        }
+    }
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < run->threads; i++) {
+        pthread_join(tids[i], NULL);
+        total.requests += res[i].requests;
+        total.bytes += res[i].bytes;
+        total.errors += res[i].errors;
+        total.connects += res[i].connects;
+        for (j = 0; j < 6; j++) total.status[j] += res[i].status[j];
+        total.hist.count += res[i].hist.count;
+        if (res[i].hist.max > total.hist.max) total.hist.max = res[i].hist.max;
+        for (j = 0; j < HIST_BUCKETS; j++) total.hist.buckets[j] += res[i].hist.buckets[j];
+    }
+
+    printf("{\"scenario\":\"%s\",\"method\":\"%s\",\"path\":\"%s\",\"loop\":\"%s\",\"connections\":%d,\"threads\":%d,"
+           "\"target_rps\":%.0f,\"duration_s\":%.3f,",
+           sc->name, sc->method, sc->path, run->rate > 0 ? "open" : "closed", run->connections, run->threads,
+           run->rate, duration);
+    for (i = 0; i < ntags; i++) {
+        char *eq = strchr(tags[i], '=');
+        printf("\"%.*s\":\"%s\",", (int)(eq - tags[i]), tags[i], eq + 1);
+    }
+    printf("\"requests\":%llu,\"rps\":%.1f,\"bytes\":%llu,\"mb_per_s\":%.2f,\"errors\":%llu,\"connects\":%llu,"
+           "\"status\":{\"1xx\":%llu,\"2xx\":%llu,\"3xx\":%llu,\"4xx\":%llu,\"5xx\":%llu,\"other\":%llu},"
+           "\"latency_us\":{",
+           (unsigned long long)total.requests, total.requests / duration, (unsigned long long)total.bytes,
+           total.bytes / duration / 1e6, (unsigned long long)total.errors, (unsigned long long)total.connects,
+           (unsigned long long)total.status[1], (unsigned long long)total.status[2],
+           (unsigned long long)total.status[3], (unsigned long long)total.status[4],
+           (unsigned long long)total.status[5], (unsigned long long)total.status[0]);
+    for (i = 0; i < 5; i++) printf("\"%s\":%.1f,", pnames[i], hist_percentile(&total.hist, percentiles[i]) / 1e3);
+    printf("\"max\":%.1f}}\n", total.hist.max / 1e3);
+    fflush(stdout);
+    free(res);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-a addr] [-p port] [-s small|image|media|form|all] [-c connections] [-t threads]\n"
+            "          [-d seconds] [-w warmup_seconds] [-R requests_per_second] [-x key=value]...\n"
+            "  -R 0 (default) runs a closed loop; a rate runs an open loop at that total rate.\n"
+            "  -x adds a string field to the JSON output, e.g. -x mode=prefork -x commit=abc123.\n",
+            prog);
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    struct run run = { .connections = 16, .threads = 1 };
+    const char *addr = "127.0.0.1", *scenario = "small";
+    double duration = 10, warmup = 1;
+    char *tags[MAX_TAGS];
+    int port = 8080, ntags = 0, opt, i, found = 0;
+
+    while ((opt = getopt(argc, argv, "a:p:s:c:t:d:w:R:x:")) != -1) {
+        switch (opt) {
+        case 'a': addr = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 's': scenario = optarg; break;
+        case 'c': run.connections = atoi(optarg); break;
+        case 't': run.threads = atoi(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'w': warmup = atof(optarg); break;
+        case 'R': run.rate = atof(optarg); break;
+        case 'x':
+            if (ntags == MAX_TAGS || !strchr(optarg, '=')) usage(argv[0]);
+            tags[ntags++] = optarg;
+            break;
+        default: usage(argv[0]);
+        }
+    }
+    if (run.connections < 1 || run.threads < 1 || run.threads > MAX_THREADS || duration <= 0 || warmup < 0 ||
+        run.rate < 0) {
+        usage(argv[0]);
+    }
+    if (run.threads > run.connections) run.threads = run.connections;
+    run.addr.sin_family = AF_INET;
+    run.addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, addr, &run.addr.sin_addr) != 1) {
+        fprintf(stderr, "loadgen: bad address '%s'\n", addr);
+        return 2;
+    }
+
+    for (i = 0; i < NSCENARIOS; i++) {
+        if (strcmp(scenario, "all") != 0 && strcmp(scenario, scenarios[i].name) != 0) continue;
+        run_scenario(&run, &scenarios[i], warmup, duration, tags, ntags);
+        found = 1;
+    }
+    if (!found) usage(argv[0]);
+    return 0;
+}
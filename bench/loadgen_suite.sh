@@ -0,0 +1,31 @@
+#!/bin/sh
+# Runs every loadgen scenario against every server mode and prints one JSON
+# line per run, tagged with the mode and commit, so results can be diffed
+# between commits. Run from the repository root:
+#   sh bench/loadgen_suite.sh [extra loadgen options, e.g. -c 128 -d 20 -R 20000]
+set -e
+
+PORT=${PORT:-18080}
+MODES=${MODES:-"fork prefork threads epoll uring"}
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+WORK=$(mktemp -d)
+trap 'kill $SERVER 2>/dev/null; rm -rf "$WORK"' EXIT
+
+gcc -O2 -Wall -pthread -o "$WORK/http" http.c -lz -lcrypto
+gcc -O2 -Wall -pthread -o "$WORK/loadgen" bench/loadgen.c
+# The server serves its working directory; give it a copy so form posts and
+# logs do not land in the checkout.
+cp -r ./*.html img video "$WORK/"
+
+for mode in $MODES; do
+    (cd "$WORK" && exec ./http -m "$mode" -l off "$PORT") >/dev/null 2>&1 &
+    SERVER=$!
+    sleep 1
+    if kill -0 $SERVER 2>/dev/null; then
+        "$WORK/loadgen" -p "$PORT" -s all -x mode="$mode" -x commit="$COMMIT" "$@"
+        kill $SERVER
+        wait $SERVER 2>/dev/null || true
+    else
+        echo "{\"mode\":\"$mode\",\"commit\":\"$COMMIT\",\"error\":\"server did not start\"}"
+    fi
+done
@@ -0,0 +1,382 @@
+/**
+ * @file micro_bench.c
+ * @brief Times the request-path primitives one at a time, away from network noise.
+ *
+ * Covers http_parse() (the former parse_http()), read_full_request() fed from
+ * a socketpair, urldecode(), parse_user_data(), get_content_type(), fileread()
+ * and http_send_response() flushed to /dev/null, on realistic inputs: browser
+ * heads, a long URL, 60 headers, percent-heavy form bodies and a 4 MB file.
+ *
+ * For every case it prints ns/op, heap allocations/op (malloc, calloc and
+ * realloc calls, counted by wrapping them below) and CPU cycles/op from a
+ * perf_event_open() cycle counter. Cycles show as "-" where the kernel or the
+ * container does not allow counters (perf_event_paranoid, seccomp, VMs).
+ * Each case is calibrated to about 100 ms and run five times; the best run
+ * is reported.
+ *
+ * Build and run from the repository root (an optional argument picks the
+ * cases whose name contains it):
+ *   gcc -O2 -Wall -pthread -o micro_bench bench/micro_bench.c -lz -lcrypto && ./micro_bench [filter]
+ */
+
+#define HTTP_NO_MAIN
+#include "../http.c"
+
+#include <sys/uio.h>
+#include <linux/perf_event.h>
+
+// ---- Allocation counting ----
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static __thread unsigned long allocs;
+
+void *malloc(size_t size) {
+    allocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    allocs++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    allocs++;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+
+// ---- Cycle counter ----
+
+int cycles_fd = -1;
+
+/**
+ * Opens a cycle counter for this thread, kernel time included when allowed
+ * (read_full_request() and the /dev/null writes spend most of theirs there).
+ */
+void cycles_open(void) {
+    struct perf_event_attr attr;
+    int exclude_kernel;
+
+    for (exclude_kernel = 0; exclude_kernel <= 1 && cycles_fd < 0; exclude_kernel++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        attr.exclude_kernel = exclude_kernel;
+        attr.exclude_hv = 1;
+        cycles_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+}
+
+uint64_t cycles_read(void) {
+    uint64_t v = 0;
+
+    if (cycles_fd < 0 || read(cycles_fd, &v, sizeof(v)) != sizeof(v)) return 0;
+    return v;
+}
+
+double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+volatile size_t sink;
+
+// ---- Inputs, filled in by build_inputs() ----
+
+char head_browser[1024];
+char head_long_url[MAX_REQUEST_SIZE];
+char head_many[MAX_REQUEST_SIZE];
+char url_encoded[2048];
+char form_small[128];
+char form_escaped[16384];
+char post_form[MAX_REQUEST_SIZE + sizeof(form_escaped)];
+char body_page[2048];
+char *body_large;
+#define BODY_LARGE (1024 * 1024)
+char big_file[64];
+#define BIG_FILE_SIZE (4 * 1024 * 1024)
+
+const char *const paths[] = {
+    "/index.html", "/style.css", "/script.js", "/img/test.jpg",
+    "/video/test.mp4", "/fonts/inter-var.woff2", "/api/data.json", "/downloads/README",
+};
+#define NPATHS (sizeof(paths) / sizeof(paths[0]))
+
+void build_inputs(void) {
+    const char *ua = "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+                     "Chrome/126.0.0.0 Safari/537.36";
+    char target[3072];
+    size_t n;
+    int i, fd;
+
+    snprintf(head_browser, sizeof(head_browser),
+             "GET /index.html HTTP/1.1\r\n"
+             "Host: localhost:8080\r\n"
+             "User-Agent: %s\r\n"
+             "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+             "Accept-Language: en-US,en;q=0.9\r\n"
+             "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+             "Connection: keep-alive\r\n"
+             "Upgrade-Insecure-Requests: 1\r\n"
+             "Sec-Fetch-Dest: document\r\n"
+             "Sec-Fetch-Mode: navigate\r\n"
+             "Sec-Fetch-Site: none\r\n"
+             "\r\n", ua);
+
+    // A search-style URL, close to the 4K head limit.
+    n = snprintf(target, sizeof(target), "/search/results.html?q=");
+    for (i = 0; n < sizeof(target) - 64; i++) {
+        n += snprintf(target + n, sizeof(target) - n, "term%d+%%22quoted%%20phrase%%22&f%d=on&", i, i);
+    }
+    snprintf(head_long_url, sizeof(head_long_url),
+             "GET %s HTTP/1.1\r\nHost: localhost:8080\r\nUser-Agent: %s\r\nAccept: */*\r\n\r\n", target, ua);
+
+    // 60 header fields, as behind a few proxies with tracing and cookies.
+    n = snprintf(head_many, sizeof(head_many), "GET /api/data.json HTTP/1.1\r\nHost: localhost:8080\r\n");
+    for (i = 0; i < 58; i++) {
+        n += snprintf(head_many + n, sizeof(head_many) - n, "X-Trace-%02d: %08x-%04x-%04x\r\n", i,
+                      i * 2654435761u, i * 40503u & 0xffff, ~i & 0xffff);
+    }
+    snprintf(head_many + n, sizeof(head_many) - n, "\r\n");
+
+    n = snprintf(url_encoded, sizeof(url_encoded), "/files/");
+    while (n < sizeof(url_encoded) - 48) {
+        n += snprintf(url_encoded + n, sizeof(url_encoded) - n, "My%%20Documents/r%%C3%%A9sum%%C3%%A9%%20%%282024%%29/");
+    }
+
+    strcpy(form_small, "name=Jane+Doe&message=Hello%2C+world%21+See+you+soon.");
+    // UTF-8 text as browsers encode it: most bytes arrive as escapes.
+    n = snprintf(form_escaped, sizeof(form_escaped), "name=%%E5%%BC%%A0%%E4%%BC%%9F&message=");
+    while (n < sizeof(form_escaped) - 40) {
+        n += snprintf(form_escaped + n, sizeof(form_escaped) - n, "%%E4%%BD%%A0%%E5%%A5%%BD%%2C+caf%%C3%%A9%%21+");
+    }
+    snprintf(post_form, sizeof(post_form),
+             "POST / HTTP/1.1\r\nHost: localhost:8080\r\nUser-Agent: %s\r\n"
+             "Content-Type: application/x-www-form-urlencoded\r\nContent-Length: %zu\r\n"
+             "Connection: keep-alive\r\n\r\n%s", ua, strlen(form_escaped), form_escaped);
+
+    n = 0;
+    while (n < sizeof(body_page) - 64) {
+        n += snprintf(body_page + n, sizeof(body_page) - n, "<p>Lorem ipsum dolor sit amet, consectetur.</p>\n");
+    }
+    body_large = malloc(BODY_LARGE);
+    snprintf(big_file, sizeof(big_file), "/tmp/micro_bench.%d", (int)getpid());
+    fd = open(big_file, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (body_large == NULL || fd < 0) {
+        perror("micro_bench setup");
+        exit(1);
+    }
+    for (n = 0; n < BODY_LARGE; n++) body_large[n] = "0123456789abcdef"[(n * 7919) >> 5 & 15];
+    for (i = 0; i < BIG_FILE_SIZE / BODY_LARGE; i++) {
+        if (write(fd, body_large, BODY_LARGE) != BODY_LARGE) {
+            perror("micro_bench setup");
+            exit(1);
+        }
+    }
+    close(fd);
+}
+
+// ---- Cases ----
+
+// One operation per call; ctx is the case's input.
+typedef void (*op_fn)(const void *ctx);
+
+void op_parse(const void *ctx) {
+    struct http_request r;
+    const char *in = ctx;
+
+    http_request_init(&r);
+    if (http_parse(&r, in, strlen(in)) != 1) {
+        fprintf(stderr, "parse error: %s\n", error_msg);
+        exit(1);
+    }
+    sink += r.nfields;
+}
+
+int pair[2] = {-1, -1};
+struct conn rconn;
+
+/**
+ * Writes one request into the socketpair and reads it back through
+ * read_full_request(), as a worker would after an EPOLLIN.
+ */
+void op_read_request(const void *ctx) {
+    const char *in = ctx;
+    size_t len = strlen(in), off = 0;
+
+    while (off < len) {
+        ssize_t n = write(pair[1], in + off, len - off);
+        if (n <= 0) {
+            perror("write() to socketpair");
+            exit(1);
+        }
+        off += n;
+    }
+    if (read_full_request(&rconn) != 1) {
+        fprintf(stderr, "read_full_request() did not complete\n");
+        exit(1);
+    }
+    sink += rconn.need;
+    conn_next_request(&rconn);
+}
+
+void op_urldecode(const void *ctx) {
+    static char out[sizeof(form_escaped)];
+
+    urldecode(out, ctx);
+    sink += out[0];
+}
+
+void op_form(const void *ctx) {
+    struct FormData d = parse_user_data((char *)ctx);
+    sink += d.message[0];
+}
+
+void op_content_type(const void *ctx) {
+    static unsigned i;
+
+    (void)ctx;
+    sink += (size_t)get_content_type(paths[i++ % NPATHS]);
+}
+
+void op_fileread(const void *ctx) {
+    struct arena a = {0};
+    File *f = fileread(&a, (char *)ctx);
+
+    if (f == NULL) exit(1);
+    sink += f->size;
+    arena_release(&a);
+}
+
+int devnull = -1;
+struct conn wconn;
+
+/**
+ * Queues a response and writes it out the way conn_flush() does, but with
+ * writev(): sendmsg() needs a socket and /dev/null is not one.
+ */
+void send_response(const char *body, int len) {
+    struct iovec iov[2];
+    int n = 0;
+
+    http_send_response(&wconn, 200, "text/html", body, len);
+    iov[n++] = (struct iovec){wconn.wbuf, wconn.wlen};
+    if (wconn.blen) iov[n++] = (struct iovec){(char *)wconn.bbuf, wconn.blen};
+    if (writev(devnull, iov, n) < 0) {
+        perror("writev() to /dev/null");
+        exit(1);
+    }
+    conn_next_request(&wconn);
+}
+
+void op_send_page(const void *ctx) {
+    (void)ctx;
+    send_response(body_page, strlen(body_page));
+}
+
+void op_send_large(const void *ctx) {
+    (void)ctx;
+    send_response(body_large, BODY_LARGE);
+}
+
+struct result {
+    double ns;
+    double allocs;
+    double cycles; // < 0 when unavailable
+};
+
+/**
+ * Runs an operation `iters` times and measures the whole batch.
+ */
+struct result run_batch(op_fn fn, const void *ctx, long iters) {
+    struct result r;
+    unsigned long a0 = allocs;
+    uint64_t c0 = cycles_read();
+    double t0 = now_ns();
+    long i;
+
+    for (i = 0; i < iters; i++) fn(ctx);
+    r.ns = (now_ns() - t0) / iters;
+    r.cycles = cycles_fd >= 0 ? (double)(cycles_read() - c0) / iters : -1;
+    r.allocs = (double)(allocs - a0) / iters;
+    return r;
+}
+
+int main(int argc, char *argv[]) {
+    struct {
+        const char *name;
+        op_fn fn;
+        const void *ctx;
+    } cases[] = {
+        {"http_parse, browser head", op_parse, head_browser},
+        {"http_parse, 3K URL", op_parse, head_long_url},
+        {"http_parse, 60 headers", op_parse, head_many},
+        {"read_full_request, GET", op_read_request, head_browser},
+        {"read_full_request, 60 headers", op_read_request, head_many},
+        {"read_full_request, 16K POST", op_read_request, post_form},
+        {"urldecode, 2K path", op_urldecode, url_encoded},
+        {"urldecode, 16K escaped form", op_urldecode, form_escaped},
+        {"parse_user_data, small", op_form, form_small},
+        {"parse_user_data, 16K escaped", op_form, form_escaped},
+        {"get_content_type", op_content_type, NULL},
+        {"fileread, index.html", op_fileread, "index.html"},
+        {"fileread, 4M file", op_fileread, big_file},
+        {"http_send_response, 2K page", op_send_page, NULL},
+        {"http_send_response, 1M body", op_send_large, NULL},
+    };
+    const char *filter = argc > 1 ? argv[1] : NULL;
+    size_t i;
+
+    simd_init();
+    build_inputs();
+    cycles_open();
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0 || (devnull = open("/dev/null", O_WRONLY)) < 0) {
+        perror("micro_bench setup");
+        return 1;
+    }
+    // Big enough for the largest request in one write().
+    int sndbuf = 1024 * 1024;
+    setsockopt(pair[1], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    fcntl(pair[0], F_SETFL, O_NONBLOCK);
+    conn_init(&rconn, pair[0]);
+    conn_init(&wconn, devnull);
+    wconn.keep_alive = 1;
+
+    printf("%-32s %10s %10s %12s   (scan kernels: %s, cycles: %s)\n", "case", "ns/op", "allocs/op", "cycles/op",
+           scan.name, cycles_fd >= 0 ? "perf" : "unavailable");
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        struct result best = {0}, r;
+        long iters = 1;
+        int k;
+
+        if (filter && strstr(cases[i].name, filter) == NULL) continue;
+        // Calibrate to ~100 ms per run (after a warmup batch).
+        run_batch(cases[i].fn, cases[i].ctx, 1);
+        while (iters < (1L << 30)) {
+            r = run_batch(cases[i].fn, cases[i].ctx, iters);
+            if (r.ns * iters > 2e7) break;
+            iters *= 4;
+        }
+        iters = (long)(1e8 / r.ns) + 1;
+        for (k = 0; k < 5; k++) {
+            r = run_batch(cases[i].fn, cases[i].ctx, iters);
+            if (k == 0 || r.ns < best.ns) best = r;
+        }
+        printf("%-32s %10.1f %10.2f", cases[i].name, best.ns, best.allocs);
+        if (best.cycles >= 0) printf(" %12.0f\n", best.cycles);
+        else printf(" %12s\n", "-");
+    }
+
+    unlink(big_file);
+    return 0;
+}
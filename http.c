@@ -1,6 +1,8 @@
 // //step 1 seting server
 // // parsing http requests
 
+#define _GNU_SOURCE // For accept4(), splice() and sched_setaffinity()
+
 // This program is a simple HTTP server demonstrating how to handle both GET and POST requests.
 // It includes fixes for race conditions, file handling, and proper POST body parsing.
 
@@ -16,18 +18,170 @@
 #include <errno.h>      // For error codes like EAGAIN
 #include <time.h>       // For getting the current time
 #include <sys/time.h>   // for timeval struct
+#include <sys/stat.h>   // fstat() for file sizes
+#include <sys/sendfile.h> // Zero-copy file bodies
+#include <sys/epoll.h>  // Event loop server mode
+#include <sys/resource.h> // For raising the open file limit
+#include <sys/wait.h>   // waitpid() for supervising workers
+#include <sys/prctl.h>  // PR_SET_PDEATHSIG
+#include <sched.h>      // CPU pinning for workers
+#include <signal.h>     // Signal handling in the master process
+#include <pthread.h>    // Thread-pool server mode
+#include <stdatomic.h>  // Lock-free pending work counter
+#include <sys/mman.h>   // Mapping the io_uring rings
+#include <sys/syscall.h> // Raw io_uring system calls
+#include <linux/io_uring.h> // io_uring I/O backend
+#include <strings.h>    // strncasecmp() for header names
+#include <sys/inotify.h> // Invalidating cached files when the docroot changes
+#include <dirent.h>     // Walking the docroot to set up watches
+#include <zlib.h>       // gzip content coding
+#include <limits.h>     // PATH_MAX
+#include <stdint.h>     // uintptr_t
+#include <inttypes.h>   // PRIu64 for the metrics page
+#include <stdarg.h>     // Formatting the metrics page
+#include <sys/uio.h>    // struct iovec for scatter-gather sends
+#include <poll.h>       // Checking for docroot events between ETag hashes
+#include <sys/eventfd.h> // Waking event loops when password hashes or form syncs are done
+#include <sys/file.h>   // flock() around access log rotation
+#include <openssl/evp.h> // scrypt password hashing, SHA-256 ETags
+#include <openssl/rand.h> // Password salts
+#include <openssl/crypto.h> // CRYPTO_memcmp()
+#include <openssl/hmac.h> // Signing session cookies
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>  // SSE2/AVX2 byte scanning kernels
+#define HAVE_X86_SIMD 1
+#endif
 
 #define LISTENADDRESS "0.0.0.0"
 #define MAX_REQUEST_SIZE 4096 // A reasonable maximum for the entire request
 #define MAX_USERNAME_LEN 65
 #define MAX_PASSWORD_LEN 65
-#define HASH_LEN 65
+#define HASH_LEN 128
+#define LISTEN_BACKLOG SOMAXCONN // Pending connection queue for the listening socket
+#define MAX_EVENTS 1024          // epoll events handled per epoll_wait() call
+#define DEQUE_INIT_CAP 64        // Initial capacity of a thread's work deque
+#define URING_ENTRIES 4096       // Submission queue size of the io_uring backend
+#define URING_BUFS 1024          // Receive buffers in the provided buffer ring (power of two)
+#define URING_BUF_SIZE 4096      // Size of each provided receive buffer
+#define URING_BGID 0             // Buffer group id of the receive buffer ring
+#define URING_CHUNK (64 * 1024)  // File bytes read and sent per io_uring round trip
+#define URING_PIPELINE_MAX (16 * 1024) // Bytes one multishot recv takes in before it must be re-armed
+#define CACHE_ENTRIES 4096       // Files the static file cache can hold
+#define CACHE_BUCKETS 8192       // Hash buckets of the cache (power of two)
+#define CACHE_SHARDS 16          // Independently locked slices of the cache (power of two)
+#define CACHE_SHARD_ENTRIES (CACHE_ENTRIES / CACHE_SHARDS)
+#define CACHE_SHARD_BUCKETS (CACHE_BUCKETS / CACHE_SHARDS)
+#define CACHE_PATH_MAX 256       // Longest cacheable file path
+#define CACHE_MIN_BLOCK 512      // Smallest cache block; classes double up to CACHE_MAX_ENTRY
+#define CACHE_CLASSES 9          // 512 B .. 128 KiB
+#define INDEX_SLOTS 16384        // Docroot index capacity (power of two)
+#define INDEX_MAX_LOAD (INDEX_SLOTS / 4 * 3) // Files indexed before lookups fall back to the disk
+#define USER_SLOTS 65536         // User store capacity (power of two)
+#define USER_MAX_LOAD (USER_SLOTS / 4 * 3) // Users that can be registered
+#define KDF_SALT_LEN 16          // Random salt bytes per password hash
+#define KDF_KEY_LEN 32           // Derived key bytes stored per password hash
+#define KDF_QUEUE_PER_THREAD 16  // Password hashes admitted per KDF thread before 503s
+#define KDF_BATCH 8              // Most jobs a KDF thread takes per wakeup
+#define KDF_NICE 10              // Scheduling priority of KDF threads, below request handling
+#define FORM_QUEUE_MAX 65536     // Form submissions waiting for the writer before 503s
+#define FORM_LINE_MAX 768        // Longest form_data.txt line (name and message are bounded)
+#define FORM_BATCH_BYTES (64 * 1024) // Form lines appended per write()
+#define ACCESS_RING_SLOTS 4096   // Access log records buffered per thread (power of two)
+#define ACCESS_URL_MAX 200       // Request target bytes kept in an access log record
+#define ACCESS_FLUSH_MS 50       // How often the access log flusher drains the rings
+#define ACCESS_BATCH_BYTES (256 * 1024) // Access log bytes appended per write()
+#define METRIC_BLOCKS 256        // Per-thread metrics blocks in shared memory
+#define HIST_SUB_BITS 4          // Latency histogram precision: 16 buckets per power of two
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP 40          // Largest power of two told apart (~18 minutes in ns)
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 2) * HIST_SUB)
+#define ACCESS_LINE_MAX (ACCESS_URL_MAX * 6 + 320) // Longest JSON line of one record, fully escaped
+#define ACCESS_DROPPED_MAX 64    // Longest {"ts":..,"dropped":N} line
+#define SESSION_SHARDS 64        // Independently locked slices of the session table (power of two)
+#define SESSION_SHARD_SLOTS 512  // Sessions per shard (power of two), at most 3/4 used
+#define SESSION_ID_LEN 16        // Random bytes identifying a session
+#define SESSION_TOKEN_LEN (SESSION_ID_LEN * 4) // Hex id and hex truncated HMAC in the cookie
+#define SESSION_MAX_AGE (7 * 24 * 3600) // Seconds a session lasts however active it is
+#define SESSION_COOKIE "sid"
+#define CACHE_MAX_ENTRY (CACHE_MIN_BLOCK << (CACHE_CLASSES - 1)) // Larger files go through sendfile()
+#define MAX_RANGES 16            // Ranges honoured in one Range header
+#define MAX_MULTIRANGE_BYTES (1024 * 1024) // Largest multipart/byteranges body assembled in memory
+#define BYTERANGES_BOUNDARY "httpd_c_byteranges_7f3a91"
+#define SLAB_SIZE (16 * 1024)    // Unit of request-scoped memory handed out by the slab pool
+#define SLAB_POOL_MAX (16 * 1024 * 1024) // Free slabs kept for reuse, per process
 
-struct sHttpreq {
-    char method[8];
-    char url[128];
+#define MAX_HEADERS 64           // Header fields kept per request
+#define BODY_CHUNK 4096          // Request body bytes read and consumed per step
+#define MAX_BODY_RULES 16        // Per-path request body limits
+
+_Static_assert(MAX_REQUEST_SIZE <= 65535, "request offsets are stored in 16 bits");
+
+// A (pointer, length) view into the request buffer; not NUL-terminated.
+struct str_view {
+    const char *p;
+    size_t len;
+};
+
+// Where a token sits in the request buffer. Offsets rather than pointers,
+// because rbuf may be reallocated while the headers are still arriving.
+struct span {
+    unsigned short off;
+    unsigned short len;
+};
+
+// Headers the server acts on. The parser records where each one is, so
+// looking one up is an array index rather than a scan.
+enum known_header {
+    HDR_HOST,
+    HDR_CONNECTION,
+    HDR_CONTENT_LENGTH,
+    HDR_CONTENT_TYPE,
+    HDR_TRANSFER_ENCODING,
+    HDR_ACCEPT_ENCODING,
+    HDR_RANGE,
+    HDR_IF_RANGE,
+    HDR_IF_NONE_MATCH,
+    HDR_IF_MODIFIED_SINCE,
+    HDR_COOKIE,
+    NKNOWN_HEADERS
+};
+
+// States of the incremental request parser.
+enum parse_state {
+    PARSE_METHOD,
+    PARSE_TARGET,
+    PARSE_VERSION,
+    PARSE_LINE_LF,      // Saw the CR ending the request line
+    PARSE_FIELD_START,  // At the start of a header line or the blank line
+    PARSE_NAME,
+    PARSE_VALUE_START,  // Skipping whitespace after the colon
+    PARSE_VALUE,
+    PARSE_FIELD_LF,     // Saw the CR ending a header line
+    PARSE_END_LF,       // Saw the CR of the blank line
+    PARSE_DONE
+};
+
+struct http_field {
+    struct span name;
+    struct span value;
+};
+
+// A request head parsed in place. http_parse() can be called again whenever
+// more bytes arrive and picks up where it stopped, so every byte is looked
+// at once no matter how the request was split across reads.
+struct http_request {
+    enum parse_state state;
+    unsigned short pos;       // Next byte to look at
+    unsigned short mark;      // Start of the token being scanned
+    unsigned short header_len; // Length of the head including the blank line, once done
+    struct span method;
+    struct span target;
+    struct span version;
+    long content_length;      // -1 if absent
+    int nfields;
+    unsigned char known[NKNOWN_HEADERS]; // Index + 1 into fields[], 0 if absent
+    struct http_field fields[MAX_HEADERS];
 };
-typedef struct sHttpreq httpreq;
 
 struct sFile {
     char filename[64];
@@ -42,611 +196,7471 @@ struct FormData {
     char name[MAX_USERNAME_LEN];
     char message[512];
     char username[MAX_USERNAME_LEN];
-    char password[MAX_PASSWORD_LEN]
+    char password[MAX_PASSWORD_LEN];
 };
 
-// Global error message buffer.
-// Note: In a real-world, multi-threaded server, this would be unsafe.
-// For a multi-process server using fork(), each process gets its own copy, so it's safe.
-char error_msg[256];
+// When the form writer syncs form_data.txt, and when a submission is answered.
+enum form_sync {
+    FORM_SYNC_OFF,     // Never synced; answered once queued
+    FORM_SYNC_BATCH,   // Each batch is synced; answered once queued
+    FORM_SYNC_DURABLE  // Each batch is synced; answered once its batch is on disk
+};
 
-/**
- * A basic, non-cryptographic password hashing function for demonstration purposes.
- * In a real-world application, you would use a dedicated library like OpenSSL
- * with a strong hashing algorithm and salt.
- * This function just takes the first 64 characters of the password and converts it
- * to a simple representation to illustrate the concept.
- *
- * @param password The password string to hash.
- * @param output The buffer to store the hash. Must be at least HASH_LEN long.
- */
-void hash_password(const char* password, char* output) {
-    // This is a placeholder. A real implementation would use a library like OpenSSL.
-    // For now, we'll just copy the password (for illustration) or a simple hash.
-    strncpy(output, password, HASH_LEN - 1);
-    output[HASH_LEN - 1] = '\0';
-}
+// Runtime settings, filled in from the command line by main().
+struct server_config {
+    int keepalive_timeout; // Seconds an idle connection is kept open
+    int keepalive_max;     // Requests served on one connection before closing it
+    size_t cache_bytes;    // Size of the shared static file cache, 0 disables it
+    int kdf_threads;       // Password hashing threads per process, 0 picks from the CPU count
+    int kdf_cost;          // scrypt cost as log2(N)
+    int session_idle;      // Seconds of inactivity after which a session ends
+    int form_sync;         // When form submissions are synced and acknowledged (enum form_sync)
+    const char *access_log; // Access log path, NULL if disabled
+    off_t log_max_bytes;   // Rotate the access log once it is this large, 0 never
+    int log_rotate_secs;   // Rotate the access log at multiples of this interval, 0 never
+    const char *metrics_path; // Request path answered with the metrics page, NULL if disabled
+    long body_max;         // Largest request body accepted on paths without a -B rule
+};
 
+struct server_config config = {
+    .keepalive_timeout = 5,
+    .keepalive_max = 100,
+    .kdf_cost = 15,
+    .session_idle = 30 * 60,
+    .form_sync = FORM_SYNC_BATCH,
+    .access_log = ".access.jsonl",
+    .log_max_bytes = 64 * 1024 * 1024,
+    .log_rotate_secs = 24 * 3600,
+    .metrics_path = "/metrics",
+    .body_max = 1024 * 1024,
+    .cache_bytes = 64 * 1024 * 1024,
+};
 
-// Helper function to decode URL-encoded characters.
-// It converts characters like %20 to spaces.
-void urldecode(char *dst, const char *src) {
-    char a, b;
-    while (*src) {
-        if (*src == '%') {
-            if (sscanf(src + 1, "%2hhx", &a) == 1) {
-                *dst++ = a;
-                src += 3;
-            } else {
-                *dst++ = *src++;
-            }
-        } else if (*src == '+') {
-            *dst++ = ' ';
-            src++;
-        } else {
-            *dst++ = *src++;
-        }
+// A block of request-scoped memory. Standard slabs (SLAB_SIZE) are recycled
+// through the pool; larger ones are made for a single oversized allocation
+// and freed when released.
+struct slab {
+    struct slab *next;
+    size_t size;      // Usable bytes in data[]
+    char data[] __attribute__((aligned(16)));
+};
+
+// Bump allocator for everything that lives only as long as one request:
+// the response buffer, compression buffers, files read for a response.
+// arena_release() gives it all back in one step.
+struct arena {
+    struct slab *head; // Slab being carved, newest first
+    size_t used;       // Bytes of head->data handed out
+};
+
+// States of the resumable request/response cycle of a connection.
+enum conn_state {
+    CONN_READING, // Accumulating request bytes
+    CONN_WRITING, // Draining the queued response
+    CONN_WAITING, // Waiting for the KDF pool to hash a password or the form writer to sync
+    CONN_CLOSED   // Finished or failed, ready to be torn down
+};
+
+// Everything a connection needs to survive between two readiness events.
+// The same state machine is driven by a blocking fork()ed child or by the
+// epoll event loop, which keeps tens of thousands of these alive at once.
+struct conn {
+    int fd;
+    enum conn_state state;
+    char *rbuf;        // Request bytes received so far (NUL-terminated)
+    size_t rlen;
+    size_t rcap;
+    struct slab *rslab; // Pool slab holding rbuf, or NULL if rbuf was malloc()ed
+    struct http_request req; // The request being received, parsed in place
+    size_t header_len; // Offset of the body once the headers are complete, 0 before
+    size_t need;       // Request bytes in rbuf once the head is complete (the body is consumed as it arrives)
+    long body_left;    // Body bytes still to be received
+    struct form_stream *form; // Decoder the body streams into (in the arena), or NULL to discard it
+    int reject;        // Status to answer a malformed request with before closing, or 0
+    struct arena arena; // Memory of the request being served
+    char *wbuf;        // Queued response bytes, in the arena
+    size_t wlen;
+    size_t woff;       // Bytes of wbuf already sent
+    const char *bbuf;  // Body sent after wbuf without being copied into it, or NULL
+    size_t blen;
+    size_t boff;       // Bytes of bbuf already sent
+    int file_fd;       // File body to send after wbuf, or -1
+    off_t file_off;    // Next byte of file_fd to send
+    off_t file_end;    // Offset just past the last byte of file_fd to send
+    int use_splice;    // sendfile() refused this file, stream it through the pipe
+    int pipe_fd[2];    // Pipe for the splice() fallback, created on first use
+    size_t pipe_len;   // File bytes sitting in the pipe, not yet on the socket
+    int keep_alive;    // Keep the connection open after the current response
+    int nrequests;     // Requests served on this connection so far
+    time_t last_active; // For idle timeouts in the event loops
+    struct conn *idle_prev, *idle_next; // Position in the event loop's idle list
+    struct cache_entry *cache_pin; // Cache entry bbuf points into, or NULL
+    off_t file_start;  // First byte of file_fd in the response, for the access log
+    uint64_t t_start;  // clock_ns() when the request's first bytes were seen, 0 before
+    uint64_t t_parsed; // clock_ns() when the request was complete
+    uint64_t t_queued; // clock_ns() when its response was queued
+    uint64_t parse_ns; // Time spent in http_parse() on this request
+    uint64_t lookup_ns; // Time spent finding the static file, 0 if none was looked up
+    struct in_addr peer; // Client address, looked up for the first logged request
+    unsigned short peer_port;
+    int have_peer;
+    int pool_released; // Thread pool: its thread has let go of the CONN_WAITING connection
+};
+
+// Connections of an event loop ordered by last activity, oldest first, so
+// idle timeouts are found without scanning every connection.
+struct conn_list {
+    struct conn *head;
+    struct conn *tail;
+};
+
+// Error message buffer.
+// Thread-local so the thread-pool mode can report errors without threads
+// clobbering each other; forked processes each get their own copy anyway.
+__thread char error_msg[256];
+
+// Set by the long-lived serving loops (epoll, io_uring, the thread pool).
+// Without one, as in a fork-mode child that serves a single connection and
+// exits, helpers are not worth a thread: records are written and passwords
+// hashed on the calling thread.
+int event_loop = 0;
+
+// eventfd of this process's event loop, -1 if there is none. Helpers that
+// finish work for a parked connection (the KDF pool, the form writer) queue
+// it on their own done list and then signal this.
+int loop_done_fd = -1;
+
+/**
+ * Creates the event loop's completion eventfd: from now on logins and synced
+ * form posts do not wait on the request path but park the connection.
+ * @param flags EFD_NONBLOCK for readiness-based loops, 0 for io_uring.
+ * @return The eventfd, or -1 (submitters then wait, error_msg is set).
+ */
+int loop_done_attach(int flags) {
+    loop_done_fd = eventfd(0, EFD_CLOEXEC | flags);
+    if (loop_done_fd < 0) {
+        snprintf(error_msg, sizeof(error_msg), "eventfd() error: %s\n", strerror(errno));
     }
-    *dst = '\0';
+    return loop_done_fd;
 }
 
 /**
- * Parses URL-encoded form data, specifically for username and password.
- * This is a simplified version for this step.
- * @param body_data The raw URL-encoded string.
- * @return A new FormData struct with parsed data.
+ * Wakes the event loop to collect finished work.
  */
-struct FormData parse_user_data(char *body_data){
-struct FormData data;
+void loop_done_signal(void) {
+    uint64_t one = 1;
 
-memset(&data,0, sizeof(data));
+    if (write(loop_done_fd, &one, sizeof(one)) < 0) perror("eventfd write() failed");
+}
+
+// Bytes allowed in a request target: visible ASCII.
+static const unsigned char target_char[256] = {
+    [0x21 ... 0x7e] = 1,
+};
 
-char* username_start = strstr(body_data,"username=");
-char* password_start = strstr(body_data,"password=");
+// Bytes allowed in a header value: tab, visible ASCII and obs-text.
+static const unsigned char value_char[256] = {
+    ['\t'] = 1, [0x20 ... 0x7e] = 1, [0x80 ... 0xff] = 1,
+};
 
-if(username_start){
-char *username_end;
-username_start += strlen("username=");
-username_end = strchr(username_start,'&');
+// Byte-scanning kernels used on the request path. Each returns the index of
+// the first byte that stops the scan, or len if there is none. simd_init()
+// picks the widest implementation the CPU supports; until then (and on
+// non-x86 builds) the scalar ones are used.
+struct scan_kernels {
+    const char *name;
+    size_t (*target)(const char *p, size_t len);  // Space, control or non-ASCII byte
+    size_t (*value)(const char *p, size_t len);   // Control byte other than tab (so CR ends a value)
+    size_t (*form)(const char *p, size_t len);    // '%' or '+' in a urlencoded string
+    size_t (*delim)(const char *p, size_t len);   // '&' or '=' in a urlencoded string
+};
 
-if(username_end){
-size_t username_len = username_end - username_start;
-strncpy(data.username,username_start , username_len > sizeof(data.username)-1 ? sizeof(data.username)-1: username_len);
-data.username[username_len > sizeof(data.username)-1 ? sizeof(data.username)-1:username_len] ='\0';
-}else{
-    strncpy(data.username, username_start,sizeof(data.username)-1);
-    data.username[sizeof(data.username)-1] ='/0';
+size_t scan_target_scalar(const char *p, size_t len) {
+    size_t i = 0;
+    while (i < len && target_char[(unsigned char)p[i]]) i++;
+    return i;
 }
+
+size_t scan_value_scalar(const char *p, size_t len) {
+    size_t i = 0;
+    while (i < len && value_char[(unsigned char)p[i]]) i++;
+    return i;
 }
 
-if(password_start){
- char *password_end; 
- password_start += strlen("password=");
- password_end = strch(password_end,'&');
- if(password_end){
+size_t scan_form_scalar(const char *p, size_t len) {
+    size_t i = 0;
+    while (i < len && p[i] != '%' && p[i] != '+') i++;
+    return i;
+}
 
-size_t password_len = password_end - password_start;
+size_t scan_delim_scalar(const char *p, size_t len) {
+    size_t i = 0;
+    while (i < len && p[i] != '&' && p[i] != '=') i++;
+    return i;
+}
 
-strncpy(data.password, password_start, password_len > sizeof(data.password)-1 ? sizeof(data.password)-1 : password_len);
-data.password[password_len > sizeof(password_start)-1 ? sizeof(password_start)-1 : password_len]='/0';
+#ifdef HAVE_X86_SIMD
+// Signed byte compares do the range checks: bytes >= 0x80 are negative, so
+// "below 0x21" also catches non-ASCII in a target, and "not negative and
+// below 0x20" singles out control bytes in a value.
 
- }  else{
-   strncpy(data.password , password_start, sizeof(password_start)-1);
-   data.password[sizeof(data.password)-1] = '/0';
- }
-}
+size_t scan_target_sse2(const char *p, size_t len) {
+    const __m128i lo = _mm_set1_epi8(0x21), del = _mm_set1_epi8(0x7f);
+    size_t i;
 
-urldecode(username_start,data.username);
-urldecode(password_start,data.password);
-return data;
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        int m = _mm_movemask_epi8(_mm_or_si128(_mm_cmplt_epi8(v, lo), _mm_cmpeq_epi8(v, del)));
+        if (m) return i + __builtin_ctz(m);
+    }
+    return i + scan_target_scalar(p + i, len - i);
 }
 
+size_t scan_value_sse2(const char *p, size_t len) {
+    const __m128i neg = _mm_set1_epi8(-1), sp = _mm_set1_epi8(0x20);
+    const __m128i tab = _mm_set1_epi8('\t'), del = _mm_set1_epi8(0x7f);
+    size_t i;
 
-/**
- * Checks if a username already exists in the users.txt file.
- * @param username The username to check.
- * @return 1 if the user exists, 0 otherwise.
- */
-int user_exists(const char* username) {
-    FILE* fp = fopen("users.txt", "r");
-    if (!fp) {
-        perror("user_exist():File not open in \n");
-        return 0; // File doesn't exist yet, so no users exist.
-    }
-    char line[512];
-    while (fgets(line, sizeof(line), fp)) {
-        char stored_username[MAX_USERNAME_LEN];
-        char* colon = strchr(line, ':');
-        if (colon) {
-            size_t len = colon - line;
-            if (len < MAX_USERNAME_LEN) {
-                strncpy(stored_username, line, len);
-                stored_username[len] = '\0';
-                if (strcmp(stored_username, username) == 0) {
-                    fclose(fp);
-                    return 1;
-                }
-            }
-        }
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i ctl = _mm_and_si128(_mm_cmpgt_epi8(v, neg), _mm_cmplt_epi8(v, sp));
+        ctl = _mm_andnot_si128(_mm_cmpeq_epi8(v, tab), ctl);
+        int m = _mm_movemask_epi8(_mm_or_si128(ctl, _mm_cmpeq_epi8(v, del)));
+        if (m) return i + __builtin_ctz(m);
     }
-    fclose(fp);
-    return 0;
+    return i + scan_value_scalar(p + i, len - i);
 }
 
-/**
- * Registers a new user by appending their username and hashed password to users.txt.
- * @param username The new user's username.
- * @param password The new user's password (will be hashed).
- * @return 1 on success, 0 on failure.
- */
-int register_user(const char* username, const char* password) {
-    if (user_exists(username)) {
-        return 0; // User already exists
-    }
+size_t scan_form_sse2(const char *p, size_t len) {
+    const __m128i pct = _mm_set1_epi8('%'), plus = _mm_set1_epi8('+');
+    size_t i;
 
-    FILE* fp = fopen("users.txt", "a");
-    if (!fp) {
-        perror("Error opening users.txt for writing");
-        return 0;
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        int m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, pct), _mm_cmpeq_epi8(v, plus)));
+        if (m) return i + __builtin_ctz(m);
     }
-    
-    char hashed_password[HASH_LEN];
-    hash_password(password, hashed_password);
-    
-    fprintf(fp, "%s:%s\n", username, hashed_password);
-    fclose(fp);
-    return 1;
+    return i + scan_form_scalar(p + i, len - i);
 }
 
-/**
- * Authenticates a user by checking their credentials against users.txt.
- * @param username The username to authenticate.
- * @param password The password to authenticate (will be hashed).
- * @return 1 on successful authentication, 0 otherwise.
- */
-int authenticate_user(const char* username, const char* password) {
-    FILE* fp = fopen("users.txt", "r");
-    if (!fp) {
-        return 0; // No user file, so no users can be authenticated.
-    }
-    
-    char line[512];
-    char hashed_password[HASH_LEN];
-    hash_password(password, hashed_password);
-    
-    while (fgets(line, sizeof(line), fp)) {
-        char stored_username[MAX_USERNAME_LEN];
-        char stored_hash[HASH_LEN];
-        
-        char* colon = strchr(line, ':');
-        if (colon) {
-            size_t len = colon - line;
-            if (len < MAX_USERNAME_LEN) {
-                strncpy(stored_username, line, len);
-                stored_username[len] = '\0';
-                
-                char* newline = strchr(colon + 1, '\n');
-                if (newline) *newline = '\0';
-                strncpy(stored_hash, colon + 1, HASH_LEN - 1);
-                
-                if (strcmp(stored_username, username) == 0 && strcmp(stored_hash, hashed_password) == 0) {
-                    fclose(fp);
-                    return 1;
-                }
-            }
-        }
+size_t scan_delim_sse2(const char *p, size_t len) {
+    const __m128i amp = _mm_set1_epi8('&'), eq = _mm_set1_epi8('=');
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        int m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, eq)));
+        if (m) return i + __builtin_ctz(m);
     }
-    fclose(fp);
-    return 0;
+    return i + scan_delim_scalar(p + i, len - i);
 }
 
+__attribute__((target("avx2")))
+size_t scan_target_avx2(const char *p, size_t len) {
+    const __m256i lo = _mm256_set1_epi8(0x21), del = _mm256_set1_epi8(0x7f);
+    size_t i;
 
-/**
- * Initializes the server socket.
- * @param portno The port number to listen on.
- * @return The server socket file descriptor, or 0 on error.
- */
-int serv_init(int portno) {
-    int sockfd;
-    struct sockaddr_in serv_addr;
-
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        snprintf(error_msg, sizeof(error_msg), "Socket() error: %s\n", strerror(errno));
-        return 0;
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        unsigned m = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpgt_epi8(lo, v), _mm256_cmpeq_epi8(v, del)));
+        if (m) return i + __builtin_ctz(m);
     }
+    return i + scan_target_sse2(p + i, len - i);
+}
 
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(portno);
-    serv_addr.sin_addr.s_addr = inet_addr(LISTENADDRESS);
+__attribute__((target("avx2")))
+size_t scan_value_avx2(const char *p, size_t len) {
+    const __m256i neg = _mm256_set1_epi8(-1), sp = _mm256_set1_epi8(0x20);
+    const __m256i tab = _mm256_set1_epi8('\t'), del = _mm256_set1_epi8(0x7f);
+    size_t i;
 
-    if (bind(sockfd, (const struct sockaddr *)&serv_addr, sizeof(serv_addr))) {
-        snprintf(error_msg, sizeof(error_msg), "Bind() error: %s\n", strerror(errno));
-        close(sockfd);
-        return 0;
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i ctl = _mm256_and_si256(_mm256_cmpgt_epi8(v, neg), _mm256_cmpgt_epi8(sp, v));
+        ctl = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, tab), ctl);
+        unsigned m = _mm256_movemask_epi8(_mm256_or_si256(ctl, _mm256_cmpeq_epi8(v, del)));
+        if (m) return i + __builtin_ctz(m);
     }
+    return i + scan_value_sse2(p + i, len - i);
+}
 
-    if (listen(sockfd, 5)) {
-        snprintf(error_msg, sizeof(error_msg), "Listen() error: %s\n", strerror(errno));
-        close(sockfd);
-        return 0;
+__attribute__((target("avx2")))
+size_t scan_form_avx2(const char *p, size_t len) {
+    const __m256i pct = _mm256_set1_epi8('%'), plus = _mm256_set1_epi8('+');
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        unsigned m = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, pct), _mm256_cmpeq_epi8(v, plus)));
+        if (m) return i + __builtin_ctz(m);
     }
+    return i + scan_form_sse2(p + i, len - i);
+}
 
-    return sockfd;
+__attribute__((target("avx2")))
+size_t scan_delim_avx2(const char *p, size_t len) {
+    const __m256i amp = _mm256_set1_epi8('&'), eq = _mm256_set1_epi8('=');
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        unsigned m = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, amp), _mm256_cmpeq_epi8(v, eq)));
+        if (m) return i + __builtin_ctz(m);
+    }
+    return i + scan_delim_sse2(p + i, len - i);
 }
+#endif
+
+// Every implementation, narrowest first; benchmarks run them side by side.
+const struct scan_kernels scan_impls[] = {
+    {"scalar", scan_target_scalar, scan_value_scalar, scan_form_scalar, scan_delim_scalar},
+#ifdef HAVE_X86_SIMD
+    {"sse2", scan_target_sse2, scan_value_sse2, scan_form_sse2, scan_delim_sse2},
+    {"avx2", scan_target_avx2, scan_value_avx2, scan_form_avx2, scan_delim_avx2},
+#endif
+};
+
+struct scan_kernels scan = {"scalar", scan_target_scalar, scan_value_scalar, scan_form_scalar, scan_delim_scalar};
 
 /**
- * Accepts a new client connection.
- * @param s The server socket file descriptor.
- * @return The client socket file descriptor, or 0 on error.
+ * Checks whether the CPU can run an implementation from scan_impls[].
  */
-int client_acpt(int s) {
-    int c; // c = client fd
-    struct sockaddr_in cli_addr;
-    socklen_t addrlength = sizeof(cli_addr);
+int scan_supported(const struct scan_kernels *k) {
+#ifdef HAVE_X86_SIMD
+    if (strcmp(k->name, "avx2") == 0) return __builtin_cpu_supports("avx2");
+    if (strcmp(k->name, "sse2") == 0) return __builtin_cpu_supports("sse2");
+#endif
+    return 1;
+}
 
-    memset(&cli_addr, 0, sizeof(cli_addr));
-    c = accept(s, (struct sockaddr *)&cli_addr, &addrlength);
+/**
+ * Selects the widest scanning kernels the CPU supports. Call once at startup.
+ */
+void simd_init(void) {
+    int i;
 
-    if (c < 0) {
-        snprintf(error_msg, sizeof(error_msg), "Accept() error: %s\n", strerror(errno));
-        return 0;
-    }
-    return c;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+#endif
+    for (i = sizeof(scan_impls) / sizeof(scan_impls[0]) - 1; i > 0 && !scan_supported(&scan_impls[i]); i--)
+        ;
+    scan = scan_impls[i];
 }
 
 /**
- * Parses the HTTP request header to find the method and URL.
- * @param str The full request string.
- * @return A new httpreq struct, or NULL on error.
+ * Derives a password's scrypt key and formats it for users.txt as
+ * "$scrypt$ln=<log2 N>,r=<r>,p=<p>$<salt>$<key>", salt and key in base64.
+ * @param password The password.
+ * @param salt KDF_SALT_LEN bytes of salt.
+ * @param ln log2 of the scrypt cost N.
+ * @param r The scrypt block size.
+ * @param p The scrypt parallelism.
+ * @param output The buffer for the formatted hash.
+ * @param size Size of output.
+ * @return 1 on success, 0 if scrypt failed (e.g. not enough memory).
  */
-httpreq *parse_http(char *str) {
-    httpreq *req;
-    char *p = str;
-    
-    req = malloc(sizeof(httpreq));
-    if (req == NULL) {
-        snprintf(error_msg, sizeof(error_msg), "parse_http() error: memory allocation failed");
-        return NULL;
-    }
-    memset(req, 0, sizeof(httpreq));
-
-    // Read method (first word)
-    char *method_end = strchr(p, ' ');
-    if (!method_end) {
-        free(req);
-        return NULL;
-    }
-    int method_len = method_end - p;
-    strncpy(req->method, p, method_len);
-    req->method[method_len] = '\0';
+int kdf_scrypt(const char *password, const unsigned char *salt, int ln, int r, int p, char *output, size_t size) {
+    unsigned char key[KDF_KEY_LEN];
+    unsigned char salt64[(KDF_SALT_LEN + 2) / 3 * 4 + 1], key64[(KDF_KEY_LEN + 2) / 3 * 4 + 1];
+    uint64_t n = (uint64_t)1 << ln;
+    uint64_t maxmem = 128 * (uint64_t)r * (n + p + 2) + (1 << 20); // What scrypt needs, plus slack
 
-    // Read URL (second word)
-    p = method_end + 1;
-    char *url_end = strchr(p, ' ');
-    if (!url_end) {
-        free(req);
-        return NULL;
+    if (!EVP_PBE_scrypt(password, strlen(password), salt, KDF_SALT_LEN, n, r, p, maxmem, key, sizeof(key))) {
+        return 0;
     }
-    int url_len = url_end - p;
-    strncpy(req->url, p, url_len);
-    req->url[url_len] = '\0';
-
-    return req;
+    EVP_EncodeBlock(salt64, salt, KDF_SALT_LEN);
+    EVP_EncodeBlock(key64, key, sizeof(key));
+    OPENSSL_cleanse(key, sizeof(key));
+    return snprintf(output, size, "$scrypt$ln=%d,r=%d,p=%d$%s$%s", ln, r, p, salt64, key64) < (int)size;
 }
 
 /**
- * Reads the entire HTTP request from the client socket.
- * This is crucial for POST requests as it includes the body.
- * It reads until the connection closes or the buffer is full.
- * @param c The client socket file descriptor.
- * @return A dynamically allocated string with the full request, or NULL on error.
+ * Hashes a password with scrypt, a fresh random salt and the configured
+ * cost. Takes tens of milliseconds by design: call it from the KDF pool,
+ * not from an event loop.
+ *
+ * @param password The password string to hash.
+ * @param output The buffer to store the hash. Must be at least HASH_LEN long.
+ * @return 1 on success, 0 on failure.
  */
-// A more robust function to read the full HTTP request. It reads headers first,
-// then uses Content-Length to read the exact body size.
-char *read_full_request(int c) {
-    char *request = NULL;
-    size_t total_size = 0;
-    ssize_t bytes_read;
-    char buffer[4096];
-    char *header_end;
-
-    // Read the request until the header delimiter "\r\n\r\n" is found
-    // or the request size limit is reached.
-    while (1) {
-        bytes_read = recv(c, buffer, sizeof(buffer), 0);
-        if (bytes_read <= 0) {
-            if (request) free(request);
-            return NULL;
-        }
+int hash_password(const char* password, char* output) {
+    unsigned char salt[KDF_SALT_LEN];
 
-        // Reallocate memory for the request buffer
-        char *temp_request = realloc(request, total_size + bytes_read + 1);
-        if (!temp_request) {
-            perror("realloc() failed");
-            if (request) free(request);
-            return NULL;
-        }
-        request = temp_request;
-        memcpy(request + total_size, buffer, bytes_read);
-        total_size += bytes_read;
-        request[total_size] = '\0';
+    if (RAND_bytes(salt, sizeof(salt)) != 1) return 0;
+    return kdf_scrypt(password, salt, config.kdf_cost, 8, 1, output, HASH_LEN);
+}
 
-        header_end = strstr(request, "\r\n\r\n");
-        if (header_end != NULL) {
-            // Found the end of headers, break the loop
-            break;
-        }
+/**
+ * Checks a password against a hash from users.txt, recomputing it with the
+ * salt and cost stored in it. Lines written before passwords were hashed
+ * hold the password itself and are compared as they are; user_upgrade()
+ * replaces them with a hash after a successful login.
+ * @return 1 if the password matches, 0 otherwise.
+ */
+int password_verify(const char *password, const char *stored) {
+    unsigned char salt[KDF_SALT_LEN + 2]; // The decoder also writes out the padding bytes
+    char salt64[32], computed[HASH_LEN];
+    size_t len = strlen(stored);
+    int ln, r, p;
 
-        // Check for request size limit
-        if (total_size >= MAX_REQUEST_SIZE) {
-            fprintf(stderr, "Request size exceeds limit.\n");
-            if (request) free(request);
-            return NULL;
-        }
+    if (strncmp(stored, "$scrypt$", 8) != 0) {
+        return strlen(password) == len && CRYPTO_memcmp(password, stored, len) == 0;
     }
-    
-    // Check if the request is a POST request and has a body
-    char *cl_header = strstr(request, "Content-Length: ");
-    if (cl_header) {
-        int content_length = atoi(cl_header + strlen("Content-Length: "));
-        // Calculate the size of the body data already read with the headers
-        size_t body_start_offset = (header_end - request) + 4;
-        size_t current_body_size = total_size - body_start_offset;
-        int remaining_bytes = content_length - current_body_size;
-        
-        // Read the rest of the body if not all of it was received
-        if (remaining_bytes > 0) {
-            char *temp_request = realloc(request, total_size + remaining_bytes + 1);
-            if (!temp_request) {
-                perror("realloc() failed for body");
-                free(request);
-                return NULL;
-            }
-            request = temp_request;
-            bytes_read = recv(c, request + total_size, remaining_bytes, 0);
-            if (bytes_read > 0) {
-                total_size += bytes_read;
-                request[total_size] = '\0';
-            }
-        }
+    if (sscanf(stored, "$scrypt$ln=%d,r=%d,p=%d$%31[^$]$", &ln, &r, &p, salt64) != 4 || ln < 1 || ln > 30 ||
+        r < 1 || r > 64 || p < 1 || p > 16 || strlen(salt64) != (KDF_SALT_LEN + 2) / 3 * 4 ||
+        EVP_DecodeBlock(salt, (unsigned char *)salt64, strlen(salt64)) != sizeof(salt)) {
+        return 0;
     }
-
-    return request;
+    if (!kdf_scrypt(password, salt, ln, r, p, computed, sizeof(computed))) return 0;
+    return strlen(computed) == len && CRYPTO_memcmp(computed, stored, len) == 0;
 }
 
 
+// Hex digit values, -1 for anything else.
+static const signed char hex_value[256] = {
+    [0 ... 255] = -1,
+    ['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4, ['5'] = 5, ['6'] = 6, ['7'] = 7, ['8'] = 8, ['9'] = 9,
+    ['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15,
+    ['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+};
+
 /**
- * Reads the entire contents of a file into a dynamically allocated struct.
- * @param filename The path to the file to read.
- * @return A pointer to a new File struct, or NULL on error.
+ * Decodes a URL-encoded string: "%XX" escapes and '+' for space. Runs of
+ * plain bytes are found with the scan kernels and copied in bulk; a '%' not
+ * followed by two hex digits is kept as is.
+ * @param dst Output buffer of at least len + 1 bytes; may be src itself.
+ * @param src The encoded bytes.
+ * @param len Length of src.
+ * @return The decoded length (dst is NUL-terminated).
  */
-File *fileread(char *filename) {
-    int n, fd;
-    File *f;
-    
-    f = malloc(sizeof(File));
-    if (f == NULL) {
-        perror("malloc() error for File struct");
-        return NULL;
-    }
-    
-    fd = open(filename, O_RDONLY);
-    if (fd < 0) {
-        perror("open() error");
-        free(f);
-        return NULL;
-    }
-    
-    strncpy(f->filename, filename, sizeof(f->filename) - 1);
-    f->filename[sizeof(f->filename) - 1] = '\0';
+size_t urldecode_n(char *dst, const char *src, size_t len) {
+    size_t i = 0, o = 0;
 
-    f->fc = malloc(1); // Start with a small buffer.
-    f->size = 0;
+    while (i < len) {
+        size_t run = 0;
 
-    char temp_buf[512];
-    while ((n = read(fd, temp_buf, sizeof(temp_buf))) > 0) {
-        void *realloc_ptr = realloc(f->fc, f->size + n);
-        if (realloc_ptr == NULL) {
-            perror("realloc() error");
-            close(fd);
-            free(f->fc);
-            free(f);
-            return NULL;
+        // Short runs between escapes are common; only call the kernel for long ones.
+        while (run < 8 && i + run < len && src[i + run] != '%' && src[i + run] != '+') run++;
+        if (run == 8) run += scan.form(src + i + 8, len - i - 8);
+        if (run) {
+            memmove(dst + o, src + i, run);
+            o += run;
+            i += run;
+        }
+        // Decode a whole burst of escapes here: UTF-8 text is mostly escapes,
+        // and a kernel call per escape would cost more than it saves.
+        while (i < len && (src[i] == '%' || src[i] == '+')) {
+            if (src[i] == '+') {
+                dst[o++] = ' ';
+                i++;
+            } else if (i + 2 < len && hex_value[(unsigned char)src[i + 1]] >= 0 &&
+                       hex_value[(unsigned char)src[i + 2]] >= 0) {
+                dst[o++] = hex_value[(unsigned char)src[i + 1]] << 4 | hex_value[(unsigned char)src[i + 2]];
+                i += 3;
+            } else {
+                dst[o++] = src[i++];
+            }
         }
-        f->fc = realloc_ptr;
-        memcpy(f->fc + f->size, temp_buf, n);
-        f->size += n;
-    }
-
-    if (n < 0) {
-        perror("read() error");
-        close(fd);
-        free(f->fc);
-        free(f);
-        return NULL;
     }
+    dst[o] = '\0';
+    return o;
+}
 
-    close(fd);
-    f->fc[f->size] = '\0'; // Null-terminate
-    
-    return f;
+// Helper function to decode URL-encoded characters.
+// It converts characters like %20 to spaces.
+void urldecode(char *dst, const char *src) {
+    urldecode_n(dst, src, strlen(src));
 }
 
+// A urlencoded body decoded while it streams in, one chunk at a time. The
+// fields the server knows are kept, decoded and truncated to fit; everything
+// else is skipped, so memory stays the same however long the body is. An
+// escape cut off by the end of a chunk is held back until the next one.
+struct form_stream {
+    struct FormData data;
+    char key[8];          // Start of the key being read; known keys fit
+    size_t key_len;       // Full length of that key
+    int in_value;         // Past the '=' of the current pair
+    char *field;          // Field the current value is decoded into, or NULL to skip it
+    size_t field_size;
+    size_t field_len;     // Decoded bytes stored so far
+    int full;             // The value did not fit; the rest of it is skipped
+    char esc[2];          // "%" or "%X" held back from the end of the last chunk
+    int nesc;
+};
+
+void form_stream_init(struct form_stream *fs) {
+    memset(fs, 0, sizeof(*fs));
+}
 
 /**
- * Sends the HTTP status line, headers, and data to the client.
- * @param c The client socket file descriptor.
- * @param code The HTTP status code.
- * @param contentType The Content-Type header value.
- * @param data The response body.
- * @param data_length The size of the response body in bytes.
+ * Picks the field for the value that follows the key just read.
  */
-void http_send_response(int c, int code, const char *contentType, const char *data, int data_length) {
-    char header_buf[1024];
-    int n;
+void form_stream_select(struct form_stream *fs) {
+    struct FormData *d = &fs->data;
 
-    snprintf(header_buf, sizeof(header_buf) - 1,
-        "HTTP/1.0 %d OK\r\n"
-        "Server: httpd.c\r\n"
-        "Content-Type: %s\r\n"
-        "Content-Length: %d\r\n"
-        "\r\n", // The crucial blank line
-        code, contentType, data_length
-    );
-
-    n = strlen(header_buf);
-    write(c, header_buf, n);
-    write(c, data, data_length); 
+    fs->field = NULL;
+    if (fs->key_len == 4 && memcmp(fs->key, "name", 4) == 0) {
+        fs->field = d->name;
+        fs->field_size = sizeof(d->name);
+    } else if (fs->key_len == 7 && memcmp(fs->key, "message", 7) == 0) {
+        fs->field = d->message;
+        fs->field_size = sizeof(d->message);
+    } else if (fs->key_len == 8 && memcmp(fs->key, "username", 8) == 0) {
+        fs->field = d->username;
+        fs->field_size = sizeof(d->username);
+    } else if (fs->key_len == 8 && memcmp(fs->key, "password", 8) == 0) {
+        fs->field = d->password;
+        fs->field_size = sizeof(d->password);
+    }
+    fs->field_len = 0;
+    fs->full = 0;
+    fs->nesc = 0;
 }
 
 /**
- * Determines the Content-Type based on a file extension.
- * @param path The file path.
- * @return A string containing the correct MIME type.
+ * Stores one decoded byte, or marks the value as too long for its field.
  */
-const char *get_content_type(const char *path) {
-    const char *extension = strrchr(path, '.');
-    if (extension == NULL) {
-        return "text/plain";
-    }
-
-    if (strcmp(extension, ".html") == 0 || strcmp(extension, ".htm") == 0) return "text/html";
-    if (strcmp(extension, ".css") == 0) return "text/css";
-    if (strcmp(extension, ".js") == 0) return "application/javascript";
-    if (strcmp(extension, ".jpeg") == 0 || strcmp(extension, ".jpg") == 0) return "image/jpeg";
-    if (strcmp(extension, ".png") == 0) return "image/png";
-    if (strcmp(extension, ".gif") == 0) return "image/gif";
-    if (strcmp(extension, ".mp4") == 0) return "video/mp4";
-    
-    return "text/plain";
+static inline void form_stream_put(struct form_stream *fs, char c) {
+    if (fs->field_len < fs->field_size - 1) fs->field[fs->field_len++] = c;
+    else fs->full = 1;
 }
 
 /**
- * The main handler for a client connection.
- * @param c The client socket file descriptor.
+ * Decodes the next piece of the current value into its field.
+ * @param fs The decoder.
+ * @param p Value bytes, without any '&'.
+ * @param len Number of bytes.
+ * @param last Whether the value ends here; otherwise a trailing incomplete
+ *        escape is held back for the next piece.
  */
-void cli_conn(int c) {
-    httpreq *req;
-    char *full_request_data;
-    File *f;
-    const char *res;
+void form_stream_value(struct form_stream *fs, const char *p, size_t len, int last) {
+    size_t i = 0, hold = 0;
 
-    // Read the entire request, including headers and potential body.
-    full_request_data = read_full_request(c);
+    if (fs->field == NULL || fs->full) return;
 
-    if (!full_request_data) {
-        fprintf(stderr, "Error reading request.\n");
-        close(c);
-        return;
+    if (fs->nesc) {
+        // Complete the escape the previous piece ended with.
+        size_t need = 3 - fs->nesc;
+        char h1, h2;
+
+        if (len < need && !last) {
+            if (len && p[0] == '%') {
+                form_stream_put(fs, '%'); // "%%": only the second one can start an escape
+                return;
+            }
+            memcpy(fs->esc + fs->nesc, p, len);
+            fs->nesc += len;
+            return;
+        }
+        if (len >= need) {
+            h1 = fs->nesc == 2 ? fs->esc[1] : p[0];
+            h2 = fs->nesc == 2 ? p[0] : p[1];
+            if (hex_value[(unsigned char)h1] >= 0 && hex_value[(unsigned char)h2] >= 0) {
+                form_stream_put(fs, hex_value[(unsigned char)h1] << 4 | hex_value[(unsigned char)h2]);
+                p += need;
+                len -= need;
+                fs->nesc = 0;
+            }
+        }
+        if (fs->nesc) {
+            // Not an escape after all: the '%' and the byte after it are plain.
+            form_stream_put(fs, '%');
+            if (fs->nesc == 2) form_stream_put(fs, fs->esc[1] == '+' ? ' ' : fs->esc[1]);
+            fs->nesc = 0;
+        }
     }
-    
-    // Parse the request headers.
-    req = parse_http(full_request_data);
-    if (!req) {
-        fprintf(stderr, "Error parsing request: %s\n", error_msg);
-        free(full_request_data);
-        close(c);
-        return;
+    if (!last) {
+        if (len >= 1 && p[len - 1] == '%') hold = 1;
+        else if (len >= 2 && p[len - 2] == '%') hold = 2;
+        memcpy(fs->esc, p + len - hold, hold);
+        fs->nesc = hold;
+        len -= hold;
     }
 
-    //printf("Method: %s, URL: %s\n", req->method, req->url);
+    while (i < len && !fs->full) {
+        size_t run = 0, room = fs->field_size - 1 - fs->field_len;
 
-    if (strcmp(req->method, "GET") == 0) {
+        while (run < 8 && i + run < len && p[i + run] != '%' && p[i + run] != '+') run++;
+        if (run == 8) run += scan.form(p + i + 8, len - i - 8);
+        if (run > room) {
+            run = room;
+            fs->full = 1;
+        }
+        memcpy(fs->field + fs->field_len, p + i, run);
+        fs->field_len += run;
+        i += run;
+        if (fs->full || i == len) break;
+        if (p[i] == '+') {
+            form_stream_put(fs, ' ');
+            i++;
+        } else if (i + 2 < len && hex_value[(unsigned char)p[i + 1]] >= 0 && hex_value[(unsigned char)p[i + 2]] >= 0) {
+            form_stream_put(fs, hex_value[(unsigned char)p[i + 1]] << 4 | hex_value[(unsigned char)p[i + 2]]);
+            i += 3;
+        } else {
+            form_stream_put(fs, p[i++]);
+        }
+    }
+    if (fs->full) fs->nesc = 0;
+}
+
+/**
+ * Ends the current key=value pair and terminates its field. A value cut
+ * short also loses a UTF-8 sequence left incomplete by the cut.
+ */
+void form_stream_end_pair(struct form_stream *fs) {
+    if (fs->in_value && fs->field) {
+        form_stream_value(fs, "", 0, 1);
+        if (fs->full) {
+            size_t k = fs->field_len, want;
+            unsigned char lead;
+
+            while (k > 0 && fs->field_len - k < 4 && ((unsigned char)fs->field[k - 1] & 0xC0) == 0x80) k--;
+            if (k > 0) {
+                lead = fs->field[k - 1];
+                want = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : lead >= 0xC0 ? 2 : 1;
+                if (fs->field_len - (k - 1) < want) fs->field_len = k - 1;
+            }
+        }
+        fs->field[fs->field_len] = '\0';
+    }
+    fs->in_value = 0;
+    fs->field = NULL;
+    fs->key_len = 0;
+}
+
+/**
+ * Consumes the next piece of a urlencoded body. Pieces may be cut anywhere.
+ * @param fs The decoder.
+ * @param p The bytes.
+ * @param len Number of bytes.
+ */
+void form_stream_feed(struct form_stream *fs, const char *p, size_t len) {
+    const char *end = p + len;
+
+    while (p < end) {
+        if (!fs->in_value) {
+            size_t run = scan.delim(p, end - p);
+
+            if (fs->key_len < sizeof(fs->key)) {
+                size_t room = sizeof(fs->key) - fs->key_len;
+                memcpy(fs->key + fs->key_len, p, run < room ? run : room);
+            }
+            fs->key_len += run;
+            p += run;
+            if (p == end) break;
+            if (*p++ == '=') {
+                form_stream_select(fs);
+                fs->in_value = 1;
+            } else {
+                fs->key_len = 0; // A key without a value
+            }
+        } else {
+            const char *amp = memchr(p, '&', end - p);
+            size_t run = (amp ? amp : end) - p;
+
+            form_stream_value(fs, p, run, amp != NULL);
+            p += run;
+            if (amp) {
+                form_stream_end_pair(fs);
+                p++;
+            }
+        }
+    }
+}
+
+/**
+ * Ends the body: the last value has no '&' after it.
+ */
+void form_stream_finish(struct form_stream *fs) {
+    form_stream_end_pair(fs);
+}
+
+/**
+ * Parses URL-encoded form data: splits the body on '&' and '=' and decodes
+ * the fields the server knows (name, message, username, password).
+ * @param body_data The raw URL-encoded string.
+ * @return A new FormData struct with parsed data.
+ */
+struct FormData parse_user_data(char *body_data){
+    struct form_stream fs;
+
+    form_stream_init(&fs);
+    form_stream_feed(&fs, body_data, strlen(body_data));
+    form_stream_finish(&fs);
+    return fs.data;
+}
+
+
+// One registered user. Entries are written once, before their hash is
+// published; only pw_hash changes afterwards, when a legacy plaintext line is
+// upgraded, and readers copy it out under the seqlock `seq`.
+struct user_entry {
+    unsigned hash;      // 0 marks a free slot
+    unsigned seq;       // Odd while pw_hash is being rewritten
+    char name[MAX_USERNAME_LEN];
+    char pw_hash[HASH_LEN];
+};
+
+// Every user in users.txt, by name, in shared memory so all workers see the
+// same set. Loaded once before workers are forked. Registrations take the
+// writer lock, append to users.txt and fsync it, and only then publish the
+// entry; lookups probe without locking. Open addressing with linear probing,
+// insert-only, at most 3/4 full.
+struct user_store {
+    pthread_mutex_t lock; // Serializes registrations across processes
+    int count;
+    unsigned file_gen;    // Bumped whenever users.txt is replaced by a rewrite
+    struct user_entry slots[USER_SLOTS];
+};
+
+struct user_store *users = NULL;
+int users_fd = -1;      // users.txt, opened for appending
+unsigned users_fd_gen;  // The file_gen users_fd was opened at
+
+unsigned user_hash(const char *name) {
+    unsigned h = 2166136261u; // FNV-1a
+
+    while (*name) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return h ? h : 1;
+}
+
+/**
+ * Finds a user, or the free slot where they would go.
+ * @param name The username.
+ * @param hash user_hash(name).
+ * @return The entry; its hash is 0 if the user does not exist, and NULL
+ *         only if the table is full and the user is not in it.
+ */
+struct user_entry *user_probe(const char *name, unsigned hash) {
+    int i, n;
+
+    for (i = hash & (USER_SLOTS - 1), n = 0; n < USER_SLOTS; i = (i + 1) & (USER_SLOTS - 1), n++) {
+        struct user_entry *e = &users->slots[i];
+        unsigned h = __atomic_load_n(&e->hash, __ATOMIC_ACQUIRE); // Pairs with the store in user_publish()
+
+        if (h == 0 || (h == hash && strcmp(e->name, name) == 0)) return e;
+    }
+    return NULL;
+}
+
+/**
+ * Fills a free slot and makes it visible to readers. Writer side only.
+ */
+void user_publish(struct user_entry *e, unsigned hash, const char *name, const char *pw_hash) {
+    strcpy(e->name, name);
+    strcpy(e->pw_hash, pw_hash);
+    __atomic_store_n(&e->hash, hash, __ATOMIC_RELEASE);
+    users->count++;
+}
+
+void user_lock(void) {
+    // A worker that died here never published its entry, so the table is
+    // intact; at worst its line reached users.txt and shows up on restart.
+    if (pthread_mutex_lock(&users->lock) == EOWNERDEAD) pthread_mutex_consistent(&users->lock);
+}
+
+void user_unlock(void) {
+    pthread_mutex_unlock(&users->lock);
+}
+
+/**
+ * Reopens users.txt if another process replaced it since this one opened it.
+ * Caller holds the writer lock.
+ * @return 1 on success, 0 on error (error_msg is set).
+ */
+int user_file_reopen_locked(void) {
+    int fd;
+
+    if (users_fd_gen == users->file_gen) return 1;
+    fd = open("users.txt", O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        snprintf(error_msg, sizeof(error_msg), "cannot open users.txt: %s\n", strerror(errno));
+        return 0;
+    }
+    close(users_fd);
+    users_fd = fd;
+    users_fd_gen = users->file_gen;
+    return 1;
+}
+
+/**
+ * Copies a user's password hash out of the store, retrying while an upgrade
+ * rewrites it.
+ * @param e The user's entry.
+ * @param out Buffer of HASH_LEN bytes.
+ */
+void user_read_hash(const struct user_entry *e, char *out) {
+    unsigned seq;
+
+    do {
+        seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        memcpy(out, e->pw_hash, HASH_LEN);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&e->seq, __ATOMIC_RELAXED));
+    out[HASH_LEN - 1] = '\0';
+}
+
+/**
+ * Maps the user store and loads users.txt into it. Must run before workers
+ * are forked. Lines that are malformed or repeat a name are skipped.
+ * @return 1 on success, 0 on error (error_msg is set).
+ */
+int user_store_init(void) {
+    pthread_mutexattr_t attr;
+    char line[512];
+    struct stat st;
+    FILE *fp;
+
+    users = mmap(NULL, sizeof(struct user_store), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (users == MAP_FAILED) {
+        users = NULL;
+        snprintf(error_msg, sizeof(error_msg), "mmap() error: %s\n", strerror(errno));
+        return 0;
+    }
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&users->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    users_fd = open("users.txt", O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (users_fd < 0 || (fp = fdopen(dup(users_fd), "r")) == NULL) {
+        snprintf(error_msg, sizeof(error_msg), "cannot open users.txt: %s\n", strerror(errno));
+        munmap(users, sizeof(struct user_store));
+        users = NULL;
+        return 0;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        char *colon = strchr(line, ':');
+        struct user_entry *e;
+        unsigned hash;
+
+        line[strcspn(line, "\r\n")] = '\0';
+        if (colon == NULL || colon == line || colon - line >= MAX_USERNAME_LEN || strlen(colon + 1) >= HASH_LEN) {
+            continue;
+        }
+        *colon = '\0';
+        hash = user_hash(line);
+        e = user_probe(line, hash);
+        if (e && e->hash) continue; // Listed twice; the first line wins
+        if (e == NULL || users->count >= USER_MAX_LOAD) {
+            fprintf(stderr, "Warning: users.txt has more than %d users, the rest cannot log in\n", USER_MAX_LOAD);
+            break;
+        }
+        user_publish(e, hash, line, colon + 1);
+    }
+    fclose(fp);
+
+    // A hand-edited file may lack its final newline; appends must start on a line of their own.
+    if (fstat(users_fd, &st) == 0 && st.st_size > 0 && pread(users_fd, line, 1, st.st_size - 1) == 1 &&
+        line[0] != '\n' && write(users_fd, "\n", 1) != 1) {
+        perror("users.txt write() failed");
+    }
+    return 1;
+}
+
+/**
+ * Looks up a user.
+ * @return The user's entry, or NULL if there is no such user.
+ */
+const struct user_entry *user_find(const char *username) {
+    struct user_entry *e;
+
+    if (users == NULL) return NULL;
+    e = user_probe(username, user_hash(username));
+    return e && e->hash ? e : NULL;
+}
+
+/**
+ * Checks if a username is registered.
+ * @param username The username to check.
+ * @return 1 if the user exists, 0 otherwise.
+ */
+int user_exists(const char* username) {
+    return user_find(username) != NULL;
+}
+
+/**
+ * Checks that a username can be stored: not empty, not too long and free of
+ * the characters that delimit users.txt.
+ */
+int username_valid(const char *username) {
+    return username[0] != '\0' && strlen(username) < MAX_USERNAME_LEN && !strpbrk(username, ":\r\n");
+}
+
+/**
+ * Adds a user with an already hashed password: appends them to users.txt,
+ * waits for it to reach the disk and then publishes them to all workers.
+ * Concurrent additions of one name leave exactly one user.
+ * @param username A username that passed username_valid().
+ * @param pw_hash The password hash, from hash_password().
+ * @return 1 if the user was added, 0 if the name is taken, -1 on error (error_msg is set).
+ */
+int user_add(const char *username, const char *pw_hash) {
+    char line[MAX_USERNAME_LEN + HASH_LEN + 2];
+    struct user_entry *e;
+    struct stat st;
+    unsigned hash;
+    int len, ret = -1;
+
+    if (users == NULL) {
+        snprintf(error_msg, sizeof(error_msg), "user store unavailable\n");
+        return -1;
+    }
+    len = snprintf(line, sizeof(line), "%s:%s\n", username, pw_hash);
+    hash = user_hash(username);
+
+    user_lock();
+    e = user_probe(username, hash);
+    if (e && e->hash) {
+        ret = 0;
+    } else if (e == NULL || users->count >= USER_MAX_LOAD) {
+        snprintf(error_msg, sizeof(error_msg), "user store is full\n");
+    } else if (!user_file_reopen_locked()) {
+        // error_msg is set
+    } else if (fstat(users_fd, &st) < 0) {
+        snprintf(error_msg, sizeof(error_msg), "cannot stat users.txt: %s\n", strerror(errno));
+    } else if (write(users_fd, line, len) != len || fdatasync(users_fd) < 0) {
+        snprintf(error_msg, sizeof(error_msg), "cannot append to users.txt: %s\n", strerror(errno));
+        if (ftruncate(users_fd, st.st_size) < 0) perror("users.txt ftruncate() failed"); // Drop a partial line
+    } else {
+        user_publish(e, hash, username, pw_hash);
+        ret = 1;
+    }
+    user_unlock();
+    return ret;
+}
+
+/**
+ * Replaces a user's legacy plaintext password with its hash. users.txt is
+ * written out afresh to a temporary file, synced and renamed over the old
+ * one, so the plaintext leaves the disk and a crash keeps either version.
+ * Other processes reopen the file before their next append.
+ * @param username The user.
+ * @param legacy The plaintext line that was verified; nothing is changed if
+ *        the entry holds something else by now.
+ * @param pw_hash The new hash, from hash_password().
+ * @return 1 if the entry was upgraded, 0 if it changed meanwhile, -1 on error (error_msg is set).
+ */
+int user_rehash(const char *username, const char *legacy, const char *pw_hash) {
+    struct user_entry *e;
+    FILE *fp;
+    int i, fd, ret = -1;
+
+    if (users == NULL) return 0;
+    user_lock();
+    e = user_probe(username, user_hash(username));
+    if (e == NULL || e->hash == 0 || strcmp(e->pw_hash, legacy) != 0) {
+        ret = 0;
+        goto out;
+    }
+
+    // Dot-prefixed, so the docroot never serves the half-written file.
+    fd = open(".users.txt.tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0 || (fp = fdopen(fd, "w")) == NULL) {
+        snprintf(error_msg, sizeof(error_msg), "cannot create .users.txt.tmp: %s\n", strerror(errno));
+        if (fd >= 0) close(fd);
+        goto out;
+    }
+    for (i = 0; i < USER_SLOTS; i++) {
+        struct user_entry *u = &users->slots[i];
+        if (u->hash) fprintf(fp, "%s:%s\n", u->name, u == e ? pw_hash : u->pw_hash);
+    }
+    if (fflush(fp) != 0 || fsync(fd) < 0) {
+        snprintf(error_msg, sizeof(error_msg), "cannot write .users.txt.tmp: %s\n", strerror(errno));
+        fclose(fp);
+        unlink(".users.txt.tmp");
+        goto out;
+    }
+    fclose(fp);
+    if (rename(".users.txt.tmp", "users.txt") < 0) {
+        snprintf(error_msg, sizeof(error_msg), "cannot replace users.txt: %s\n", strerror(errno));
+        unlink(".users.txt.tmp");
+        goto out;
+    }
+    users->file_gen++;
+    if (!user_file_reopen_locked()) fprintf(stderr, "Warning: %s", error_msg);
+
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    strcpy(e->pw_hash, pw_hash);
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+    ret = 1;
+out:
+    user_unlock();
+    return ret;
+}
+
+/**
+ * Upgrades a legacy plaintext entry after its password was verified. Takes
+ * one password hash; call it where password_verify() would run.
+ * @param username The user.
+ * @param password The verified password.
+ * @param stored The entry it was verified against.
+ */
+void user_upgrade(const char *username, const char *password, const char *stored) {
+    char pw_hash[HASH_LEN];
+
+    if (strncmp(stored, "$scrypt$", 8) == 0) return;
+    if (!hash_password(password, pw_hash)) {
+        fprintf(stderr, "Password hashing failed while upgrading user '%s'\n", username);
+    } else if (user_rehash(username, stored, pw_hash) < 0) {
+        fprintf(stderr, "Upgrading user '%s' failed: %s", username, error_msg);
+    }
+}
+
+/**
+ * Registers a new user, hashing the password on the calling thread.
+ * Request handlers go through the KDF pool instead (see http_auth()).
+ * @param username The new user's username.
+ * @param password The new user's password (will be hashed).
+ * @return 1 on success, 0 on failure (error_msg is set).
+ */
+int register_user(const char* username, const char* password) {
+    char hashed_password[HASH_LEN];
+
+    if (!username_valid(username)) {
+        snprintf(error_msg, sizeof(error_msg), "invalid username\n");
+        return 0;
+    }
+    if (!hash_password(password, hashed_password)) {
+        snprintf(error_msg, sizeof(error_msg), "password hashing failed\n");
+        return 0;
+    }
+    switch (user_add(username, hashed_password)) {
+    case 1:
+        return 1;
+    case 0:
+        snprintf(error_msg, sizeof(error_msg), "user '%s' already exists\n", username);
+        return 0;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Authenticates a user against the user store, hashing on the calling thread.
+ * @param username The username to authenticate.
+ * @param password The password to authenticate (will be hashed).
+ * @return 1 on successful authentication, 0 otherwise.
+ */
+int authenticate_user(const char* username, const char* password) {
+    const struct user_entry *e = user_find(username);
+    char stored[HASH_LEN];
+
+    if (e == NULL) return 0;
+    user_read_hash(e, stored);
+    if (!password_verify(password, stored)) return 0;
+    user_upgrade(username, password, stored);
+    return 1;
+}
+
+// Counters kept per worker and summed for /metrics.
+enum metric_counter {
+    M_REQUESTS,
+    M_BYTES,
+    M_STATUS_1XX, M_STATUS_2XX, M_STATUS_3XX, M_STATUS_4XX, M_STATUS_5XX,
+    M_CACHE_HITS,
+    M_CACHE_MISSES,
+    M_ACCEPT_ERRORS,
+    NCOUNTERS
+};
+
+// Phases of request handling with a latency histogram each.
+enum metric_phase {
+    PHASE_READ,   // First request bytes to complete request
+    PHASE_PARSE,  // Time spent in the request parser
+    PHASE_LOOKUP, // Finding a static file: cache, docroot index, open()
+    PHASE_SEND,   // Queued response to the last byte handed to the kernel
+    PHASE_FORM,   // Form submission queued to written (and synced) by the form writer
+    NPHASES
+};
+
+// Log-linear latency histogram in nanoseconds, as in HdrHistogram: values
+// below 16 have a bucket each, and every power of two above is split into
+// 16 buckets, so a bucket is at most 1/16 of its value wide.
+struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+// The metrics of one thread. Only its owner writes to it, with plain
+// (non-locked) increments, so recording costs a few nanoseconds; readers sum
+// all blocks with relaxed loads. Counts only ever grow, so a block whose
+// owner exited keeps its totals and is handed to the next thread.
+struct metric_block {
+    int owner __attribute__((aligned(64))); // Thread id of the writer, 0 if free
+    uint64_t counters[NCOUNTERS] __attribute__((aligned(64)));
+    struct histogram phases[NPHASES];
+};
+
+// Every worker's blocks, in shared memory mapped before the first fork().
+// Threads that find no free block share the last one, whose counts may
+// then lose the odd concurrent update.
+struct metrics {
+    struct metric_block blocks[METRIC_BLOCKS];
+};
+
+struct metrics *metrics = NULL;
+__thread struct metric_block *mblock = NULL;
+
+const char *const phase_names[NPHASES] = {"read", "parse", "lookup", "send", "form"};
+
+/**
+ * Maps the metrics blocks. Must run before workers are forked.
+ * @return 1 on success, 0 on error (error_msg is set).
+ */
+int metrics_init(void) {
+    metrics = mmap(NULL, sizeof(struct metrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (metrics == MAP_FAILED) {
+        metrics = NULL;
+        snprintf(error_msg, sizeof(error_msg), "metrics mmap() error: %s\n", strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Gives the calling thread a block of its own: a free one, or one whose
+ * owner has exited (a finished fork-mode child, a crashed worker).
+ */
+struct metric_block *metrics_claim(void) {
+    int tid = syscall(SYS_gettid), i;
+
+    for (i = 0; i < METRIC_BLOCKS - 1; i++) {
+        struct metric_block *b = &metrics->blocks[i];
+        int owner = __atomic_load_n(&b->owner, __ATOMIC_RELAXED);
+
+        if (owner != 0 && (kill(owner, 0) == 0 || errno != ESRCH)) continue;
+        if (__atomic_compare_exchange_n(&b->owner, &owner, tid, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return b;
+    }
+    return &metrics->blocks[METRIC_BLOCKS - 1];
+}
+
+static inline struct metric_block *metrics_block(void) {
+    if (mblock == NULL && metrics) mblock = metrics_claim();
+    return mblock;
+}
+
+/**
+ * Adds to one of the calling thread's counters.
+ */
+static inline void metric_add(enum metric_counter c, uint64_t v) {
+    struct metric_block *b = metrics_block();
+
+    if (b) __atomic_store_n(&b->counters[c], __atomic_load_n(&b->counters[c], __ATOMIC_RELAXED) + v, __ATOMIC_RELAXED);
+}
+
+static inline unsigned hist_bucket(uint64_t v) {
+    unsigned e;
+
+    if (v < HIST_SUB) return v;
+    e = 63 - __builtin_clzll(v);
+    if (e > HIST_MAX_EXP) return HIST_BUCKETS - 1;
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB + ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/**
+ * Records a latency sample, in nanoseconds, for one phase.
+ */
+static inline void metric_time(enum metric_phase p, uint64_t ns) {
+    struct metric_block *b = metrics_block();
+    struct histogram *h;
+    unsigned i;
+
+    if (b == NULL) return;
+    h = &b->phases[p];
+    i = hist_bucket(ns);
+    __atomic_store_n(&h->buckets[i], __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, __atomic_load_n(&h->sum, __ATOMIC_RELAXED) + ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->count, __atomic_load_n(&h->count, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Initializes the server socket.
+ * @param portno The port number to listen on.
+ * @param reuseport Set SO_REUSEPORT so several workers can each bind their own listener
+ *        on the same address and let the kernel balance connections between them.
+ * @return The server socket file descriptor, or 0 on error.
+ */
+int serv_init(int portno, int reuseport) {
+    int sockfd;
+    struct sockaddr_in serv_addr;
+
+    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        snprintf(error_msg, sizeof(error_msg), "Socket() error: %s\n", strerror(errno));
+        return 0;
+    }
+
+    // Allow quick restarts while old connections sit in TIME_WAIT.
+    int opt = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+        snprintf(error_msg, sizeof(error_msg), "SO_REUSEPORT error: %s\n", strerror(errno));
+        close(sockfd);
+        return 0;
+    }
+
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(portno);
+    serv_addr.sin_addr.s_addr = inet_addr(LISTENADDRESS);
+
+    if (bind(sockfd, (const struct sockaddr *)&serv_addr, sizeof(serv_addr))) {
+        snprintf(error_msg, sizeof(error_msg), "Bind() error: %s\n", strerror(errno));
+        close(sockfd);
+        return 0;
+    }
+
+    if (listen(sockfd, LISTEN_BACKLOG)) {
+        snprintf(error_msg, sizeof(error_msg), "Listen() error: %s\n", strerror(errno));
+        close(sockfd);
+        return 0;
+    }
+
+    return sockfd;
+}
+
+/**
+ * Accepts a new client connection.
+ * @param s The server socket file descriptor.
+ * @return The client socket file descriptor, or 0 on error.
+ */
+int client_acpt(int s) {
+    int c; // c = client fd
+    struct sockaddr_in cli_addr;
+    socklen_t addrlength = sizeof(cli_addr);
+
+    memset(&cli_addr, 0, sizeof(cli_addr));
+    c = accept(s, (struct sockaddr *)&cli_addr, &addrlength);
+
+    if (c < 0) {
+        metric_add(M_ACCEPT_ERRORS, 1);
+        snprintf(error_msg, sizeof(error_msg), "Accept() error: %s\n", strerror(errno));
+        return 0;
+    }
+    return c;
+}
+
+// Characters allowed in methods and header names (RFC 9110 "tchar").
+static const unsigned char tchar[256] = {
+    ['!'] = 1, ['#'] = 1, ['$'] = 1, ['%'] = 1, ['&'] = 1, ['\''] = 1, ['*'] = 1, ['+'] = 1,
+    ['-'] = 1, ['.'] = 1, ['^'] = 1, ['_'] = 1, ['`'] = 1, ['|'] = 1, ['~'] = 1,
+    ['0'] = 1, ['1'] = 1, ['2'] = 1, ['3'] = 1, ['4'] = 1, ['5'] = 1, ['6'] = 1, ['7'] = 1, ['8'] = 1, ['9'] = 1,
+    ['A'] = 1, ['B'] = 1, ['C'] = 1, ['D'] = 1, ['E'] = 1, ['F'] = 1, ['G'] = 1, ['H'] = 1, ['I'] = 1,
+    ['J'] = 1, ['K'] = 1, ['L'] = 1, ['M'] = 1, ['N'] = 1, ['O'] = 1, ['P'] = 1, ['Q'] = 1, ['R'] = 1,
+    ['S'] = 1, ['T'] = 1, ['U'] = 1, ['V'] = 1, ['W'] = 1, ['X'] = 1, ['Y'] = 1, ['Z'] = 1,
+    ['a'] = 1, ['b'] = 1, ['c'] = 1, ['d'] = 1, ['e'] = 1, ['f'] = 1, ['g'] = 1, ['h'] = 1, ['i'] = 1,
+    ['j'] = 1, ['k'] = 1, ['l'] = 1, ['m'] = 1, ['n'] = 1, ['o'] = 1, ['p'] = 1, ['q'] = 1, ['r'] = 1,
+    ['s'] = 1, ['t'] = 1, ['u'] = 1, ['v'] = 1, ['w'] = 1, ['x'] = 1, ['y'] = 1, ['z'] = 1,
+};
+
+/**
+ * Maps a header name to its known_header slot.
+ * @return The slot, or -1 for headers the server does not act on.
+ */
+int http_known_header(const char *name, size_t len) {
+#define HDR_IS(s) (len == sizeof(s) - 1 && strncasecmp(name, s, len) == 0)
+    switch (len) {
+    case 4: if (HDR_IS("Host")) return HDR_HOST; break;
+    case 5: if (HDR_IS("Range")) return HDR_RANGE; break;
+    case 6: if (HDR_IS("Cookie")) return HDR_COOKIE; break;
+    case 8: if (HDR_IS("If-Range")) return HDR_IF_RANGE; break;
+    case 10: if (HDR_IS("Connection")) return HDR_CONNECTION; break;
+    case 12: if (HDR_IS("Content-Type")) return HDR_CONTENT_TYPE; break;
+    case 13: if (HDR_IS("If-None-Match")) return HDR_IF_NONE_MATCH; break;
+    case 14: if (HDR_IS("Content-Length")) return HDR_CONTENT_LENGTH; break;
+    case 15: if (HDR_IS("Accept-Encoding")) return HDR_ACCEPT_ENCODING; break;
+    case 17:
+        if (HDR_IS("Transfer-Encoding")) return HDR_TRANSFER_ENCODING;
+        if (HDR_IS("If-Modified-Since")) return HDR_IF_MODIFIED_SINCE;
+        break;
+    }
+    return -1;
+#undef HDR_IS
+}
+
+/**
+ * Records a complete header line.
+ * @return 1 on success, 0 if the header is malformed or one too many (error_msg is set).
+ */
+int http_add_field(struct http_request *req, const char *buf, struct span name, struct span value) {
+    int k;
+
+    if (req->nfields == MAX_HEADERS) {
+        snprintf(error_msg, sizeof(error_msg), "too many header fields");
+        return 0;
+    }
+    req->fields[req->nfields].name = name;
+    req->fields[req->nfields].value = value;
+    req->nfields++;
+
+    k = http_known_header(buf + name.off, name.len);
+    if (k < 0) return 1;
+    if (k == HDR_CONTENT_LENGTH) {
+        // Digits only, and a repeated header must agree: anything else invites request smuggling.
+        long n = 0;
+        unsigned i;
+
+        if (value.len == 0 || value.len > 15) {
+            snprintf(error_msg, sizeof(error_msg), "bad Content-Length");
+            return 0;
+        }
+        for (i = 0; i < value.len; i++) {
+            char c = buf[value.off + i];
+            if (c < '0' || c > '9') {
+                snprintf(error_msg, sizeof(error_msg), "bad Content-Length");
+                return 0;
+            }
+            n = n * 10 + (c - '0');
+        }
+        if (req->content_length >= 0 && req->content_length != n) {
+            snprintf(error_msg, sizeof(error_msg), "conflicting Content-Length");
+            return 0;
+        }
+        req->content_length = n;
+    } else if (k == HDR_TRANSFER_ENCODING) {
+        snprintf(error_msg, sizeof(error_msg), "Transfer-Encoding is not supported");
+        return 0;
+    }
+    if (!req->known[k]) req->known[k] = req->nfields;
+    return 1;
+}
+
+/**
+ * Resets a parser for a new request.
+ */
+void http_request_init(struct http_request *req) {
+    req->state = PARSE_METHOD;
+    req->pos = req->mark = req->header_len = 0;
+    req->method.len = req->target.len = req->version.len = 0;
+    req->content_length = -1;
+    req->nfields = 0;
+    memset(req->known, 0, sizeof(req->known));
+}
+
+/**
+ * Parses as much of a request head as has been received. Only bytes not seen
+ * by an earlier call are examined; nothing is copied or allocated, the
+ * request line and header fields are recorded as spans of buf.
+ * @param req Parser state from http_request_init() or an earlier call.
+ * @param buf The request bytes, starting with the request line.
+ * @param len Number of bytes in buf (at most MAX_REQUEST_SIZE).
+ * @return 1 once the head is complete, 0 if more bytes are needed,
+ *         -1 on a malformed request (error_msg is set).
+ */
+int http_parse(struct http_request *req, const char *buf, size_t len) {
+    size_t pos = req->pos;
+
+    // Each state consumes as many bytes as it can in its own tight loop.
+    while (pos < len) {
+        unsigned char c;
+
+        switch (req->state) {
+        case PARSE_METHOD:
+            while (pos < len && tchar[(unsigned char)buf[pos]]) pos++;
+            if (pos == len) break;
+            if (buf[pos] != ' ' || pos == req->mark) goto bad;
+            req->method = (struct span){req->mark, pos - req->mark};
+            req->mark = ++pos;
+            req->state = PARSE_TARGET;
+            break;
+
+        case PARSE_TARGET:
+            // Visible ASCII up to the space; controls and bytes >= 0x7f are refused.
+            pos += scan.target(buf + pos, len - pos);
+            if (pos == len) break;
+            if (buf[pos] != ' ' || pos == req->mark) goto bad;
+            req->target = (struct span){req->mark, pos - req->mark};
+            req->mark = ++pos;
+            req->state = PARSE_VERSION;
+            break;
+
+        case PARSE_VERSION:
+            while (pos < len && buf[pos] != '\r' && pos - req->mark < 8) pos++;
+            if (pos == len) break;
+            if (buf[pos] != '\r' || pos - req->mark != 8 || memcmp(buf + req->mark, "HTTP/1.", 7) != 0 ||
+                buf[pos - 1] < '0' || buf[pos - 1] > '9') {
+                goto bad;
+            }
+            req->version = (struct span){req->mark, 8};
+            req->state = PARSE_LINE_LF;
+            pos++;
+            break;
+
+        case PARSE_LINE_LF:
+        case PARSE_FIELD_LF:
+            if (buf[pos] != '\n') goto bad;
+            req->state = PARSE_FIELD_START;
+            pos++;
+            break;
+
+        case PARSE_FIELD_START:
+            c = buf[pos];
+            if (c == '\r') {
+                req->state = PARSE_END_LF;
+                pos++;
+                break;
+            }
+            if (!tchar[c]) goto bad; // Includes obsolete line folding
+            req->mark = pos;
+            req->state = PARSE_NAME;
+            /* fall through */
+
+        case PARSE_NAME:
+            while (pos < len && tchar[(unsigned char)buf[pos]]) pos++;
+            if (pos == len) break;
+            if (buf[pos] != ':') goto bad;
+            // Stash the name span in the next free slot until the value is known.
+            if (req->nfields == MAX_HEADERS) {
+                snprintf(error_msg, sizeof(error_msg), "too many header fields");
+                return -1;
+            }
+            req->fields[req->nfields].name = (struct span){req->mark, pos - req->mark};
+            req->state = PARSE_VALUE_START;
+            pos++;
+            /* fall through */
+
+        case PARSE_VALUE_START:
+            while (pos < len && (buf[pos] == ' ' || buf[pos] == '\t')) pos++;
+            if (pos == len) break;
+            req->mark = pos;
+            req->state = PARSE_VALUE;
+            /* fall through */
+
+        case PARSE_VALUE: {
+            size_t end;
+
+            // Tab or visible bytes (obs-text included) up to the CR.
+            pos += scan.value(buf + pos, len - pos);
+            if (pos == len) break;
+            if (buf[pos] != '\r') goto bad;
+            for (end = pos; end > req->mark && (buf[end - 1] == ' ' || buf[end - 1] == '\t'); end--)
+                ;
+            if (!http_add_field(req, buf, req->fields[req->nfields].name,
+                                (struct span){req->mark, end - req->mark})) {
+                return -1;
+            }
+            req->state = PARSE_FIELD_LF;
+            pos++;
+            break;
+        }
+
+        case PARSE_END_LF:
+            if (buf[pos] != '\n') goto bad;
+            req->state = PARSE_DONE;
+            req->header_len = ++pos;
+            req->pos = pos;
+            return 1;
+
+        case PARSE_DONE:
+            return 1;
+        }
+    }
+
+    req->pos = pos;
+    return req->state == PARSE_DONE;
+
+bad:
+    snprintf(error_msg, sizeof(error_msg), "malformed request at byte %zu", pos);
+    return -1;
+}
+
+/**
+ * Turns a span of the current request into a view of the request buffer.
+ */
+struct str_view http_view(const struct conn *cn, struct span s) {
+    return (struct str_view){cn->rbuf + s.off, s.len};
+}
+
+/**
+ * Looks up a known header of the current request.
+ * @param cn The connection with a parsed request head.
+ * @param h The header.
+ * @return A view of its value; p is NULL if the header is absent.
+ */
+struct str_view http_header(const struct conn *cn, enum known_header h) {
+    if (!cn->req.known[h]) return (struct str_view){NULL, 0};
+    return http_view(cn, cn->req.fields[cn->req.known[h] - 1].value);
+}
+
+/**
+ * Compares a view with a string, case-sensitively.
+ */
+int sv_eq(struct str_view v, const char *s) {
+    return v.len == strlen(s) && memcmp(v.p, s, v.len) == 0;
+}
+
+// Free standard slabs. Per thread, so the thread-pool mode never contends on
+// it; the total across threads is capped through slab_pooled.
+__thread struct slab *slab_pool = NULL;
+atomic_size_t slab_pooled = 0;
+
+/**
+ * Takes a standard slab from the pool, or allocates one.
+ * @return The slab, or NULL if memory allocation failed.
+ */
+struct slab *slab_get(void) {
+    struct slab *sl = slab_pool;
+
+    if (sl) {
+        slab_pool = sl->next;
+        atomic_fetch_sub_explicit(&slab_pooled, SLAB_SIZE, memory_order_relaxed);
+        return sl;
+    }
+    sl = malloc(sizeof(struct slab) + SLAB_SIZE);
+    if (sl == NULL) {
+        perror("malloc() failed for slab");
+        return NULL;
+    }
+    sl->size = SLAB_SIZE;
+    return sl;
+}
+
+/**
+ * Returns a slab to the pool, or frees it if it is oversized or the pool is full.
+ */
+void slab_put(struct slab *sl) {
+    if (sl->size != SLAB_SIZE ||
+        atomic_fetch_add_explicit(&slab_pooled, SLAB_SIZE, memory_order_relaxed) + SLAB_SIZE > SLAB_POOL_MAX) {
+        if (sl->size == SLAB_SIZE) atomic_fetch_sub_explicit(&slab_pooled, SLAB_SIZE, memory_order_relaxed);
+        free(sl);
+        return;
+    }
+    sl->next = slab_pool;
+    slab_pool = sl;
+}
+
+/**
+ * Allocates request-scoped memory, 16-byte aligned. It stays valid until
+ * arena_release().
+ * @param a The arena.
+ * @param n Number of bytes.
+ * @return The memory, or NULL if allocation failed.
+ */
+void *arena_alloc(struct arena *a, size_t n) {
+    struct slab *sl;
+
+    n = (n + 15) & ~(size_t)15;
+    if (a->head && a->used + n <= a->head->size) {
+        void *p = a->head->data + a->used;
+        a->used += n;
+        return p;
+    }
+
+    if (n > SLAB_SIZE) {
+        // A dedicated slab, linked behind the current one so its free space stays usable.
+        sl = malloc(sizeof(struct slab) + n);
+        if (sl == NULL) {
+            perror("malloc() failed for arena");
+            return NULL;
+        }
+        sl->size = n;
+        if (a->head) {
+            sl->next = a->head->next;
+            a->head->next = sl;
+        } else {
+            sl->next = NULL;
+            a->head = sl;
+            a->used = n;
+        }
+        return sl->data;
+    }
+
+    sl = slab_get();
+    if (sl == NULL) return NULL;
+    sl->next = a->head;
+    a->head = sl;
+    a->used = n;
+    return sl->data;
+}
+
+/**
+ * Releases everything allocated from an arena.
+ */
+void arena_release(struct arena *a) {
+    struct slab *sl = a->head;
+
+    while (sl) {
+        struct slab *next = sl->next;
+        slab_put(sl);
+        sl = next;
+    }
+    a->head = NULL;
+    a->used = 0;
+}
+
+/**
+ * Gives the request buffer back once it holds nothing, so idle keep-alive
+ * connections do not pin memory.
+ */
+void conn_drop_rbuf(struct conn *cn) {
+    if (cn->rslab) slab_put(cn->rslab);
+    else free(cn->rbuf);
+    cn->rslab = NULL;
+    cn->rbuf = NULL;
+    cn->rlen = cn->rcap = 0;
+}
+
+/**
+ * Nanoseconds from the monotonic clock, for timing the phases of a request.
+ */
+uint64_t clock_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/**
+ * Prepares a connection for its first request.
+ * @param cn The connection state to initialize.
+ * @param fd The client socket file descriptor.
+ */
+void conn_init(struct conn *cn, int fd) {
+    memset(cn, 0, sizeof(*cn));
+    cn->fd = fd;
+    cn->state = CONN_READING;
+    cn->file_fd = -1;
+    cn->pipe_fd[0] = cn->pipe_fd[1] = -1;
+    http_request_init(&cn->req);
+}
+
+void cache_unpin(struct conn *cn); // With the file cache below
+
+/**
+ * Releases the buffers and files owned by a connection. Does not close the socket.
+ * @param cn The connection state to release.
+ */
+void conn_free(struct conn *cn) {
+    cache_unpin(cn);
+    if (cn->file_fd >= 0) close(cn->file_fd);
+    cn->file_fd = -1;
+    if (cn->pipe_fd[0] >= 0) {
+        close(cn->pipe_fd[0]);
+        close(cn->pipe_fd[1]);
+        cn->pipe_fd[0] = cn->pipe_fd[1] = -1;
+    }
+    conn_drop_rbuf(cn);
+    arena_release(&cn->arena);
+    cn->wbuf = NULL;
+}
+
+/**
+ * Makes sure the request buffer can take at least `extra` more bytes plus a NUL.
+ * @return 1 on success, 0 if memory allocation failed.
+ */
+int conn_reserve(struct conn *cn, size_t extra) {
+    size_t want = cn->rlen + extra + 1;
+
+    if (want <= cn->rcap) return 1;
+
+    if (cn->rbuf == NULL && want <= SLAB_SIZE) {
+        // Requests normally fit one pooled slab.
+        cn->rslab = slab_get();
+        if (cn->rslab == NULL) return 0;
+        cn->rbuf = cn->rslab->data;
+        cn->rcap = SLAB_SIZE;
+        return 1;
+    }
+
+    // Outgrew the slab (a large body or a long pipeline): move to the heap.
+    size_t cap = cn->rcap * 2 > want ? cn->rcap * 2 : want;
+    char *temp_request = cn->rslab ? malloc(cap) : realloc(cn->rbuf, cap);
+    if (!temp_request) {
+        perror("realloc() failed");
+        return 0;
+    }
+    if (cn->rslab) {
+        memcpy(temp_request, cn->rbuf, cn->rlen + 1);
+        slab_put(cn->rslab);
+        cn->rslab = NULL;
+    }
+    cn->rbuf = temp_request;
+    cn->rcap = cap;
+    return 1;
+}
+
+// Request body limits by exact path, from -B. The login routes only ever
+// need a name and a password; other paths fall back to config.body_max.
+struct body_rule {
+    const char *path;
+    size_t len;
+    long max;
+};
+
+struct body_rule body_rules[MAX_BODY_RULES] = {
+    {"/login", 6, 4096},
+    {"/register", 9, 4096},
+    {"/logout", 7, 4096},
+};
+int nbody_rules = 3;
+
+/**
+ * Sets a request body limit.
+ * @param spec "<path>=<bytes>" for one path, or "<bytes>" for all other paths.
+ * @return 1 on success, 0 on error (error_msg is set).
+ */
+int body_rule_add(const char *spec) {
+    const char *eq = strchr(spec, '=');
+    const char *num = eq ? eq + 1 : spec;
+    char *end;
+    long max = strtol(num, &end, 10);
+    int i;
+
+    if (*num == '\0' || *end != '\0' || max < 0 || (eq && spec[0] != '/')) {
+        snprintf(error_msg, sizeof(error_msg), "bad body limit '%s', expected [/path=]bytes\n", spec);
+        return 0;
+    }
+    if (eq == NULL) {
+        config.body_max = max;
+        return 1;
+    }
+    for (i = 0; i < nbody_rules; i++) {
+        if (body_rules[i].len == (size_t)(eq - spec) && memcmp(body_rules[i].path, spec, eq - spec) == 0) break;
+    }
+    if (i == MAX_BODY_RULES) {
+        snprintf(error_msg, sizeof(error_msg), "too many body limits (at most %d)\n", MAX_BODY_RULES);
+        return 0;
+    }
+    if (i == nbody_rules) nbody_rules++;
+    body_rules[i] = (struct body_rule){spec, eq - spec, max};
+    return 1;
+}
+
+/**
+ * The largest body accepted for the request target, query string ignored.
+ */
+long body_limit_for(struct str_view target) {
+    const char *query = memchr(target.p, '?', target.len);
+    size_t len = query ? (size_t)(query - target.p) : target.len;
+    int i;
+
+    for (i = 0; i < nbody_rules; i++) {
+        if (body_rules[i].len == len && memcmp(body_rules[i].path, target.p, len) == 0) return body_rules[i].max;
+    }
+    return config.body_max;
+}
+
+/**
+ * Sets up the body of a request whose head just completed. A body over the
+ * limit of its path is refused before any of it is read. POST bodies are
+ * decoded as they stream in; other bodies are read and dropped.
+ * @return 1 on success, 0 to refuse the request (cn->reject is set for a 413).
+ */
+int body_begin(struct conn *cn) {
+    if (cn->req.content_length <= 0) return 1;
+    if (cn->req.content_length > body_limit_for(http_view(cn, cn->req.target))) {
+        cn->reject = 413;
+        return 0;
+    }
+    cn->body_left = cn->req.content_length;
+    if (sv_eq(http_view(cn, cn->req.method), "POST")) {
+        cn->form = arena_alloc(&cn->arena, sizeof(*cn->form));
+        if (cn->form == NULL) return 0;
+        form_stream_init(cn->form);
+    }
+    return 1;
+}
+
+/**
+ * Hands the body bytes buffered behind the head to the decoder and drops
+ * them, so rbuf never holds more than the head and one chunk. Bytes past
+ * the body belong to a pipelined request and stay.
+ */
+void body_consume(struct conn *cn) {
+    size_t have = cn->rlen - cn->header_len;
+    size_t n = have < (size_t)cn->body_left ? have : (size_t)cn->body_left;
+
+    if (n == 0) return;
+    if (cn->form) form_stream_feed(cn->form, cn->rbuf + cn->header_len, n);
+    memmove(cn->rbuf + cn->header_len, cn->rbuf + cn->header_len + n, have - n);
+    cn->rlen -= n;
+    cn->rbuf[cn->rlen] = '\0';
+    cn->body_left -= n;
+    if (cn->body_left == 0 && cn->form) form_stream_finish(cn->form);
+}
+
+/**
+ * Checks whether the bytes buffered so far form a complete request.
+ * The head is parsed incrementally, then Content-Length gives the exact body
+ * size and the body is consumed chunk by chunk as it arrives. Only bytes that
+ * arrived since the last call are examined, so this is cheap to call after
+ * every read.
+ * @param cn The connection whose rbuf just grew.
+ * @return 1 when the full request is buffered, 0 if more data is needed, -1 on
+ *         error. A malformed request also sets cn->reject.
+ */
+int request_progress(struct conn *cn) {
+    if (cn->rlen == 0) return 0;
+    if (cn->t_start == 0) cn->t_start = clock_ns();
+
+    if (!cn->header_len) {
+        // Pipelined requests may follow; the head itself must fit the limit.
+        size_t avail = cn->rlen < MAX_REQUEST_SIZE ? cn->rlen : MAX_REQUEST_SIZE;
+        uint64_t t0 = clock_ns();
+        int r = http_parse(&cn->req, cn->rbuf, avail);
+
+        cn->parse_ns += clock_ns() - t0;
+
+        if (r < 0) {
+            fprintf(stderr, "Bad request: %s\n", error_msg);
+            cn->reject = 400;
+            return -1;
+        }
+        if (r == 0) {
+            // Check for request size limit
+            if (avail == MAX_REQUEST_SIZE) {
+                fprintf(stderr, "Request size exceeds limit.\n");
+                cn->reject = 431;
+                return -1;
+            }
+            return 0;
+        }
+        cn->header_len = cn->req.header_len;
+        cn->need = cn->header_len;
+        if (!body_begin(cn)) return -1;
+    }
+
+    if (cn->body_left) {
+        body_consume(cn);
+        if (cn->body_left) return 0;
+    }
+    cn->t_parsed = clock_ns();
+    return 1;
+}
+
+/**
+ * Appends bytes received by some other means (e.g. io_uring) to the request buffer.
+ * @return 1 on success, 0 if memory allocation failed.
+ */
+int conn_append(struct conn *cn, const char *data, size_t n) {
+    if (!conn_reserve(cn, n)) return 0;
+    memcpy(cn->rbuf + cn->rlen, data, n);
+    cn->rlen += n;
+    cn->rbuf[cn->rlen] = '\0';
+    return 1;
+}
+
+/**
+ * Reads as much of the HTTP request as the socket currently has to offer.
+ * This is resumable: on a non-blocking socket it returns when recv() would block
+ * and picks up where it stopped on the next call.
+ * On a blocking socket it simply keeps reading until the request is complete.
+ * @param cn The connection to read into. cn->rbuf holds the request.
+ * @return 1 when the full request is buffered, 0 if more data is needed, -1 on error or EOF.
+ */
+int read_full_request(struct conn *cn) {
+    ssize_t bytes_read;
+    int r;
+
+    // A pipelined request may already be sitting in the buffer.
+    if (cn->rlen > 0) {
+        r = request_progress(cn);
+        if (r != 0) return r;
+    }
+
+    while (1) {
+        // A body is read one chunk at a time and never past its end; until the
+        // decoder has taken a chunk, the rest waits in the socket.
+        size_t extra = cn->body_left ? (cn->body_left < BODY_CHUNK ? cn->body_left : BODY_CHUNK) : 4096;
+        if (!conn_reserve(cn, extra)) return -1;
+
+        bytes_read = recv(cn->fd, cn->rbuf + cn->rlen, cn->body_left ? extra : cn->rcap - cn->rlen - 1, 0);
+        if (bytes_read == 0) {
+            return -1; // Peer closed before sending a full request
+        }
+        if (bytes_read < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            snprintf(error_msg, sizeof(error_msg), "recv() error: %s", strerror(errno));
+            return -1;
+        }
+        cn->rlen += bytes_read;
+        cn->rbuf[cn->rlen] = '\0';
+
+        r = request_progress(cn);
+        if (r != 0) return r;
+    }
+}
+
+
+/**
+ * Reads the entire contents of a file into request-scoped memory.
+ * @param a The arena to allocate from; the File is released with it.
+ * @param filename The path to the file to read.
+ * @return A pointer to a new File struct, or NULL on error.
+ */
+File *fileread(struct arena *a, char *filename) {
+    int n = 0, fd;
+    File *f;
+    
+    f = arena_alloc(a, sizeof(File));
+    if (f == NULL) return NULL;
+    
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("open() error");
+        return NULL;
+    }
+    
+    strncpy(f->filename, filename, sizeof(f->filename) - 1);
+    f->filename[sizeof(f->filename) - 1] = '\0';
+
+    // Size the buffer once from fstat() instead of growing it chunk by chunk.
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("fstat() error");
+        close(fd);
+        return NULL;
+    }
+    f->fc = arena_alloc(a, st.st_size + 1); // +1 for the terminating NUL written below
+    f->size = 0;
+    if (f->fc == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    while (f->size < st.st_size && (n = read(fd, f->fc + f->size, st.st_size - f->size)) > 0) {
+        f->size += n;
+    }
+
+    if (n < 0) {
+        perror("read() error");
+        close(fd);
+        return NULL;
+    }
+
+    close(fd);
+    f->fc[f->size] = '\0'; // Null-terminate
+    
+    return f;
+}
+
+/**
+ * Returns the reason phrase for a status code.
+ */
+const char *http_reason(int code) {
+    switch (code) {
+    case 200: return "OK";
+    case 206: return "Partial Content";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 409: return "Conflict";
+    case 413: return "Content Too Large";
+    case 414: return "URI Too Long";
+    case 416: return "Range Not Satisfiable";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    case 503: return "Service Unavailable";
+    default:  return "Unknown";
+    }
+}
+
+#define PREFIX_SLOTS 64 // Pre-serialized status/type header prefixes per thread (power of two)
+
+// "HTTP/1.1 <code> <reason>\r\nServer: ...\r\nContent-Type: <type>\r\nContent-Length: ",
+// serialized the first time a (status, type) pair is used and copied from
+// then on. Thread-local, so lookups need no lock.
+struct header_prefix {
+    int code;
+    const char *type; // Compared by address: types are static strings
+    unsigned short len;
+    char text[238];
+};
+
+__thread struct header_prefix header_prefixes[PREFIX_SLOTS];
+
+/**
+ * Finds or builds the pre-serialized prefix for a status and content type.
+ * @return The prefix, or NULL if it does not fit a slot.
+ */
+const struct header_prefix *http_header_prefix(int code, const char *contentType) {
+    unsigned h = ((unsigned)code * 31u + (unsigned)((uintptr_t)contentType >> 3)) & (PREFIX_SLOTS - 1);
+    struct header_prefix *hp = &header_prefixes[h];
+    int n;
+
+    if (hp->code == code && hp->type == contentType) return hp;
+
+    // On a collision the newcomer simply takes the slot.
+    n = snprintf(hp->text, sizeof(hp->text),
+                 "HTTP/1.1 %d %s\r\n"
+                 "Server: httpd.c\r\n"
+                 "Content-Type: %s\r\n"
+                 "Content-Length: ",
+                 code, http_reason(code), contentType);
+    if (n >= (int)sizeof(hp->text)) {
+        hp->code = 0;
+        return NULL;
+    }
+    hp->code = code;
+    hp->type = contentType;
+    hp->len = n;
+    return hp;
+}
+
+/**
+ * Writes a non-negative number in decimal.
+ * @return The number of digits written.
+ */
+int format_ulong(char *buf, unsigned long v) {
+    char tmp[20];
+    int n = 0, i;
+
+    do {
+        tmp[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    for (i = 0; i < n; i++) buf[i] = tmp[n - 1 - i];
+    return n;
+}
+
+/**
+ * Formats the status line and the headers that only depend on the response
+ * itself, starting from the pre-serialized prefix of its status and type.
+ * Date, Connection and the blank line are added by http_queue_prefix(), so
+ * the result can be cached and reused.
+ * @param buf Output buffer.
+ * @param size Size of buf.
+ * @param code The HTTP status code.
+ * @param contentType The Content-Type header value; a string with static
+ *        storage, such as get_content_type() returns.
+ * @param data_length The size of the response body, in bytes.
+ * @param extra_headers Further "Name: value\r\n" lines, or NULL.
+ * @return The length of the formatted prefix.
+ */
+int http_format_header(char *buf, size_t size, int code, const char *contentType, long data_length,
+                       const char *extra_headers) {
+    const struct header_prefix *hp = http_header_prefix(code, contentType);
+    size_t elen = extra_headers ? strlen(extra_headers) : 0;
+    size_t n;
+
+    if (hp == NULL || hp->len + 22 + elen > size) {
+        int r = snprintf(buf, size,
+            "HTTP/1.1 %d %s\r\n"
+            "Server: httpd.c\r\n"
+            "Content-Type: %s\r\n"
+            "Content-Length: %ld\r\n"
+            "%s",
+            code, http_reason(code), contentType, data_length, extra_headers ? extra_headers : ""
+        );
+        return r < (int)size ? r : (int)size - 1;
+    }
+
+    memcpy(buf, hp->text, hp->len);
+    n = hp->len + format_ulong(buf + hp->len, data_length);
+    buf[n++] = '\r';
+    buf[n++] = '\n';
+    if (elen) memcpy(buf + n, extra_headers, elen);
+    return n + elen;
+}
+
+/**
+ * The Date header line for the current second. Formatted at most once per
+ * second per thread instead of once per response.
+ * @param len Set to the length of the line.
+ */
+const char *http_date_header(size_t *len) {
+    static __thread char line[64];
+    static __thread size_t line_len;
+    static __thread time_t line_time = -1;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    if (ts.tv_sec != line_time) {
+        struct tm tm;
+
+        gmtime_r(&ts.tv_sec, &tm);
+        line_len = strftime(line, sizeof(line), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+        line_time = ts.tv_sec;
+    }
+    *len = line_len;
+    return line;
+}
+
+/**
+ * Queues a header prefix from http_format_header() plus the Date and
+ * Connection headers and the blank line, replacing any previously queued
+ * response.
+ * @param cn The client connection.
+ * @param prefix The formatted header prefix.
+ * @param n Length of prefix.
+ * @param extra Room to reserve after the headers for a copied body.
+ * @return 1 on success, 0 if memory allocation failed.
+ */
+int http_queue_prefix(struct conn *cn, const char *prefix, size_t n, size_t extra) {
+    const char *tail = cn->keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    size_t tlen = strlen(tail);
+    size_t dlen;
+    const char *date = http_date_header(&dlen);
+
+    char *wbuf = arena_alloc(&cn->arena, n + dlen + tlen + extra);
+    if (wbuf == NULL) {
+        cn->state = CONN_CLOSED;
+        return 0;
+    }
+    memcpy(wbuf, prefix, n);
+    memcpy(wbuf + n, date, dlen);
+    memcpy(wbuf + n + dlen, tail, tlen); // The crucial blank line ends the tail
+    cn->t_queued = clock_ns();
+    cn->wbuf = wbuf;
+    cn->wlen = n + dlen + tlen;
+    cn->woff = 0;
+    cn->bbuf = NULL;
+    cn->blen = cn->boff = 0;
+    cn->state = CONN_WRITING;
+    return 1;
+}
+
+/**
+ * Queues the HTTP status line and headers on the connection, replacing any
+ * previously queued response.
+ * @param cn The client connection.
+ * @param code The HTTP status code.
+ * @param contentType The Content-Type header value.
+ * @param data_length The size of the response body that will follow, in bytes.
+ * @param extra Room to reserve after the headers for a copied body.
+ * @return 1 on success, 0 if memory allocation failed.
+ */
+int http_queue_header(struct conn *cn, int code, const char *contentType, long data_length, size_t extra) {
+    char header_buf[1024];
+    int n = http_format_header(header_buf, sizeof(header_buf), code, contentType, data_length, NULL);
+
+    return http_queue_prefix(cn, header_buf, n, extra);
+}
+
+/**
+ * Queues the HTTP status line, headers, and data on the connection.
+ * Nothing is written here; conn_flush() drains the queue as the socket allows.
+ * The body is copied, so data may be released right after the call.
+ * @param cn The client connection.
+ * @param code The HTTP status code.
+ * @param contentType The Content-Type header value.
+ * @param data The response body.
+ * @param data_length The size of the response body in bytes.
+ */
+void http_send_response(struct conn *cn, int code, const char *contentType, const char *data, int data_length) {
+    if (!http_queue_header(cn, code, contentType, data_length, data_length)) return;
+    memcpy(cn->wbuf + cn->wlen, data, data_length);
+    cn->wlen += data_length;
+}
+
+/**
+ * Like http_send_response(), but the body is not copied: it goes out from
+ * data itself, in the same sendmsg() as the headers.
+ * @param data The response body. Must stay valid until the response has been
+ *        sent: static data, or memory from the connection's arena.
+ */
+void http_send_response_ref(struct conn *cn, int code, const char *contentType, const char *data, size_t data_length) {
+    if (!http_queue_header(cn, code, contentType, data_length, 0)) return;
+    cn->bbuf = data;
+    cn->blen = data_length;
+}
+
+/**
+ * Queues a response whose body is a byte range of the given file. Only the
+ * headers are buffered; the body is sent from the file by conn_flush() (or
+ * read by the io_uring backend). The connection takes ownership of fd.
+ * @param cn The client connection.
+ * @param prefix Header prefix from http_format_header().
+ * @param n Length of prefix.
+ * @param fd The open file.
+ * @param start First byte of the file to send.
+ * @param end Offset just past the last byte to send.
+ * @return 1 on success, 0 on error (fd is closed).
+ */
+int http_send_file(struct conn *cn, const char *prefix, size_t n, int fd, off_t start, off_t end) {
+    if (!http_queue_prefix(cn, prefix, n, 0)) {
+        close(fd);
+        return 0;
+    }
+    cn->file_fd = fd;
+    cn->file_start = cn->file_off = start;
+    cn->file_end = end;
+    cn->use_splice = 0;
+    return 1;
+}
+
+/**
+ * splice() fallback for files sendfile() cannot handle: file -> pipe -> socket,
+ * still without copying through user space. Bytes left in the pipe when the
+ * socket fills up are flushed first on the next call.
+ * @return 1 once the whole file is sent, 0 if the socket would block, -1 on error.
+ */
+int conn_splice_file(struct conn *cn) {
+    ssize_t n;
+
+    if (cn->pipe_fd[0] < 0 && pipe2(cn->pipe_fd, O_NONBLOCK | O_CLOEXEC) < 0) {
+        snprintf(error_msg, sizeof(error_msg), "pipe2() error: %s", strerror(errno));
+        return -1;
+    }
+
+    while (cn->pipe_len > 0 || cn->file_off < cn->file_end) {
+        if (cn->pipe_len == 0) {
+            loff_t off = cn->file_off;
+            size_t left = cn->file_end - cn->file_off;
+            n = splice(cn->file_fd, &off, cn->pipe_fd[1], NULL, left, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR) continue;
+                snprintf(error_msg, sizeof(error_msg), "splice() error: %s", n ? strerror(errno) : "file truncated");
+                return -1;
+            }
+            cn->file_off = off;
+            cn->pipe_len = n;
+        }
+
+        n = splice(cn->pipe_fd[0], NULL, cn->fd, NULL, cn->pipe_len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            snprintf(error_msg, sizeof(error_msg), "splice() error: %s", strerror(errno));
+            return -1;
+        }
+        cn->pipe_len -= n;
+    }
+    return 1;
+}
+
+/**
+ * Streams the file body from the page cache to the socket with sendfile(),
+ * switching to splice() if the file does not support it. Memory use does not
+ * depend on the file size.
+ * @return 1 once the whole file is sent, 0 if the socket would block, -1 on error.
+ */
+int conn_send_file(struct conn *cn) {
+    while (!cn->use_splice && cn->file_off < cn->file_end) {
+        ssize_t n = sendfile(cn->fd, cn->file_fd, &cn->file_off, cn->file_end - cn->file_off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            if (errno == EINVAL || errno == ENOSYS) {
+                cn->use_splice = 1;
+                break;
+            }
+            snprintf(error_msg, sizeof(error_msg), "sendfile() error: %s", strerror(errno));
+            return -1;
+        }
+        if (n == 0) {
+            snprintf(error_msg, sizeof(error_msg), "sendfile() error: file truncated");
+            return -1;
+        }
+    }
+
+    if (cn->use_splice) return conn_splice_file(cn);
+    return 1;
+}
+
+/**
+ * Writes as much of the queued response as the socket accepts: the buffered
+ * headers and the body (in one sendmsg(), resuming after short writes), then
+ * the file body if there is one.
+ * @param cn The client connection.
+ * @return 1 once everything is sent, 0 if the socket would block, -1 on error.
+ */
+int conn_flush(struct conn *cn) {
+    // With a file body behind them, let the headers share a segment with its first bytes.
+    int more = cn->file_fd >= 0 && cn->file_end > cn->file_off ? MSG_MORE : 0;
+
+    while (cn->woff < cn->wlen || cn->boff < cn->blen) {
+        struct iovec iov[2];
+        struct msghdr msg = { .msg_iov = iov };
+        ssize_t n;
+
+        if (cn->woff < cn->wlen) {
+            iov[msg.msg_iovlen++] = (struct iovec){cn->wbuf + cn->woff, cn->wlen - cn->woff};
+        }
+        if (cn->boff < cn->blen) {
+            iov[msg.msg_iovlen++] = (struct iovec){(char *)cn->bbuf + cn->boff, cn->blen - cn->boff};
+        }
+        n = sendmsg(cn->fd, &msg, MSG_NOSIGNAL | more);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            snprintf(error_msg, sizeof(error_msg), "sendmsg() error: %s", strerror(errno));
+            return -1;
+        }
+        if ((size_t)n <= cn->wlen - cn->woff) {
+            cn->woff += n;
+        } else {
+            cn->boff += n - (cn->wlen - cn->woff);
+            cn->woff = cn->wlen;
+        }
+    }
+
+    if (cn->file_fd >= 0) return conn_send_file(cn);
+    return 1;
+}
+
+// File extension to MIME type, as a perfect hash: every extension has a
+// slot of its own, so a lookup is one hash and one compare.
+struct mime_type {
+    const char *ext;
+    const char *type;
+};
+
+#define MIME_NONE 0xff // No known extension: served as text/plain
+#define MIME_EXT_MAX 7 // Longest extension in the table
+
+// Generated by tools/mime_phf.py; edit the list there and rerun.
+#define MIME_SLOTS 64
+#define MIME_SEED 2166136406u
+static const struct mime_type mime_types[MIME_SLOTS] = {
+    [2] = {"ogg", "audio/ogg"},
+    [3] = {"txt", "text/plain"},
+    [8] = {"wav", "audio/wav"},
+    [9] = {"htm", "text/html"},
+    [10] = {"png", "image/png"},
+    [12] = {"ico", "image/x-icon"},
+    [14] = {"woff", "font/woff"},
+    [15] = {"wasm", "application/wasm"},
+    [16] = {"xml", "application/xml"},
+    [17] = {"mp3", "audio/mpeg"},
+    [20] = {"mp4", "video/mp4"},
+    [25] = {"js", "application/javascript"},
+    [32] = {"webm", "video/webm"},
+    [38] = {"jpeg", "image/jpeg"},
+    [39] = {"webp", "image/webp"},
+    [40] = {"svg", "image/svg+xml"},
+    [41] = {"jpg", "image/jpeg"},
+    [44] = {"gif", "image/gif"},
+    [45] = {"avif", "image/avif"},
+    [49] = {"html", "text/html"},
+    [52] = {"mjs", "application/javascript"},
+    [54] = {"json", "application/json"},
+    [55] = {"css", "text/css"},
+    [58] = {"pdf", "application/pdf"},
+    [59] = {"woff2", "font/woff2"},
+};
+// End of generated code.
+
+/**
+ * Finds the MIME table slot of a file's extension. Extensions match
+ * case-insensitively.
+ * @param path The file path.
+ * @return The slot in mime_types[], or MIME_NONE.
+ */
+int mime_lookup(const char *path) {
+    const char *extension = strrchr(path, '.');
+    char ext[MIME_EXT_MAX + 1];
+    unsigned h = MIME_SEED;
+    int i;
+
+    if (extension == NULL) return MIME_NONE;
+    for (i = 0; extension[i + 1]; i++) {
+        unsigned char c = extension[i + 1];
+
+        if (i == MIME_EXT_MAX) return MIME_NONE;
+        if (c >= 'A' && c <= 'Z') c |= 0x20;
+        ext[i] = c;
+        h = (h ^ c) * 16777619u; // FNV-1a, as in the generator
+    }
+    ext[i] = '\0';
+    h = (h ^ (h >> 16)) & (MIME_SLOTS - 1);
+    return mime_types[h].ext && strcmp(mime_types[h].ext, ext) == 0 ? (int)h : MIME_NONE;
+}
+
+/**
+ * The MIME type of a mime_lookup() result.
+ */
+const char *mime_name(int slot) {
+    return slot == MIME_NONE ? "text/plain" : mime_types[slot].type;
+}
+
+/**
+ * Determines the Content-Type based on a file extension.
+ * @param path The file path.
+ * @return A string containing the correct MIME type.
+ */
+const char *get_content_type(const char *path) {
+    return mime_name(mime_lookup(path));
+}
+
+#define FIXED_BODY_MAX (64 * 1024) // Largest page kept as a fixed response
+
+// Responses whose bytes never change between requests: the error pages and
+// the form confirmation page. Each one is serialized once, header prefix and
+// body back to back, and copied onto a connection as is; only Date and
+// Connection are added per response. Every process keeps its own copy and
+// rebuilds it when the shared generation counter moves, which the docroot
+// watcher bumps whenever one of the underlying files changes.
+enum fixed_id {
+    FIXED_BAD_REQUEST,
+    FIXED_NOT_FOUND,
+    FIXED_NOT_ALLOWED,
+    FIXED_URI_TOO_LONG,
+    FIXED_HEADERS_TOO_LARGE,
+    FIXED_FORM_SUCCESS,
+    FIXED_REGISTERED,
+    FIXED_LOGIN_OK,
+    FIXED_LOGIN_FAILED,
+    FIXED_USER_EXISTS,
+    FIXED_SERVER_ERROR,
+    FIXED_BUSY,
+    FIXED_LOGGED_OUT,
+    FIXED_FORM_BUSY,
+    FIXED_TOO_LARGE,
+    NFIXED
+};
+
+struct fixed_response {
+    int code;
+    const char *file;  // Page to serve, or NULL for the built-in text
+    const char *text;  // Built-in body, also used when file cannot be read
+    const char *extra; // Further header lines, or NULL
+    char *blob;        // Header prefix followed by the body
+    size_t header_len;
+    size_t body_len;
+};
+
+struct fixed_response fixed[NFIXED] = {
+    [FIXED_BAD_REQUEST] = {400, NULL, "Bad Request"},
+    [FIXED_NOT_FOUND] = {404, NULL, "File not found"},
+    [FIXED_NOT_ALLOWED] = {405, NULL, "Method not supported "},
+    [FIXED_URI_TOO_LONG] = {414, NULL, "URI Too Long"},
+    [FIXED_HEADERS_TOO_LARGE] = {431, NULL, "Request Header Fields Too Large"},
+    [FIXED_FORM_SUCCESS] = {200, "./success.html",
+                            "<h2>Data Submitted Successfully!</h2><p>Check the form_data.txt file on the server.</p>"},
+    [FIXED_REGISTERED] = {200, NULL, "<h2>Registration successful</h2>"},
+    [FIXED_LOGIN_OK] = {200, NULL, "<h2>Login successful</h2>"},
+    [FIXED_LOGIN_FAILED] = {401, NULL, "Invalid username or password"},
+    [FIXED_USER_EXISTS] = {409, NULL, "Username already taken"},
+    [FIXED_SERVER_ERROR] = {500, NULL, "Internal Server Error"},
+    [FIXED_BUSY] = {503, NULL, "Too many login attempts in progress, try again shortly", "Retry-After: 1\r\n"},
+    [FIXED_LOGGED_OUT] = {200, NULL, "<h2>Logged out</h2>",
+                          "Set-Cookie: " SESSION_COOKIE "=; Path=/; HttpOnly; SameSite=Strict; Max-Age=0\r\n"},
+    [FIXED_FORM_BUSY] = {503, NULL, "Too many form submissions in progress, try again shortly", "Retry-After: 1\r\n"},
+    [FIXED_TOO_LARGE] = {413, NULL, "Content Too Large"},
+};
+
+pthread_rwlock_t fixed_lock = PTHREAD_RWLOCK_INITIALIZER;
+unsigned fixed_gen_local;
+unsigned *fixed_gen_shared = &fixed_gen_local; // Bumped on changes, shared by all workers
+unsigned fixed_gen = -1;                         // Generation this process last built
+
+/**
+ * Points an error status at a page in the docroot instead of its built-in text.
+ * Every response with that status gets the page (e.g. both 503s), each still
+ * with its own extra header lines.
+ * @param spec "<code>=<file>", e.g. "404=./404.html".
+ * @return 1 on success, 0 on error (error_msg is set).
+ */
+int fixed_configure(const char *spec) {
+    char *end, *path;
+    long code = strtol(spec, &end, 10);
+    int i, found = 0;
+
+    if (*end != '=' || end[1] == '\0') {
+        snprintf(error_msg, sizeof(error_msg), "bad error page '%s', expected <code>=<file>\n", spec);
+        return 0;
+    }
+    for (i = 0; i < NFIXED; i++) {
+        if (fixed[i].code == code && code >= 400) found = 1;
+    }
+    if (!found) {
+        snprintf(error_msg, sizeof(error_msg), "no configurable error page for status %ld\n", code);
+        return 0;
+    }
+    end++;
+    // Watched paths are spelled "./dir/file"; pages outside the docroot are read once.
+    if (end[0] == '/' || strncmp(end, "./", 2) == 0) {
+        path = end;
+    } else {
+        path = malloc(strlen(end) + 3);
+        if (path == NULL) {
+            snprintf(error_msg, sizeof(error_msg), "malloc() error for error page\n");
+            return 0;
+        }
+        sprintf(path, "./%s", end);
+    }
+    for (i = 0; i < NFIXED; i++) {
+        if (fixed[i].code == code) fixed[i].file = path;
+    }
+    return 1;
+}
+
+/**
+ * Serializes one fixed response from its file, or from its built-in text if
+ * the file is missing or too large.
+ * @return A malloc()ed blob, or NULL if memory allocation failed.
+ */
+char *fixed_build(const struct fixed_response *fr, size_t *header_len, size_t *body_len) {
+    char header_buf[1024];
+    const char *type = "text/plain";
+    const char *body = fr->text;
+    size_t len = strlen(fr->text);
+    char *page = NULL, *blob;
+    int hlen;
+
+    if (fr->file) {
+        int fd = open(fr->file, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+
+        if (fd < 0) {
+            perror("open() error for fixed response");
+        } else if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size <= FIXED_BODY_MAX &&
+                   (page = malloc(st.st_size + 1)) != NULL) {
+            ssize_t n = 0, got = 0;
+
+            while (got < st.st_size && (n = read(fd, page + got, st.st_size - got)) > 0) got += n;
+            if (n < 0) {
+                perror("read() error for fixed response");
+                free(page);
+                page = NULL;
+            } else {
+                body = page;
+                len = got;
+                type = get_content_type(fr->file);
+            }
+        }
+        if (fd >= 0) close(fd);
+    }
+    if (body == fr->text && fr->code == 200) type = "text/html";
+
+    hlen = http_format_header(header_buf, sizeof(header_buf), fr->code, type, len, fr->extra);
+    blob = malloc(hlen + len);
+    if (blob != NULL) {
+        memcpy(blob, header_buf, hlen);
+        memcpy(blob + hlen, body, len);
+        *header_len = hlen;
+        *body_len = len;
+    }
+    free(page);
+    return blob;
+}
+
+/**
+ * Rebuilds every fixed response of this process. The files are read before
+ * the lock is taken, so responses keep going out meanwhile.
+ */
+void fixed_refresh(void) {
+    unsigned gen = __atomic_load_n(fixed_gen_shared, __ATOMIC_ACQUIRE);
+    char *blob[NFIXED];
+    size_t header_len[NFIXED], body_len[NFIXED];
+    int i;
+
+    for (i = 0; i < NFIXED; i++) blob[i] = fixed_build(&fixed[i], &header_len[i], &body_len[i]);
+
+    pthread_rwlock_wrlock(&fixed_lock);
+    for (i = 0; i < NFIXED; i++) {
+        char *old = fixed[i].blob;
+
+        if (blob[i] == NULL) continue; // Out of memory: keep serving the previous version
+        fixed[i].blob = blob[i];
+        fixed[i].header_len = header_len[i];
+        fixed[i].body_len = body_len[i];
+        blob[i] = old;
+    }
+    __atomic_store_n(&fixed_gen, gen, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&fixed_lock);
+
+    for (i = 0; i < NFIXED; i++) free(blob[i]);
+}
+
+/**
+ * Tells every worker that a fixed response may be stale. Called by the
+ * docroot watcher; with a NULL path all of them are rebuilt.
+ */
+void fixed_invalidate(const char *path) {
+    int i;
+
+    for (i = 0; i < NFIXED && path; i++) {
+        if (fixed[i].file && strcmp(fixed[i].file, path) == 0) break;
+    }
+    if (i == NFIXED) return;
+    __atomic_add_fetch(fixed_gen_shared, 1, __ATOMIC_RELEASE);
+    fixed_refresh(); // Processes forked from now on start out current
+}
+
+void fixed_atfork_prepare(void) {
+    pthread_rwlock_wrlock(&fixed_lock);
+}
+
+void fixed_atfork_parent(void) {
+    pthread_rwlock_unlock(&fixed_lock);
+}
+
+void fixed_atfork_child(void) {
+    // The lock records its writer's thread id, which is not ours: start afresh.
+    pthread_rwlock_init(&fixed_lock, NULL);
+}
+
+/**
+ * Builds the fixed responses and maps their shared generation counter.
+ * Must run before workers are forked.
+ * @return 1 on success, 0 on error (error_msg is set).
+ */
+int fixed_init(void) {
+    unsigned *gen = mmap(NULL, sizeof(unsigned), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (gen == MAP_FAILED) {
+        snprintf(error_msg, sizeof(error_msg), "fixed response mmap() error: %s\n", strerror(errno));
+        return 0;
+    }
+    *gen = 0;
+    fixed_gen_shared = gen;
+    // A fork() during a rebuild must not leave the child with the lock held.
+    pthread_atfork(fixed_atfork_prepare, fixed_atfork_parent, fixed_atfork_child);
+    fixed_refresh();
+    return 1;
+}
+
+/**
+ * Queues one of the fixed responses with a further header line, such as a
+ * Set-Cookie that differs per response.
+ * @param cn The client connection.
+ * @param id Which response.
+ * @param extra "Name: value\r\n" lines, or NULL.
+ */
+void http_send_fixed_extra(struct conn *cn, enum fixed_id id, const char *extra) {
+    struct fixed_response *fr = &fixed[id];
+    size_t elen = extra ? strlen(extra) : 0;
+    char header_buf[1024];
+
+    if (__atomic_load_n(&fixed_gen, __ATOMIC_ACQUIRE) != __atomic_load_n(fixed_gen_shared, __ATOMIC_ACQUIRE)) {
+        fixed_refresh();
+    }
+    pthread_rwlock_rdlock(&fixed_lock);
+    if (fr->blob == NULL) {
+        pthread_rwlock_unlock(&fixed_lock);
+        http_send_response_ref(cn, fr->code, "text/plain", fr->text, strlen(fr->text));
+        return;
+    }
+    if (elen && fr->header_len + elen <= sizeof(header_buf)) {
+        memcpy(header_buf, fr->blob, fr->header_len);
+        memcpy(header_buf + fr->header_len, extra, elen);
+    } else {
+        elen = 0;
+    }
+    if (http_queue_prefix(cn, elen ? header_buf : fr->blob, fr->header_len + elen, fr->body_len)) {
+        memcpy(cn->wbuf + cn->wlen, fr->blob + fr->header_len, fr->body_len);
+        cn->wlen += fr->body_len;
+    }
+    pthread_rwlock_unlock(&fixed_lock);
+}
+
+/**
+ * Queues one of the fixed responses: a copy of its pre-serialized bytes, no
+ * formatting and no disk access.
+ * @param cn The client connection.
+ * @param id Which response.
+ */
+void http_send_fixed(struct conn *cn, enum fixed_id id) {
+    http_send_fixed_extra(cn, id, NULL);
+}
+
+/**
+ * Formats a time as an HTTP-date (RFC 7231 IMF-fixdate).
+ */
+void http_date(time_t t, char *buf, size_t size) {
+    struct tm tm;
+
+    gmtime_r(&t, &tm);
+    strftime(buf, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/**
+ * Parses an HTTP-date. Only the IMF-fixdate form is accepted; the obsolete
+ * RFC 850 and asctime forms are treated as invalid, which merely disables
+ * the condition that carries them.
+ * @return The time, or -1 if the value is not a valid date.
+ */
+time_t http_parse_date(struct str_view v) {
+    char buf[64];
+    struct tm tm;
+    char *end;
+
+    if (v.len >= sizeof(buf)) return -1;
+    memcpy(buf, v.p, v.len);
+    buf[v.len] = '\0';
+    memset(&tm, 0, sizeof(tm));
+    end = strptime(buf, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == NULL || *end != '\0') return -1;
+    return timegm(&tm);
+}
+
+const char not_modified_status[] = "HTTP/1.1 304 Not Modified\r\nServer: httpd.c\r\n";
+
+// The validators of one representation of a file and the headers built from
+// them, pre-serialized as the complete head of the 304 that answers a
+// matching conditional request. Past the status line, the same lines go into
+// the 200 response (see validator_lines()).
+struct validators {
+    char etag[48];     // Strong ETag with its quotes, "" while not known yet
+    time_t mtime;      // Last-Modified
+    int len;           // Length of head
+    char head[448];
+};
+
+/**
+ * The ETag, Last-Modified, Cache-Control and Vary lines of a validators
+ * head, for use as extra headers of the full response.
+ */
+const char *validator_lines(const struct validators *v) {
+    return v->head + sizeof(not_modified_status) - 1;
+}
+
+/**
+ * Fills in the validators of a representation.
+ * @param v The validators.
+ * @param etag The ETag, or "" to send none.
+ * @param suffix Appended inside the quotes of the ETag, so each content
+ *        coding of a file gets a tag of its own; "" for none.
+ * @param mtime Modification time of the file.
+ * @param cache_control The Cache-Control value, or NULL.
+ * @param vary Whether the response varies with Accept-Encoding.
+ */
+void validators_init(struct validators *v, const char *etag, const char *suffix, time_t mtime,
+                     const char *cache_control, int vary) {
+    size_t elen = strlen(etag), slen = strlen(suffix);
+    char date[64];
+    int n;
+
+    if (elen >= 2 && elen + slen < sizeof(v->etag)) {
+        memcpy(v->etag, etag, elen - 1); // Up to the closing quote
+        memcpy(v->etag + elen - 1, suffix, slen);
+        memcpy(v->etag + elen - 1 + slen, "\"", 2);
+    } else {
+        v->etag[0] = '\0';
+    }
+    v->mtime = mtime;
+    http_date(mtime, date, sizeof(date));
+
+    n = snprintf(v->head, sizeof(v->head), "%s", not_modified_status);
+    if (v->etag[0]) n += snprintf(v->head + n, sizeof(v->head) - n, "ETag: %s\r\n", v->etag);
+    n += snprintf(v->head + n, sizeof(v->head) - n, "Last-Modified: %s\r\n", date);
+    if (cache_control) n += snprintf(v->head + n, sizeof(v->head) - n, "Cache-Control: %s\r\n", cache_control);
+    if (vary) n += snprintf(v->head + n, sizeof(v->head) - n, "Vary: Accept-Encoding\r\n");
+    v->len = n < (int)sizeof(v->head) ? n : (int)sizeof(v->head) - 1;
+}
+
+/**
+ * Whether an entity tag appears in an If-None-Match list. Comparison is
+ * weak, as RFC 7232 requires for this header: W/ prefixes are ignored.
+ */
+int etag_list_match(struct str_view list, const char *etag) {
+    const char *p = list.p, *end = list.p + list.len;
+    size_t elen = strlen(etag);
+
+    while (p < end) {
+        const char *tag;
+
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        if (p == end) break;
+        if (*p == '*') return 1;
+        if (end - p > 2 && p[0] == 'W' && p[1] == '/') p += 2;
+        tag = p;
+        if (p < end && *p == '"') {
+            p++;
+            while (p < end && *p != '"') p++;
+            if (p < end) p++;
+        }
+        if ((size_t)(p - tag) == elen && memcmp(tag, etag, elen) == 0) return 1;
+        while (p < end && *p != ',') p++; // Skip anything malformed
+    }
+    return 0;
+}
+
+/**
+ * Evaluates If-None-Match, or If-Modified-Since when there is no
+ * If-None-Match (RFC 7232, section 6).
+ * @param cn The client connection.
+ * @param etag The current ETag, "" if none is known.
+ * @param mtime The current modification time.
+ * @return 1 if the client's copy is current and a 304 should be sent.
+ */
+int http_not_modified(struct conn *cn, const char *etag, time_t mtime) {
+    struct str_view inm = http_header(cn, HDR_IF_NONE_MATCH);
+    struct str_view ims;
+    time_t since;
+
+    if (inm.p) return etag[0] && etag_list_match(inm, etag);
+    ims = http_header(cn, HDR_IF_MODIFIED_SINCE);
+    if (!ims.p) return 0;
+    since = http_parse_date(ims);
+    return since != -1 && mtime <= since;
+}
+
+/**
+ * Queues the 304 of a representation whose validators matched.
+ */
+void http_send_not_modified(struct conn *cn, const struct validators *v) {
+    http_queue_prefix(cn, v->head, v->len, 0);
+}
+
+#define MAX_CACHE_RULES 16
+
+// Cache-Control values by path prefix, from -C. The longest matching prefix wins.
+struct cache_rule {
+    const char *prefix; // URL path prefix, e.g. "/img/"
+    size_t len;
+    const char *value;
+};
+
+struct cache_rule cache_rules[MAX_CACHE_RULES];
+int ncache_rules = 0;
+
+/**
+ * Adds a Cache-Control rule.
+ * @param spec "<path prefix>=<value>", e.g. "/img/=public, max-age=86400".
+ * @return 1 on success, 0 on error (error_msg is set).
+ */
+int cache_rule_add(const char *spec) {
+    const char *eq = strchr(spec, '=');
+
+    if (eq == NULL || spec[0] != '/' || eq[1] == '\0' || strpbrk(eq + 1, "\r\n")) {
+        snprintf(error_msg, sizeof(error_msg), "bad cache rule '%s', expected /prefix=value\n", spec);
+        return 0;
+    }
+    if (ncache_rules == MAX_CACHE_RULES) {
+        snprintf(error_msg, sizeof(error_msg), "too many cache rules (at most %d)\n", MAX_CACHE_RULES);
+        return 0;
+    }
+    cache_rules[ncache_rules].prefix = spec;
+    cache_rules[ncache_rules].len = eq - spec;
+    cache_rules[ncache_rules].value = eq + 1;
+    ncache_rules++;
+    return 1;
+}
+
+/**
+ * The Cache-Control value configured for a file.
+ * @param path A normalized path, "./dir/file".
+ * @return The value, or NULL to send no Cache-Control header.
+ */
+const char *cache_control_for(const char *path) {
+    const char *value = NULL;
+    size_t best = 0;
+    int i;
+
+    for (i = 0; i < ncache_rules; i++) {
+        const struct cache_rule *r = &cache_rules[i];
+        if (r->len >= best && strncmp(path + 1, r->prefix, r->len) == 0) {
+            value = r->value;
+            best = r->len;
+        }
+    }
+    return value;
+}
+
+// Content codings, in order of preference. Precompressed sidecars are served
+// for all of them; gzip is also produced on the fly and cached.
+enum coding {
+    CODING_BR,
+    CODING_ZSTD,
+    CODING_GZIP,
+    NCODINGS
+};
+
+struct coding_info {
+    const char *name; // Accept-Encoding / Content-Encoding token
+    const char *ext;  // Sidecar file suffix
+};
+
+const struct coding_info codings[NCODINGS] = {
+    [CODING_BR] = {"br", ".br"},
+    [CODING_ZSTD] = {"zstd", ".zst"},
+    [CODING_GZIP] = {"gzip", ".gz"},
+};
+
+// One cached file: precomputed header prefix, body and 304 head, stored back
+// to back in a block of the cache arena.
+struct cache_entry {
+    int next;        // Next entry in the hash chain or the free list, -1 ends it
+    int live;        // In the hash chain
+    int retired;     // Dropped while pinned; freed by the last cache_unpin()
+    int pins;        // Responses still sending the body from the arena
+    int referenced;  // CLOCK bit, set on every hit
+    int cls;         // Size class of the block
+    unsigned hash;
+    size_t off;      // Block offset in the arena
+    size_t header_len;
+    size_t body_len;
+    size_t nm_len;   // Length of the 304 head, 0 if conditionals are not evaluated
+    time_t mtime;
+    char etag[48];
+    char path[CACHE_PATH_MAX];
+};
+
+// One independently locked slice of the cache: a path's hash picks its
+// shard, and the shard owns the entries, hash chains and arena blocks of
+// those paths, so hits on different shards never contend. Blocks are carved
+// from the shard's part of the arena in power-of-two size classes and
+// recycled within their class; when a class runs dry, CLOCK evicts an
+// unpinned entry of that class.
+struct cache_shard {
+    pthread_mutex_t lock;  // Process-shared and robust
+    int broken;            // A worker died holding the lock; out of service until restart
+    int hand;              // CLOCK hand over entries[]
+    int free_entry;
+    size_t free_block[CACHE_CLASSES]; // Offset + 1 of the first free block, 0 if none
+    size_t base;           // The shard's part of the arena
+    size_t bump;           // Next offset never handed out
+    size_t limit;
+    int buckets[CACHE_SHARD_BUCKETS];
+    struct cache_entry entries[CACHE_SHARD_ENTRIES];
+} __attribute__((aligned(64)));
+
+// The static file cache. It lives in a shared anonymous mapping created before
+// any worker is forked, so processes and threads all see the same entries.
+// A hit queues the cached header and sends the body straight from the arena;
+// the entry stays pinned until the response is finished.
+struct file_cache {
+    unsigned seq;          // Bumped on every invalidation
+    struct cache_shard shards[CACHE_SHARDS];
+    char arena[];
+};
+
+struct file_cache *cache = NULL;
+
+unsigned cache_hash(const char *path) {
+    unsigned h = 2166136261u; // FNV-1a
+
+    while (*path) {
+        h ^= (unsigned char)*path++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/**
+ * Decides whether a URL may be cached. Paths with "." segments or empty
+ * segments have several spellings, which inotify invalidation could not
+ * match, so they are always served from disk.
+ */
+int cache_url_ok(const char *url) {
+    return strstr(url, "/.") == NULL && strstr(url, "//") == NULL && strchr(url, '\t') == NULL &&
+           strlen(url) + 2 < CACHE_PATH_MAX;
+}
+
+struct cache_shard *cache_shard_of(unsigned hash) {
+    return &cache->shards[hash & (CACHE_SHARDS - 1)];
+}
+
+int *cache_bucket(struct cache_shard *sh, unsigned hash) {
+    return &sh->buckets[(hash / CACHE_SHARDS) & (CACHE_SHARD_BUCKETS - 1)];
+}
+
+/**
+ * Empties a shard.
+ */
+void cache_shard_reset(struct cache_shard *sh) {
+    int i;
+
+    for (i = 0; i < CACHE_SHARD_BUCKETS; i++) sh->buckets[i] = -1;
+    for (i = 0; i < CACHE_SHARD_ENTRIES; i++) {
+        memset(&sh->entries[i], 0, sizeof(sh->entries[i]));
+        sh->entries[i].next = i + 1 < CACHE_SHARD_ENTRIES ? i + 1 : -1;
+    }
+    sh->free_entry = 0;
+    sh->hand = 0;
+    memset(sh->free_block, 0, sizeof(sh->free_block));
+    sh->bump = sh->base;
+}
+
+/**
+ * Locks a shard. A worker that died inside the shard may have left its
+ * entries and free lists half updated, and other processes may still be
+ * sending bodies pinned in its arena, some of them by pins nobody will ever
+ * release. Such a shard is never reset; it is taken out of service instead,
+ * so none of its memory is handed out again, and its paths are served from
+ * disk until the server restarts.
+ * @return 1 with the lock held, 0 if the shard is out of service (not locked).
+ */
+int cache_lock(struct cache_shard *sh) {
+    if (pthread_mutex_lock(&sh->lock) == EOWNERDEAD) {
+        sh->broken = 1;
+        pthread_mutex_consistent(&sh->lock);
+    }
+    if (sh->broken) {
+        pthread_mutex_unlock(&sh->lock);
+        return 0;
+    }
+    return 1;
+}
+
+void cache_unlock(struct cache_shard *sh) {
+    pthread_mutex_unlock(&sh->lock);
+}
+
+/**
+ * Maps the shared cache. Must run before workers are forked.
+ * @param bytes Size of the data arena, split evenly between the shards.
+ * @return 1 on success, 0 on error (error_msg is set).
+ */
+int cache_init(size_t bytes) {
+    pthread_mutexattr_t attr;
+    size_t part = bytes / CACHE_SHARDS / CACHE_MIN_BLOCK * CACHE_MIN_BLOCK;
+    size_t total = sizeof(struct file_cache) + bytes;
+    int i;
+
+    cache = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (cache == MAP_FAILED) {
+        cache = NULL;
+        snprintf(error_msg, sizeof(error_msg), "cache mmap() error: %s\n", strerror(errno));
+        return 0;
+    }
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *sh = &cache->shards[i];
+
+        pthread_mutex_init(&sh->lock, &attr);
+        sh->base = i * part;
+        sh->limit = sh->base + part;
+        cache_shard_reset(sh);
+    }
+    pthread_mutexattr_destroy(&attr);
+    return 1;
+}
+
+/**
+ * Returns an unlinked entry's block and slot to the free lists.
+ * Caller holds the shard lock.
+ */
+void cache_free_locked(struct cache_shard *sh, int idx) {
+    struct cache_entry *e = &sh->entries[idx];
+
+    // The first bytes of a free block hold the next free offset.
+    memcpy(cache->arena + e->off, &sh->free_block[e->cls], sizeof(size_t));
+    sh->free_block[e->cls] = e->off + 1;
+
+    e->live = 0;
+    e->retired = 0;
+    e->next = sh->free_entry;
+    sh->free_entry = idx;
+}
+
+/**
+ * Unlinks a live entry. Its memory is reused at once, or after the last
+ * response sending from it has finished. Caller holds the shard lock.
+ */
+void cache_drop_locked(struct cache_shard *sh, int idx) {
+    struct cache_entry *e = &sh->entries[idx];
+    int *link = cache_bucket(sh, e->hash);
+
+    while (*link != idx) link = &sh->entries[*link].next;
+    *link = e->next;
+
+    if (e->pins > 0) {
+        e->live = 0;
+        e->retired = 1;
+        return;
+    }
+    cache_free_locked(sh, idx);
+}
+
+/**
+ * Advances the CLOCK hand until it evicts an unreferenced, unpinned entry,
+ * optionally only of the given size class. Caller holds the shard lock.
+ * @return 1 if an entry was evicted.
+ */
+int cache_evict_locked(struct cache_shard *sh, int cls) {
+    int steps;
+
+    for (steps = 0; steps < 2 * CACHE_SHARD_ENTRIES; steps++) {
+        struct cache_entry *e = &sh->entries[sh->hand];
+        int idx = sh->hand;
+
+        sh->hand = (sh->hand + 1) % CACHE_SHARD_ENTRIES;
+        if (!e->live || e->pins > 0 || (cls >= 0 && e->cls != cls)) continue;
+        if (e->referenced) {
+            e->referenced = 0;
+            continue;
+        }
+        cache_drop_locked(sh, idx);
+        return 1;
+    }
+    return 0;
+}
+
+int cache_find_locked(struct cache_shard *sh, const char *path, unsigned hash) {
+    int idx = *cache_bucket(sh, hash);
+
+    while (idx >= 0) {
+        struct cache_entry *e = &sh->entries[idx];
+        if (e->hash == hash && strcmp(e->path, path) == 0) return idx;
+        idx = e->next;
+    }
+    return -1;
+}
+
+/**
+ * Current invalidation sequence number. Read it before loading a file from
+ * disk and pass it to cache_insert(), which then refuses the data if the
+ * file may have changed in between.
+ */
+unsigned cache_seq(void) {
+    return cache ? __atomic_load_n(&cache->seq, __ATOMIC_ACQUIRE) : 0;
+}
+
+/**
+ * Releases the cache entry a connection's response was sent from.
+ * @param cn The client connection.
+ */
+void cache_unpin(struct conn *cn) {
+    struct cache_entry *e = cn->cache_pin;
+    struct cache_shard *sh;
+
+    if (e == NULL) return;
+    cn->cache_pin = NULL;
+    sh = cache_shard_of(e->hash);
+    if (!cache_lock(sh)) return;
+    if (--e->pins == 0 && e->retired) cache_free_locked(sh, e - sh->entries);
+    cache_unlock(sh);
+}
+
+/**
+ * Serves a file from the cache: queues the cached headers and points the
+ * body at the cached bytes, which go out without being copied, or queues
+ * the cached 304 head when the request's conditionals show the client's
+ * copy is current.
+ * @param cn The client connection.
+ * @param path The file path.
+ * @return 1 on a hit, 0 on a miss.
+ */
+int cache_lookup(struct conn *cn, const char *path) {
+    struct cache_shard *sh;
+    struct cache_entry *e;
+    unsigned hash;
+    int idx;
+
+    if (cache == NULL) return 0;
+    cache_unpin(cn);
+    hash = cache_hash(path);
+    sh = cache_shard_of(hash);
+
+    if (!cache_lock(sh)) return 0;
+    idx = cache_find_locked(sh, path, hash);
+    if (idx < 0) {
+        cache_unlock(sh);
+        return 0;
+    }
+
+    e = &sh->entries[idx];
+    if (e->nm_len && http_not_modified(cn, e->etag, e->mtime)) {
+        http_queue_prefix(cn, cache->arena + e->off + e->header_len + e->body_len, e->nm_len, 0);
+    } else if (http_queue_prefix(cn, cache->arena + e->off, e->header_len, 0)) {
+        // The body stays in the arena; the pin keeps it there until the response is done.
+        cn->bbuf = cache->arena + e->off + e->header_len;
+        cn->blen = e->body_len;
+        e->pins++;
+        cn->cache_pin = e;
+    }
+    e->referenced = 1;
+    cache_unlock(sh);
+    return 1;
+}
+
+/**
+ * Adds a file to the cache, evicting other entries of its shard as needed.
+ * @param path The file path.
+ * @param header The header prefix from http_format_header().
+ * @param header_len Length of header.
+ * @param body The file contents.
+ * @param body_len Length of body.
+ * @param v The response's validators, or NULL to always answer with the body.
+ * @param seq cache_seq() from before the file was read.
+ */
+void cache_insert(const char *path, const char *header, size_t header_len,
+                  const char *body, size_t body_len, const struct validators *v, unsigned seq) {
+    size_t nm_len = v ? v->len : 0;
+    size_t need = header_len + body_len + nm_len;
+    struct cache_shard *sh;
+    struct cache_entry *e;
+    unsigned hash;
+    int cls = 0, idx;
+    size_t off;
+
+    if (cache == NULL || need > CACHE_MAX_ENTRY || strlen(path) >= CACHE_PATH_MAX) return;
+    while ((size_t)(CACHE_MIN_BLOCK << cls) < need) cls++;
+    hash = cache_hash(path);
+    sh = cache_shard_of(hash);
+
+    if (!cache_lock(sh)) return;
+    if (__atomic_load_n(&cache->seq, __ATOMIC_ACQUIRE) != seq || cache_find_locked(sh, path, hash) >= 0) {
+        cache_unlock(sh); // Changed on disk since it was read, or already cached
+        return;
+    }
+
+    if (sh->free_entry < 0 && !cache_evict_locked(sh, -1)) {
+        cache_unlock(sh);
+        return;
+    }
+
+    if (sh->free_block[cls] == 0) {
+        size_t size = (size_t)CACHE_MIN_BLOCK << cls;
+        if (sh->bump + size <= sh->limit) {
+            memcpy(cache->arena + sh->bump, &sh->free_block[cls], sizeof(size_t));
+            sh->free_block[cls] = sh->bump + 1;
+            sh->bump += size;
+        } else if (!cache_evict_locked(sh, cls)) {
+            cache_unlock(sh);
+            return;
+        }
+    }
+    off = sh->free_block[cls] - 1;
+    memcpy(&sh->free_block[cls], cache->arena + off, sizeof(size_t));
+
+    idx = sh->free_entry;
+    e = &sh->entries[idx];
+    sh->free_entry = e->next;
+
+    e->live = 1;
+    e->retired = 0;
+    e->pins = 0;
+    e->referenced = 1;
+    e->cls = cls;
+    e->hash = hash;
+    e->off = off;
+    e->header_len = header_len;
+    e->body_len = body_len;
+    e->nm_len = nm_len;
+    e->mtime = v ? v->mtime : 0;
+    strcpy(e->etag, v ? v->etag : "");
+    strcpy(e->path, path);
+    memcpy(cache->arena + off, header, header_len);
+    memcpy(cache->arena + off + header_len, body, body_len);
+    if (v) memcpy(cache->arena + off + header_len + body_len, v->head, nm_len);
+
+    e->next = *cache_bucket(sh, hash);
+    *cache_bucket(sh, hash) = idx;
+    cache_unlock(sh);
+}
+
+/**
+ * Builds the cache key of a compressed variant of a file. Tabs never appear
+ * in cacheable paths, so variant keys cannot collide with file paths.
+ */
+void cache_variant_key(char *buf, size_t size, const char *path, int coding) {
+    snprintf(buf, size, "%s\t%s", path, codings[coding].name);
+}
+
+/**
+ * Drops one cache key, if it is cached.
+ */
+void cache_drop_key(const char *key) {
+    unsigned hash = cache_hash(key);
+    struct cache_shard *sh = cache_shard_of(hash);
+    int idx;
+
+    if (!cache_lock(sh)) return;
+    if ((idx = cache_find_locked(sh, key, hash)) >= 0) cache_drop_locked(sh, idx);
+    cache_unlock(sh);
+}
+
+/**
+ * Drops a file and its compressed variants. A changed sidecar (e.g.
+ * "style.css.br") also drops the variants of the file it belongs to, so a
+ * cached on-the-fly gzip cannot shadow a newly added sidecar.
+ */
+void cache_drop_path(const char *path) {
+    char key[CACHE_PATH_MAX + 8];
+    size_t len = strlen(path);
+    int c;
+
+    cache_drop_key(path);
+    for (c = 0; c < NCODINGS; c++) {
+        size_t elen = strlen(codings[c].ext);
+
+        cache_variant_key(key, sizeof(key), path, c);
+        cache_drop_key(key);
+
+        if (len > elen && len - elen < sizeof(key) && strcmp(path + len - elen, codings[c].ext) == 0) {
+            memcpy(key, path, len - elen);
+            key[len - elen] = '\0';
+            cache_drop_path(key);
+        }
+    }
+}
+
+/**
+ * Drops a file from the cache. With a NULL path the whole cache is emptied.
+ */
+void cache_invalidate(const char *path) {
+    int i, idx;
+
+    if (cache == NULL) return;
+    // Bump first: an insert racing with this either sees the new number and
+    // gives up, or got in before and is dropped below.
+    __atomic_add_fetch(&cache->seq, 1, __ATOMIC_RELEASE);
+    if (path != NULL) {
+        cache_drop_path(path);
+        return;
+    }
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *sh = &cache->shards[i];
+
+        if (!cache_lock(sh)) continue;
+        for (idx = 0; idx < CACHE_SHARD_ENTRIES; idx++) {
+            if (sh->entries[idx].live) cache_drop_locked(sh, idx);
+        }
+        cache_unlock(sh);
+    }
+}
+
+// The access log as a docroot path ("./logs/access.jsonl"), "" if it is
+// disabled or lies outside the docroot. Set once at startup.
+char access_log_path[PATH_MAX];
+
+/**
+ * Tells whether a docroot path must never be served: hidden files and the
+ * server's own data files, which live in the docroot directory (users.txt,
+ * form_data.txt, and the access log with its rotated copies).
+ * @param path A normalized path, "./dir/file".
+ * @return 1 if the path is off limits, 0 otherwise.
+ */
+int docroot_private(const char *path) {
+    size_t len = strlen(access_log_path);
+
+    if (strstr(path + 1, "/.") != NULL) return 1;
+    if (strcmp(path, "./users.txt") == 0 || strcmp(path, "./form_data.txt") == 0) return 1;
+    return len && strncmp(path, access_log_path, len) == 0 && (path[len] == '\0' || path[len] == '.');
+}
+
+// Metadata of a file under the docroot, as of the last scan or change event.
+struct file_meta {
+    off_t size;
+    time_t mtime;
+    long mtime_nsec;
+    unsigned version;   // New on every rewrite of the entry, so stale fds are noticed
+    int slot;           // Index slot, also the file's slot in the per-process fd table
+    int mime;           // mime_types[] slot, or MIME_NONE
+    char etag[40];
+};
+
+struct index_entry {
+    unsigned hash;      // 0 marks a free slot
+    struct file_meta meta;
+    char path[CACHE_PATH_MAX];
+};
+
+// Every regular file under the docroot, by normalized path ("./dir/file").
+// It lives in shared memory, built before any worker is forked and then kept
+// current by the watcher thread, its only writer. Readers copy an entry out
+// under a sequence lock and retry if an update overlapped; they never block.
+// Open addressing with linear probing, at most 3/4 full, so almost every
+// lookup is a single probe.
+struct docroot_index {
+    unsigned seq;       // Odd while an update is in progress
+    int count;
+    int complete;       // 0 once a file did not fit: misses must then be checked on disk
+    unsigned next_version;
+    struct index_entry slots[INDEX_SLOTS];
+};
+
+struct docroot_index *docroot = NULL;
+int index_unhashed;     // Set when an entry may still lack its ETag
+
+// Open descriptors of indexed files, by index slot. Per process, because
+// descriptors are; a stripe of locks keeps the thread-pool workers apart.
+struct fd_slot {
+    int fd;
+    unsigned version;   // Entry version the fd was opened for, 0 if none
+};
+
+struct fd_slot *fd_slots = NULL;
+pthread_mutex_t fd_slot_locks[64];
+time_t fd_slots_swept;
+unsigned fd_slots_seq;
+
+unsigned index_hash(const char *path) {
+    unsigned h = cache_hash(path);
+    return h ? h : 1;
+}
+
+void index_write_begin(void) {
+    __atomic_store_n(&docroot->seq, docroot->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void index_write_end(void) {
+    __atomic_store_n(&docroot->seq, docroot->seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Finds a path in the index. Writer side only.
+ * @return The slot, or -1.
+ */
+int index_find(const char *path, unsigned hash) {
+    int i, n;
+
+    for (i = hash & (INDEX_SLOTS - 1), n = 0; n < INDEX_SLOTS; i = (i + 1) & (INDEX_SLOTS - 1), n++) {
+        struct index_entry *e = &docroot->slots[i];
+        if (e->hash == 0) return -1;
+        if (e->hash == hash && strcmp(e->path, path) == 0) return i;
+    }
+    return -1;
+}
+
+/**
+ * Describes a file from its stat() results. The ETag is left empty: it is a
+ * hash of the contents, filled in later by index_hash_pending().
+ */
+void file_meta_fill(struct file_meta *m, const char *path, const struct stat *st) {
+    m->size = st->st_size;
+    m->mtime = st->st_mtim.tv_sec;
+    m->mtime_nsec = st->st_mtim.tv_nsec;
+    m->version = 0;
+    m->slot = -1;
+    m->mime = mime_lookup(path);
+    m->etag[0] = '\0';
+}
+
+/**
+ * A fresh entry version. Never 0, which marks an empty fd slot.
+ */
+unsigned index_next_version(void) {
+    if (++docroot->next_version == 0) docroot->next_version++;
+    return docroot->next_version;
+}
+
+/**
+ * Fills in an entry's metadata from stat() results and gives it a new version.
+ */
+void index_fill(struct index_entry *e, int slot, const struct stat *st) {
+    file_meta_fill(&e->meta, e->path, st);
+    index_unhashed = 1;
+    e->meta.version = index_next_version();
+    e->meta.slot = slot;
+}
+
+/**
+ * Removes the entry in a slot, shifting later entries of its probe run back
+ * so no tombstones are needed. Caller is inside index_write_begin/end.
+ */
+void index_delete_slot(int i) {
+    int j = i;
+
+    docroot->count--;
+    while (1) {
+        struct index_entry *e;
+        int home;
+
+        j = (j + 1) & (INDEX_SLOTS - 1);
+        e = &docroot->slots[j];
+        if (e->hash == 0) break;
+        home = e->hash & (INDEX_SLOTS - 1);
+        // Leave it if its home lies cyclically in (i, j].
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) continue;
+        docroot->slots[i] = *e;
+        docroot->slots[i].meta.slot = i;
+        docroot->slots[i].meta.version = index_next_version();
+        i = j;
+    }
+    docroot->slots[i].hash = 0;
+}
+
+/**
+ * Brings the index entry of one path in line with the filesystem: added or
+ * updated if it is a regular file, removed otherwise. Hidden files (any
+ * segment starting with '.') are never indexed.
+ * @param path A normalized path, "./dir/file".
+ */
+void index_update(const char *path) {
+    unsigned hash;
+    struct stat st;
+    int i, present;
+
+    if (docroot == NULL) return;
+    hash = index_hash(path);
+    present = !docroot_private(path) && strlen(path) < CACHE_PATH_MAX &&
+              stat(path, &st) == 0 && S_ISREG(st.st_mode);
+
+    index_write_begin();
+    i = index_find(path, hash);
+    if (present && i < 0) {
+        if (docroot->count >= INDEX_MAX_LOAD) {
+            docroot->complete = 0;
+        } else {
+            for (i = hash & (INDEX_SLOTS - 1); docroot->slots[i].hash; i = (i + 1) & (INDEX_SLOTS - 1))
+                ;
+            strcpy(docroot->slots[i].path, path);
+            index_fill(&docroot->slots[i], i, &st);
+            docroot->slots[i].hash = hash;
+            docroot->count++;
+        }
+    } else if (present) {
+        index_fill(&docroot->slots[i], i, &st);
+    } else if (i >= 0) {
+        index_delete_slot(i);
+    }
+    index_write_end();
+}
+
+/**
+ * Indexes every regular file below a directory.
+ */
+void index_add_tree(const char *dir) {
+    struct dirent *de;
+    DIR *d = opendir(dir);
+
+    if (d == NULL) return;
+    while ((de = readdir(d)) != NULL) {
+        char sub[CACHE_PATH_MAX];
+        struct stat st;
+
+        if (de->d_name[0] == '.') continue;
+        if (snprintf(sub, sizeof(sub), "%s/%s", dir, de->d_name) >= (int)sizeof(sub)) {
+            __atomic_store_n(&docroot->complete, 0, __ATOMIC_RELEASE); // Cannot be indexed
+            continue;
+        }
+        if (stat(sub, &st) < 0) continue;
+        if (S_ISDIR(st.st_mode)) index_add_tree(sub);
+        else if (S_ISREG(st.st_mode)) index_update(sub);
+    }
+    closedir(d);
+}
+
+/**
+ * Drops every entry below a directory that was removed or moved away, then
+ * indexes whatever is there now.
+ */
+void index_update_tree(const char *dir) {
+    size_t len = strlen(dir);
+    int i;
+
+    if (docroot == NULL) return;
+    index_write_begin();
+    for (i = 0; i < INDEX_SLOTS; i++) {
+        struct index_entry *e = &docroot->slots[i];
+        // Deleting shifts a later entry into slot i, so look at it again.
+        while (e->hash && strncmp(e->path, dir, len) == 0 && e->path[len] == '/') index_delete_slot(i);
+    }
+    index_write_end();
+    index_add_tree(dir);
+}
+
+/**
+ * Rescans the whole docroot, e.g. after inotify lost events.
+ */
+void index_rebuild(void) {
+    if (docroot == NULL) return;
+    index_write_begin();
+    memset(docroot->slots, 0, sizeof(docroot->slots));
+    docroot->count = 0;
+    docroot->complete = 1;
+    index_write_end();
+    index_add_tree(".");
+}
+
+/**
+ * Empties the index for good and makes every lookup go to the disk. Used
+ * when the watcher stops and the index could no longer be kept current.
+ */
+void index_disable(void) {
+    if (docroot == NULL) return;
+    index_write_begin();
+    memset(docroot->slots, 0, sizeof(docroot->slots));
+    docroot->count = 0;
+    docroot->complete = 0;
+    index_write_end();
+}
+
+/**
+ * Maps the docroot index and fills it. Must run before workers are forked.
+ * @return 1 on success, 0 on error (error_msg is set).
+ */
+int index_init(void) {
+    int i;
+
+    docroot = mmap(NULL, sizeof(struct docroot_index), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    fd_slots = calloc(INDEX_SLOTS, sizeof(struct fd_slot));
+    if (docroot == MAP_FAILED || fd_slots == NULL) {
+        if (docroot != MAP_FAILED) munmap(docroot, sizeof(struct docroot_index));
+        docroot = NULL;
+        free(fd_slots);
+        fd_slots = NULL;
+        snprintf(error_msg, sizeof(error_msg), "docroot index allocation failed\n");
+        return 0;
+    }
+    for (i = 0; i < 64; i++) pthread_mutex_init(&fd_slot_locks[i], NULL);
+    docroot->complete = 1;
+    index_add_tree(".");
+    return 1;
+}
+
+/**
+ * Looks up a normalized path in the docroot index.
+ * @param path The path, "./dir/file".
+ * @param meta Set to the file's metadata when found.
+ * @return 1 if found, 0 if there is no such file, -1 if the index cannot
+ *         tell (not built, overflowed, or busy) and the disk must be asked.
+ */
+int index_lookup(const char *path, struct file_meta *meta) {
+    unsigned hash;
+    int tries;
+
+    if (docroot == NULL) return -1;
+    hash = index_hash(path);
+
+    for (tries = 0; tries < 4; tries++) {
+        unsigned seq = __atomic_load_n(&docroot->seq, __ATOMIC_ACQUIRE);
+        int found = 0, complete, i, n;
+
+        if (seq & 1) continue; // An update is in progress
+        for (i = hash & (INDEX_SLOTS - 1), n = 0; n < INDEX_SLOTS; i = (i + 1) & (INDEX_SLOTS - 1), n++) {
+            struct index_entry *e = &docroot->slots[i];
+            unsigned h = __atomic_load_n(&e->hash, __ATOMIC_RELAXED);
+
+            if (h == 0) break;
+            if (h == hash && strncmp(e->path, path, CACHE_PATH_MAX) == 0) {
+                *meta = e->meta;
+                found = 1;
+                break;
+            }
+        }
+        complete = docroot->complete;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&docroot->seq, __ATOMIC_RELAXED) == seq) return found ? 1 : complete ? 0 : -1;
+    }
+    return -1;
+}
+
+/**
+ * Hashes a file's contents for its ETag: the first 128 bits of its SHA-256,
+ * in hex, so files that differ anywhere practically never share a tag.
+ * @param fd The open file.
+ * @param st fstat() results for fd.
+ * @param etag Receives the quoted ETag.
+ * @param size Size of etag; needs 35 bytes.
+ * @return 1 on success, 0 if the file could not be read in full.
+ */
+int file_etag(int fd, const struct stat *st, char *etag, size_t size) {
+    static char buf[65536]; // Watcher thread only
+    static const char hex[] = "0123456789abcdef";
+    unsigned char md[EVP_MAX_MD_SIZE];
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    off_t off = 0;
+    ssize_t n;
+    int i, ok;
+
+    if (ctx == NULL || size < 35 || !EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)) {
+        EVP_MD_CTX_free(ctx);
+        return 0;
+    }
+    while (off < st->st_size && (n = pread(fd, buf, sizeof(buf), off)) > 0) {
+        EVP_DigestUpdate(ctx, buf, n);
+        off += n;
+    }
+    ok = off == st->st_size && EVP_DigestFinal_ex(ctx, md, NULL);
+    EVP_MD_CTX_free(ctx);
+    if (!ok) return 0;
+
+    etag[0] = '"';
+    for (i = 0; i < 16; i++) {
+        etag[1 + 2 * i] = hex[md[i] >> 4];
+        etag[2 + 2 * i] = hex[md[i] & 15];
+    }
+    etag[33] = '"';
+    etag[34] = '\0';
+    return 1;
+}
+
+/**
+ * Computes the ETags the index is still missing, once per file version, on
+ * the watcher thread so requests never wait for a hash. Stops early when
+ * docroot events are waiting, since they may make the work moot; entries
+ * that changed while being hashed are left for the next pass.
+ * @param ifd The inotify descriptor.
+ */
+void index_hash_pending(int ifd) {
+    struct pollfd pfd = {.fd = ifd, .events = POLLIN};
+    int i;
+
+    if (docroot == NULL || !index_unhashed) return;
+    for (i = 0; i < INDEX_SLOTS; i++) {
+        struct index_entry *e = &docroot->slots[i];
+        char path[CACHE_PATH_MAX], etag[sizeof(e->meta.etag)];
+        struct stat st;
+        unsigned version;
+        int fd, ok;
+
+        if (e->hash == 0 || e->meta.etag[0]) continue;
+        if (poll(&pfd, 1, 0) > 0) return; // Events first; come back afterwards
+        strcpy(path, e->path);
+        version = e->meta.version;
+
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) continue;
+        ok = fstat(fd, &st) == 0 && st.st_size == e->meta.size && st.st_mtim.tv_sec == e->meta.mtime &&
+             st.st_mtim.tv_nsec == e->meta.mtime_nsec && file_etag(fd, &st, etag, sizeof(etag));
+        close(fd);
+        // The watcher is the index's only writer, so the entry can only have
+        // moved if an event was handled meanwhile; check anyway.
+        if (!ok || e->hash == 0 || e->meta.version != version || strcmp(e->path, path) != 0) continue;
+
+        index_write_begin();
+        memcpy(e->meta.etag, etag, sizeof(etag));
+        index_write_end();
+        cache_invalidate(path); // Cached copies were stored without the ETag
+    }
+    index_unhashed = 0;
+}
+
+/**
+ * Closes descriptors whose files have since changed or left the index, at
+ * most once a second and only after the index changed, so deleted files do
+ * not stay pinned open. Caller holds no fd slot lock.
+ */
+void fd_slots_sweep(void) {
+    unsigned seq = __atomic_load_n(&docroot->seq, __ATOMIC_ACQUIRE);
+    struct timespec ts;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    if (seq == fd_slots_seq || ts.tv_sec == fd_slots_swept) return;
+    fd_slots_swept = ts.tv_sec;
+    fd_slots_seq = seq;
+    for (i = 0; i < INDEX_SLOTS; i++) {
+        struct fd_slot *s = &fd_slots[i];
+        struct index_entry *e = &docroot->slots[i];
+
+        if (!s->version || (__atomic_load_n(&e->hash, __ATOMIC_RELAXED) &&
+                            s->version == __atomic_load_n(&e->meta.version, __ATOMIC_RELAXED))) {
+            continue;
+        }
+        pthread_mutex_lock(&fd_slot_locks[i & 63]);
+        if (s->version) close(s->fd);
+        s->version = 0;
+        pthread_mutex_unlock(&fd_slot_locks[i & 63]);
+    }
+}
+
+/**
+ * Opens a file under the docroot for a response. Files the index knows are
+ * served from a descriptor kept open in their fd slot, so the path is only
+ * walked once per version of the file; files it knows are absent cost no
+ * system call at all.
+ * @param path A normalized path, "./dir/file".
+ * @param meta Set to the file's metadata.
+ * @return A descriptor the caller owns, or -1 if there is no such regular file.
+ */
+int docroot_open(const char *path, struct file_meta *meta) {
+    struct fd_slot *s;
+    struct stat st;
+    int fd, known = index_lookup(path, meta);
+
+    if (known == 0) return -1;
+    if (known < 0 || fd_slots == NULL) {
+        // Not indexed: hidden files and the server's data files stay hidden either way.
+        if (docroot_private(path)) return -1;
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return -1;
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+            close(fd);
+            return -1;
+        }
+        file_meta_fill(meta, path, &st);
+        return fd;
+    }
+
+    fd_slots_sweep();
+    s = &fd_slots[meta->slot];
+    pthread_mutex_lock(&fd_slot_locks[meta->slot & 63]);
+    if (s->version != meta->version) {
+        if (s->version) close(s->fd);
+        s->fd = open(path, O_RDONLY | O_CLOEXEC);
+        s->version = s->fd >= 0 ? meta->version : 0;
+    }
+    // The slot keeps its own descriptor; the response gets a duplicate to close.
+    // Duplicates share the file offset, so bodies are read with pread()/sendfile() at explicit offsets.
+    fd = s->version ? fcntl(s->fd, F_DUPFD_CLOEXEC, 0) : -1;
+    pthread_mutex_unlock(&fd_slot_locks[meta->slot & 63]);
+    return fd;
+}
+
+/**
+ * Turns a request path into the docroot path it names, "./dir/file": empty
+ * and "." segments are dropped and ".." segments resolved, so every spelling
+ * of a file maps to the one the index knows it by. "/" names index.html.
+ * @param out Output buffer.
+ * @param size Size of out; the result is never longer than len + 2.
+ * @param p The request path, without the query string.
+ * @param len Length of p.
+ * @return Length of the result, or 0 if the path climbs above the docroot.
+ */
+size_t docroot_path(char *out, size_t size, const char *p, size_t len) {
+    const char *end = p + len;
+    size_t n = 1;
+
+    out[0] = '.';
+    while (p < end) {
+        const char *seg = p;
+        size_t slen;
+
+        while (p < end && *p != '/') p++;
+        slen = p - seg;
+        p++;
+        if (slen == 0 || (slen == 1 && seg[0] == '.')) continue;
+        if (slen == 2 && seg[0] == '.' && seg[1] == '.') {
+            if (n == 1) return 0;
+            while (out[--n] != '/')
+                ;
+            continue;
+        }
+        if (n + 1 + slen + 1 > size) return 0;
+        out[n++] = '/';
+        memcpy(out + n, seg, slen);
+        n += slen;
+    }
+    if (n == 1) {
+        if (size < sizeof("./index.html")) return 0;
+        strcpy(out, "./index.html");
+        return sizeof("./index.html") - 1;
+    }
+    out[n] = '\0';
+    return n;
+}
+
+// Maps inotify watch descriptors back to directory paths. Only the watcher
+// thread touches it.
+struct watch_dir {
+    int wd;
+    char path[CACHE_PATH_MAX];
+};
+
+struct watch_dir *watch_dirs = NULL;
+int nwatch_dirs = 0;
+
+/**
+ * Watches a directory and, recursively, its subdirectories. Hidden
+ * directories (.git and friends) are skipped.
+ */
+void watch_tree(int ifd, const char *dir) {
+    const uint32_t mask = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+                          IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+    struct watch_dir *dirs;
+    struct dirent *de;
+    DIR *d;
+    int wd = inotify_add_watch(ifd, dir, mask);
+
+    if (wd < 0) {
+        perror("inotify_add_watch() failed");
+        return;
+    }
+    dirs = realloc(watch_dirs, (nwatch_dirs + 1) * sizeof(struct watch_dir));
+    if (dirs == NULL) return;
+    watch_dirs = dirs;
+    watch_dirs[nwatch_dirs].wd = wd;
+    snprintf(watch_dirs[nwatch_dirs].path, CACHE_PATH_MAX, "%s", dir);
+    nwatch_dirs++;
+
+    d = opendir(dir);
+    if (d == NULL) return;
+    while ((de = readdir(d)) != NULL) {
+        char sub[CACHE_PATH_MAX];
+        struct stat st;
+
+        if (de->d_name[0] == '.') continue;
+        if (snprintf(sub, sizeof(sub), "%s/%s", dir, de->d_name) >= (int)sizeof(sub)) continue;
+        if (stat(sub, &st) == 0 && S_ISDIR(st.st_mode)) watch_tree(ifd, sub);
+    }
+    closedir(d);
+}
+
+/**
+ * Background thread that turns docroot changes into cache invalidations.
+ */
+void *cache_watch_thread(void *arg) {
+    int ifd = *(int *)arg;
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    free(arg);
+    watch_tree(ifd, ".");
+
+    while (1) {
+        ssize_t n;
+        char *p;
+
+        index_hash_pending(ifd);
+        n = read(ifd, buf, sizeof(buf));
+
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            perror("inotify read() failed");
+            cache_invalidate(NULL);
+            fixed_invalidate(NULL);
+            index_disable();
+            return NULL;
+        }
+
+        for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            char path[CACHE_PATH_MAX];
+            int i;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                cache_invalidate(NULL); // Events were lost
+                fixed_invalidate(NULL);
+                index_rebuild();
+                continue;
+            }
+            for (i = 0; i < nwatch_dirs && watch_dirs[i].wd != ev->wd; i++)
+                ;
+            if (i == nwatch_dirs) continue;
+            if (ev->mask & IN_IGNORED) {
+                watch_dirs[i] = watch_dirs[--nwatch_dirs];
+                continue;
+            }
+            if (ev->len == 0) continue; // Event on the directory itself
+
+            if (snprintf(path, sizeof(path), "%s/%s", watch_dirs[i].path, ev->name) >= (int)sizeof(path)) {
+                continue; // Too long to have been cached
+            }
+            if (ev->mask & IN_ISDIR) {
+                if (ev->mask & (IN_CREATE | IN_MOVED_TO)) watch_tree(ifd, path);
+                if (ev->mask & (IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE)) {
+                    cache_invalidate(NULL);
+                    fixed_invalidate(NULL);
+                }
+                if (ev->mask & (IN_CREATE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE)) index_update_tree(path);
+            } else {
+                index_update(path); // First, so a refilled cache entry sees the new metadata
+                cache_invalidate(path);
+                fixed_invalidate(path);
+            }
+        }
+    }
+}
+
+/**
+ * Starts watching the docroot for the file cache and the fixed responses.
+ * Call once, before forking workers.
+ * @return 1 on success, 0 on error (error_msg is set).
+ */
+int cache_watch_start(void) {
+    pthread_t tid;
+    int *ifd = malloc(sizeof(int));
+    int err;
+
+    if (ifd == NULL || (*ifd = inotify_init1(IN_CLOEXEC)) < 0) {
+        snprintf(error_msg, sizeof(error_msg), "inotify_init1() error: %s\n", strerror(errno));
+        free(ifd);
+        return 0;
+    }
+    err = pthread_create(&tid, NULL, cache_watch_thread, ifd);
+    if (err) {
+        snprintf(error_msg, sizeof(error_msg), "pthread_create() error: %s\n", strerror(err));
+        close(*ifd);
+        free(ifd);
+        return 0;
+    }
+    pthread_detach(tid);
+    return 1;
+}
+
+/**
+ * Whether a MIME type is audio/video/image media, whose responses advertise
+ * byte range support so players can seek.
+ */
+int is_media_type(const char *type) {
+    return strncmp(type, "video/", 6) == 0 || strncmp(type, "audio/", 6) == 0 || strncmp(type, "image/", 6) == 0;
+}
+
+/**
+ * Parses a "bytes=" Range header value against a file of the given size.
+ * Unsatisfiable ranges are dropped; suffix ranges ("-500") count from the end.
+ * @param value The header value (not NUL-terminated).
+ * @param vlen Length of value.
+ * @param size The file size.
+ * @param ranges Output: [start, end) pairs.
+ * @param max Capacity of ranges.
+ * @return The number of satisfiable ranges, or -1 if the header is malformed
+ *         or asks for too many ranges (then it is ignored and the whole file sent).
+ */
+int parse_range(const char *value, size_t vlen, off_t size, off_t ranges[][2], int max) {
+    char buf[512];
+    char *p, *save = NULL;
+    int n = 0;
+
+    if (vlen >= sizeof(buf) || vlen < 6 || strncmp(value, "bytes=", 6) != 0) return -1;
+    memcpy(buf, value + 6, vlen - 6);
+    buf[vlen - 6] = '\0';
+
+    for (p = strtok_r(buf, ",", &save); p; p = strtok_r(NULL, ",", &save)) {
+        char *dash, *end;
+        long long a, b;
+
+        while (*p == ' ' || *p == '\t') p++;
+        dash = strchr(p, '-');
+        if (dash == NULL) return -1;
+
+        if (dash == p) { // Suffix range: the last N bytes
+            b = strtoll(dash + 1, &end, 10);
+            if (end == dash + 1 || b < 0) return -1;
+            if (b == 0) continue;
+            a = b >= size ? 0 : size - b;
+            b = size;
+        } else {
+            a = strtoll(p, &end, 10);
+            if (end != dash || a < 0) return -1;
+            if (dash[1] == '\0' || dash[1] == ' ') {
+                b = size;
+            } else {
+                b = strtoll(dash + 1, &end, 10);
+                if (end == dash + 1 || b < a) return -1;
+                b = b + 1 > size ? size : b + 1;
+            }
+            if (a >= size) continue; // Unsatisfiable
+        }
+
+        if (n == max) return -1;
+        ranges[n][0] = a;
+        ranges[n][1] = b;
+        n++;
+    }
+    return n;
+}
+
+/**
+ * Answers a Range request for an open file: 206 with the single range streamed
+ * from the file, 206 multipart/byteranges built from just the requested bytes,
+ * or 416 if nothing is satisfiable.
+ * @param cn The client connection.
+ * @param fd The open file; ownership passes to the connection on success.
+ * @param meta The file's metadata.
+ * @param content_type The file's MIME type.
+ * @param extra Headers shared with the full response (Accept-Ranges, Last-Modified).
+ * @param value The Range header value.
+ * @param vlen Length of value.
+ * @return 1 if a response was queued, 0 to ignore the Range header.
+ */
+int http_send_range(struct conn *cn, int fd, const struct file_meta *meta, const char *content_type,
+                    const char *extra, const char *value, size_t vlen) {
+    off_t ranges[MAX_RANGES][2];
+    char header_buf[1024];
+    char hdrs[512];
+    int nranges, hlen, i;
+
+    nranges = parse_range(value, vlen, meta->size, ranges, MAX_RANGES);
+    if (nranges < 0) return 0;
+
+    if (nranges == 0) {
+        const char *res = "Requested range not satisfiable";
+        snprintf(hdrs, sizeof(hdrs), "%sContent-Range: bytes */%lld\r\n", extra, (long long)meta->size);
+        hlen = http_format_header(header_buf, sizeof(header_buf), 416, "text/plain", strlen(res), hdrs);
+        if (http_queue_prefix(cn, header_buf, hlen, 0)) {
+            cn->bbuf = res;
+            cn->blen = strlen(res);
+        }
+        close(fd);
+        return 1;
+    }
+
+    if (nranges == 1) {
+        snprintf(hdrs, sizeof(hdrs), "%sContent-Range: bytes %lld-%lld/%lld\r\n", extra,
+                 (long long)ranges[0][0], (long long)ranges[0][1] - 1, (long long)meta->size);
+        hlen = http_format_header(header_buf, sizeof(header_buf), 206, content_type,
+                                  ranges[0][1] - ranges[0][0], hdrs);
+        if (!http_send_file(cn, header_buf, hlen, fd, ranges[0][0], ranges[0][1])) cn->state = CONN_CLOSED;
+        return 1;
+    }
+
+    // Several ranges: build the multipart body from only the requested bytes.
+    char part_hdr[MAX_RANGES][256];
+    int part_len[MAX_RANGES];
+    size_t body_len = 0, pos;
+    const char *closing = "--" BYTERANGES_BOUNDARY "--\r\n";
+
+    for (i = 0; i < nranges; i++) {
+        part_len[i] = snprintf(part_hdr[i], sizeof(part_hdr[i]),
+                               "--" BYTERANGES_BOUNDARY "\r\n"
+                               "Content-Type: %s\r\n"
+                               "Content-Range: bytes %lld-%lld/%lld\r\n"
+                               "\r\n",
+                               content_type, (long long)ranges[i][0], (long long)ranges[i][1] - 1,
+                               (long long)meta->size);
+        body_len += part_len[i] + (ranges[i][1] - ranges[i][0]) + 2;
+    }
+    body_len += strlen(closing);
+    if (body_len > MAX_MULTIRANGE_BYTES) return 0; // Too big to assemble: send the whole file
+
+    hlen = http_format_header(header_buf, sizeof(header_buf), 206,
+                              "multipart/byteranges; boundary=" BYTERANGES_BOUNDARY, body_len, extra);
+    if (!http_queue_prefix(cn, header_buf, hlen, body_len)) {
+        close(fd);
+        return 1;
+    }
+
+    pos = cn->wlen;
+    for (i = 0; i < nranges; i++) {
+        size_t want = ranges[i][1] - ranges[i][0];
+        ssize_t n;
+
+        memcpy(cn->wbuf + pos, part_hdr[i], part_len[i]);
+        pos += part_len[i];
+        n = pread(fd, cn->wbuf + pos, want, ranges[i][0]);
+        if (n != (ssize_t)want) {
+            cn->state = CONN_CLOSED; // Short read: the file shrank underneath us
+            close(fd);
+            return 1;
+        }
+        pos += want;
+        memcpy(cn->wbuf + pos, "\r\n", 2);
+        pos += 2;
+    }
+    memcpy(cn->wbuf + pos, closing, strlen(closing));
+    cn->wlen = pos + strlen(closing);
+    close(fd);
+    return 1;
+}
+
+/**
+ * Whether responses of a MIME type are worth compressing.
+ */
+int is_compressible_type(const char *type) {
+    return strncmp(type, "text/", 5) == 0 || strcmp(type, "application/javascript") == 0 ||
+           strcmp(type, "application/json") == 0 || strcmp(type, "image/svg+xml") == 0;
+}
+
+/**
+ * Parses the request's Accept-Encoding header.
+ * @param cn The client connection.
+ * @return A bitmask of (1 << coding) for every coding the client accepts.
+ */
+int http_accept_codings(struct conn *cn) {
+    struct str_view value = http_header(cn, HDR_ACCEPT_ENCODING);
+    const char *p, *end;
+    int mask = 0, star = -1, named = 0;
+
+    if (value.p == NULL) return 0;
+
+    for (p = value.p, end = value.p + value.len; p < end;) {
+        const char *tok, *tok_end, *item_end = memchr(p, ',', end - p);
+        const char *q;
+        int acceptable = 1, c;
+
+        if (item_end == NULL) item_end = end;
+        while (p < item_end && (*p == ' ' || *p == '\t')) p++;
+        tok = p;
+        while (p < item_end && *p != ';' && *p != ' ' && *p != '\t') p++;
+        tok_end = p;
+
+        // "q=0" (however many zeros) refuses the coding.
+        q = memchr(p, '=', item_end - p);
+        if (q && q > p && (q[-1] == 'q' || q[-1] == 'Q')) {
+            double qv = strtod(q + 1, NULL);
+            acceptable = qv > 0;
+        }
+
+        if (tok_end - tok == 1 && *tok == '*') {
+            star = acceptable;
+        } else {
+            for (c = 0; c < NCODINGS; c++) {
+                if ((size_t)(tok_end - tok) == strlen(codings[c].name) &&
+                    strncasecmp(tok, codings[c].name, tok_end - tok) == 0) {
+                    named |= 1 << c;
+                    if (acceptable) mask |= 1 << c;
+                }
+            }
+        }
+        p = item_end + 1;
+    }
+    if (star == 1) mask |= ((1 << NCODINGS) - 1) & ~named;
+    return mask;
+}
+
+voidpf zlib_arena_alloc(voidpf opaque, uInt items, uInt size) {
+    return arena_alloc(opaque, (size_t)items * size);
+}
+
+void zlib_arena_free(voidpf opaque, voidpf address) {
+    (void)opaque; // Released with the arena
+    (void)address;
+}
+
+/**
+ * Compresses a buffer into the gzip format. All memory, zlib's own state
+ * included, comes from the arena.
+ * @param a The request's arena.
+ * @param in The data.
+ * @param len Length of in.
+ * @param out_len Set to the compressed length.
+ * @return The compressed data in the arena, or NULL on error.
+ */
+char *gzip_compress(struct arena *a, const char *in, size_t len, size_t *out_len) {
+    z_stream zs;
+    char *out;
+    size_t cap;
+
+    memset(&zs, 0, sizeof(zs));
+    zs.zalloc = zlib_arena_alloc;
+    zs.zfree = zlib_arena_free;
+    zs.opaque = a;
+    // windowBits 15 + 16 selects the gzip wrapper. Results are cached, so spend the CPU once.
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) return NULL;
+    cap = deflateBound(&zs, len);
+    out = arena_alloc(a, cap);
+    if (out == NULL) {
+        deflateEnd(&zs);
+        return NULL;
+    }
+
+    zs.next_in = (Bytef *)in;
+    zs.avail_in = len;
+    zs.next_out = (Bytef *)out;
+    zs.avail_out = cap;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&zs);
+        return NULL;
+    }
+    *out_len = zs.total_out;
+    deflateEnd(&zs);
+    return out;
+}
+
+/**
+ * Reads a whole small file into the write buffer behind the given headers
+ * and adds the response to the cache.
+ * @param cn The client connection.
+ * @param key The cache key.
+ * @param header The header prefix from http_format_header().
+ * @param hlen Length of header.
+ * @param fd The open file; always closed.
+ * @param size The file size.
+ * @param v The response's validators, cached with it.
+ * @param seq cache_seq() from before the file was opened.
+ */
+void http_send_cached_file(struct conn *cn, const char *key, const char *header, int hlen,
+                           int fd, size_t size, const struct validators *v, unsigned seq) {
+    ssize_t n = 0;
+    size_t got = 0;
+
+    if (!http_queue_prefix(cn, header, hlen, size)) {
+        close(fd);
+        return; // The connection is being closed
+    }
+    while (got < size && (n = pread(fd, cn->wbuf + cn->wlen + got, size - got, got)) > 0) {
+        got += n;
+    }
+    close(fd);
+    if (got != size) {
+        cn->state = CONN_CLOSED; // Headers promised more bytes than we got
+        return;
+    }
+    cache_insert(key, header, hlen, cn->wbuf + cn->wlen, got, v, seq);
+    cn->wlen += got;
+}
+
+/**
+ * Serves a compressed variant of a file: a precompressed sidecar next to it
+ * if one exists, otherwise a gzip made once and kept in the cache. A sidecar
+ * carries its own ETag; the on-the-fly gzip gets the file's with "-gzip".
+ * @param cn The client connection.
+ * @param file_path The file path.
+ * @param cacheable Whether the path is in a form the cache can key on.
+ * @param fd The open file; closed if a variant was queued.
+ * @param meta The file's metadata.
+ * @param content_type The file's MIME type.
+ * @param cache_control The Cache-Control value for the file, or NULL.
+ * @param mask Codings the client accepts, from http_accept_codings().
+ * @param seq cache_seq() from before the file was opened.
+ * @return 1 if a response was queued, 0 to send the file uncompressed.
+ */
+int http_send_encoded(struct conn *cn, const char *file_path, int cacheable, int fd, const struct file_meta *meta,
+                      const char *content_type, const char *cache_control, int mask, unsigned seq) {
+    struct validators v;
+    char header_buf[1024];
+    char extra[512];
+    char key[CACHE_PATH_MAX + 8];
+    int c, hlen;
+
+    for (c = 0; c < NCODINGS; c++) {
+        char sidecar[PATH_MAX];
+        struct file_meta smeta;
+        int sfd;
+
+        if (!(mask & (1 << c))) continue;
+        if (snprintf(sidecar, sizeof(sidecar), "%s%s", file_path, codings[c].ext) >= (int)sizeof(sidecar)) continue;
+        sfd = docroot_open(sidecar, &smeta); // Usually answered by the index without a system call
+        if (sfd < 0) continue;
+
+        close(fd);
+        validators_init(&v, smeta.etag, "", smeta.mtime, cache_control, 1);
+        if (http_not_modified(cn, v.etag, v.mtime)) {
+            close(sfd);
+            http_send_not_modified(cn, &v);
+            return 1;
+        }
+        snprintf(extra, sizeof(extra), "Content-Encoding: %s\r\n%s", codings[c].name, validator_lines(&v));
+        hlen = http_format_header(header_buf, sizeof(header_buf), 200, content_type, smeta.size, extra);
+        if (cacheable && cache && smeta.size < CACHE_MAX_ENTRY) {
+            cache_variant_key(key, sizeof(key), file_path, c);
+            http_send_cached_file(cn, key, header_buf, hlen, sfd, smeta.size, &v, seq);
+        } else if (!http_send_file(cn, header_buf, hlen, sfd, 0, smeta.size)) {
+            cn->state = CONN_CLOSED;
+        }
+        return 1;
+    }
+
+    // No sidecar: gzip on the fly, but only when the result can be cached, so
+    // the compression cost is paid once per file rather than once per request.
+    if (!(mask & (1 << CODING_GZIP)) || !cacheable || !cache || meta->size >= CACHE_MAX_ENTRY) return 0;
+
+    validators_init(&v, meta->etag, "-gzip", meta->mtime, cache_control, 1);
+    if (http_not_modified(cn, v.etag, v.mtime)) {
+        close(fd);
+        http_send_not_modified(cn, &v);
+        return 1;
+    }
+
+    char *raw = arena_alloc(&cn->arena, meta->size + 1);
+    char *gz;
+    size_t got = 0, gz_len;
+    ssize_t n = 0;
+
+    if (raw == NULL) return 0;
+    while (got < (size_t)meta->size && (n = pread(fd, raw + got, meta->size - got, got)) > 0) got += n;
+    if (got != (size_t)meta->size || (gz = gzip_compress(&cn->arena, raw, got, &gz_len)) == NULL) return 0;
+
+    snprintf(extra, sizeof(extra), "Content-Encoding: gzip\r\n%s", validator_lines(&v));
+    hlen = http_format_header(header_buf, sizeof(header_buf), 200, content_type, gz_len, extra);
+    if (http_queue_prefix(cn, header_buf, hlen, 0)) {
+        cn->bbuf = gz; // In the arena, so it outlives the send
+        cn->blen = gz_len;
+        cache_variant_key(key, sizeof(key), file_path, CODING_GZIP);
+        cache_insert(key, header_buf, hlen, gz, gz_len, &v, seq);
+    }
+    close(fd);
+    return 1;
+}
+
+/**
+ * Looks up the cached compressed variants of a file, in order of preference.
+ * @return 1 on a hit, 0 on a miss.
+ */
+int cache_lookup_encoded(struct conn *cn, const char *file_path, int mask) {
+    char key[CACHE_PATH_MAX + 8];
+    int c;
+
+    for (c = 0; c < NCODINGS; c++) {
+        if (!(mask & (1 << c))) continue;
+        cache_variant_key(key, sizeof(key), file_path, c);
+        if (cache_lookup(cn, key)) return 1;
+    }
+    return 0;
+}
+
+/**
+ * Notes how long finding a static file took, and whether the cache had it.
+ * @param hit 1 for a cache hit, 0 for a miss, -1 if the cache was not asked.
+ */
+void lookup_done(struct conn *cn, uint64_t t0, int hit) {
+    cn->lookup_ns = clock_ns() - t0;
+    if (hit >= 0) metric_add(hit ? M_CACHE_HITS : M_CACHE_MISSES, 1);
+}
+
+/**
+ * Queues a GET response for a file, from the cache when possible, otherwise
+ * from disk: small files are read once and added to the cache, larger ones
+ * are streamed with sendfile(). Text is sent compressed when the client
+ * accepts it. Every response carries ETag (once the file's content hash is
+ * known) and Last-Modified, and conditional requests that match get a 304.
+ * @param cn The client connection.
+ * @param file_path The file path.
+ * @param cacheable Whether the path is in a form the cache can key on.
+ * @return 1 if a response was queued, 0 if the file cannot be served.
+ */
+int http_send_static(struct conn *cn, const char *file_path, int cacheable) {
+    struct str_view range = http_header(cn, HDR_RANGE);
+    const char *content_type, *cache_control;
+    struct validators v;
+    char header_buf[1024];
+    char extra[512];
+    struct file_meta meta;
+    unsigned seq;
+    int fd, hlen, mask = 0, compressible;
+    uint64_t t0 = clock_ns();
+
+    // Partial content is never served from the cache; it reads only the bytes asked for.
+    content_type = get_content_type(file_path);
+    compressible = !range.p && is_compressible_type(content_type);
+    if (compressible) {
+        mask = http_accept_codings(cn);
+        if (mask && cacheable && cache_lookup_encoded(cn, file_path, mask)) {
+            lookup_done(cn, t0, 1);
+            return 1;
+        }
+    }
+    // A gzip client missing above goes to disk so the evicted variant is rebuilt.
+    if (!range.p && !(mask & (1 << CODING_GZIP)) && cacheable && cache_lookup(cn, file_path)) {
+        lookup_done(cn, t0, 1);
+        return 1;
+    }
+
+    seq = cache_seq();
+    fd = docroot_open(file_path, &meta);
+    lookup_done(cn, t0, cacheable && cache ? 0 : -1);
+    if (fd < 0) return 0;
+    cache_control = cache_control_for(file_path);
+
+    if (compressible && mask &&
+        http_send_encoded(cn, file_path, cacheable, fd, &meta, content_type, cache_control, mask, seq)) {
+        return 1;
+    }
+    validators_init(&v, meta.etag, "", meta.mtime, cache_control, is_compressible_type(content_type));
+    // A matching If-None-Match or If-Modified-Since wins over Range (RFC 7233, section 3.1).
+    if (http_not_modified(cn, v.etag, v.mtime)) {
+        close(fd);
+        http_send_not_modified(cn, &v);
+        return 1;
+    }
+
+    if (is_media_type(content_type)) {
+        snprintf(extra, sizeof(extra), "Accept-Ranges: bytes\r\n%s", validator_lines(&v));
+
+        if (range.p) {
+            // If-Range: only honour the range if the client's copy is still current.
+            // An ETag must match strongly; a date must be the exact Last-Modified.
+            struct str_view if_range = http_header(cn, HDR_IF_RANGE);
+            char date[64];
+
+            http_date(meta.mtime, date, sizeof(date));
+            if ((!if_range.p || sv_eq(if_range, date) || (v.etag[0] && sv_eq(if_range, v.etag))) &&
+                http_send_range(cn, fd, &meta, content_type, extra, range.p, range.len)) {
+                return 1;
+            }
+        }
+    } else {
+        snprintf(extra, sizeof(extra), "%s", validator_lines(&v));
+    }
+
+    hlen = http_format_header(header_buf, sizeof(header_buf), 200, content_type, meta.size, extra);
+
+    if (cacheable && cache && meta.size < CACHE_MAX_ENTRY) {
+        http_send_cached_file(cn, file_path, header_buf, hlen, fd, meta.size, &v, seq);
+        return 1;
+    }
+
+    if (!http_send_file(cn, header_buf, hlen, fd, 0, meta.size)) cn->state = CONN_CLOSED;
+    return 1;
+}
+
+/**
+ * Seconds from a coarse monotonic clock, cheap enough to read per event.
+ */
+time_t now_sec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+// One logged-in session. The id is random, so its bytes double as the hash.
+struct session_entry {
+    unsigned char id[SESSION_ID_LEN];
+    char username[MAX_USERNAME_LEN];
+    int used;
+    time_t created;   // now_sec() at login
+    time_t last_used; // now_sec() at the last request that presented it
+};
+
+// A slice of the session table with its own lock, so requests of different
+// sessions rarely wait on each other. Open addressing with linear probing,
+// entries removed by shifting their successors back (no tombstones).
+struct session_shard {
+    pthread_mutex_t lock;
+    int count;
+    struct session_entry slots[SESSION_SHARD_SLOTS];
+} __attribute__((aligned(64)));
+
+// Sessions of every worker, in shared memory. Cookies carry the session id
+// and an HMAC of it under a key drawn at startup, so forged or mangled
+// cookies are turned away before any shard is locked.
+struct session_store {
+    unsigned char key[32];
+    struct session_shard shards[SESSION_SHARDS];
+};
+
+struct session_store *sessions = NULL;
+
+/**
+ * Maps the session table and draws its signing key. Must run before workers
+ * are forked. Sessions do not survive a restart.
+ * @return 1 on success, 0 on error (error_msg is set).
+ */
+int session_init(void) {
+    pthread_mutexattr_t attr;
+    int i;
+
+    sessions = mmap(NULL, sizeof(struct session_store), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (sessions == MAP_FAILED) {
+        sessions = NULL;
+        snprintf(error_msg, sizeof(error_msg), "session mmap() error: %s\n", strerror(errno));
+        return 0;
+    }
+    if (RAND_bytes(sessions->key, sizeof(sessions->key)) != 1) {
+        snprintf(error_msg, sizeof(error_msg), "cannot draw the session key\n");
+        munmap(sessions, sizeof(struct session_store));
+        sessions = NULL;
+        return 0;
+    }
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    for (i = 0; i < SESSION_SHARDS; i++) pthread_mutex_init(&sessions->shards[i].lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return 1;
+}
+
+struct session_shard *session_shard_lock(const unsigned char *id) {
+    struct session_shard *sh = &sessions->shards[id[0] & (SESSION_SHARDS - 1)];
+
+    // A worker that died holding the lock may have left one entry half
+    // written; the worst it can do is fail to match.
+    if (pthread_mutex_lock(&sh->lock) == EOWNERDEAD) pthread_mutex_consistent(&sh->lock);
+    return sh;
+}
+
+unsigned session_home(const unsigned char *id) {
+    return (id[1] | id[2] << 8) & (SESSION_SHARD_SLOTS - 1);
+}
+
+/**
+ * Finds a session in a locked shard.
+ * @return The slot index, or -1 if it is not there.
+ */
+int session_find_locked(struct session_shard *sh, const unsigned char *id) {
+    unsigned i, n;
+
+    for (i = session_home(id), n = 0; n < SESSION_SHARD_SLOTS; i = (i + 1) & (SESSION_SHARD_SLOTS - 1), n++) {
+        if (!sh->slots[i].used) return -1;
+        if (memcmp(sh->slots[i].id, id, SESSION_ID_LEN) == 0) return i;
+    }
+    return -1;
+}
+
+/**
+ * Empties a slot of a locked shard and moves later entries of the probe
+ * run back, so lookups never stop early at the hole.
+ */
+void session_delete_locked(struct session_shard *sh, unsigned hole) {
+    unsigned i = hole;
+
+    while (1) {
+        unsigned home;
+
+        i = (i + 1) & (SESSION_SHARD_SLOTS - 1);
+        if (!sh->slots[i].used) break;
+        home = session_home(sh->slots[i].id);
+        // Move the entry unless its home lies cyclically in (hole, i].
+        if (((i - home) & (SESSION_SHARD_SLOTS - 1)) >= ((i - hole) & (SESSION_SHARD_SLOTS - 1))) {
+            sh->slots[hole] = sh->slots[i];
+            hole = i;
+        }
+    }
+    memset(&sh->slots[hole], 0, sizeof(sh->slots[hole]));
+    sh->count--;
+}
+
+int session_expired(const struct session_entry *e, time_t now) {
+    return now - e->last_used >= config.session_idle || now - e->created >= SESSION_MAX_AGE;
+}
+
+/**
+ * Makes room in a full shard: drops every expired session and, if none
+ * was, the one idle the longest.
+ */
+void session_evict_locked(struct session_shard *sh, time_t now) {
+    unsigned i = 0;
+    int oldest = -1, dropped = 0;
+
+    while (i < SESSION_SHARD_SLOTS) {
+        struct session_entry *e = &sh->slots[i];
+
+        if (e->used && session_expired(e, now)) {
+            session_delete_locked(sh, i); // Pulls a later entry into i: look at it again
+            dropped = 1;
+            continue;
+        }
+        if (e->used && (oldest < 0 || e->last_used < sh->slots[oldest].last_used)) oldest = i;
+        i++;
+    }
+    if (!dropped && oldest >= 0) session_delete_locked(sh, oldest);
+}
+
+/**
+ * The cookie value of a session: its id and the truncated HMAC-SHA256 of
+ * the id, both in hex.
+ */
+void session_token(const unsigned char *id, char *out) {
+    static const char hex[] = "0123456789abcdef";
+    unsigned char mac[EVP_MAX_MD_SIZE], raw[SESSION_ID_LEN * 2];
+    unsigned mac_len, i;
+
+    HMAC(EVP_sha256(), sessions->key, sizeof(sessions->key), id, SESSION_ID_LEN, mac, &mac_len);
+    memcpy(raw, id, SESSION_ID_LEN);
+    memcpy(raw + SESSION_ID_LEN, mac, SESSION_ID_LEN);
+    for (i = 0; i < sizeof(raw); i++) {
+        out[2 * i] = hex[raw[i] >> 4];
+        out[2 * i + 1] = hex[raw[i] & 15];
+    }
+    out[SESSION_TOKEN_LEN] = '\0';
+}
+
+/**
+ * Checks the signature of a cookie value and extracts the session id.
+ * @return 1 if the token is well formed and was signed by this server.
+ */
+int session_token_parse(struct str_view token, unsigned char *id) {
+    unsigned char raw[SESSION_ID_LEN * 2];
+    char expect[SESSION_TOKEN_LEN + 1];
+    size_t i;
+
+    if (token.len != SESSION_TOKEN_LEN) return 0;
+    for (i = 0; i < sizeof(raw); i++) {
+        int hi = hex_value[(unsigned char)token.p[2 * i]], lo = hex_value[(unsigned char)token.p[2 * i + 1]];
+
+        if (hi < 0 || lo < 0) return 0;
+        raw[i] = hi << 4 | lo;
+    }
+    memcpy(id, raw, SESSION_ID_LEN);
+    session_token(id, expect);
+    // Compared in lower case, as issued; the comparison takes the same time wherever it differs.
+    return CRYPTO_memcmp(expect, token.p, SESSION_TOKEN_LEN) == 0;
+}
+
+/**
+ * Starts a session for a user who just proved their password.
+ * @param username The user.
+ * @param token Receives the cookie value, SESSION_TOKEN_LEN + 1 bytes.
+ * @return 1 on success, 0 if sessions are unavailable.
+ */
+int session_create(const char *username, char *token) {
+    unsigned char id[SESSION_ID_LEN];
+    struct session_shard *sh;
+    struct session_entry *e;
+    time_t now = now_sec();
+    unsigned i;
+
+    if (sessions == NULL || RAND_bytes(id, sizeof(id)) != 1) return 0;
+    sh = session_shard_lock(id);
+    if (sh->count >= SESSION_SHARD_SLOTS / 4 * 3) session_evict_locked(sh, now);
+    for (i = session_home(id); sh->slots[i].used; i = (i + 1) & (SESSION_SHARD_SLOTS - 1))
+        ;
+    e = &sh->slots[i];
+    memcpy(e->id, id, sizeof(id));
+    strcpy(e->username, username);
+    e->created = e->last_used = now;
+    e->used = 1;
+    sh->count++;
+    pthread_mutex_unlock(&sh->lock);
+    session_token(id, token);
+    return 1;
+}
+
+/**
+ * Finds the value of the session cookie in a request.
+ * @return The value, or a view with p == NULL if there is none.
+ */
+struct str_view session_cookie(const struct conn *cn) {
+    struct str_view cookies = http_header(cn, HDR_COOKIE), none = {NULL, 0};
+    const char *p = cookies.p, *end = cookies.p + cookies.len;
+    size_t nlen = strlen(SESSION_COOKIE);
+
+    while (p && p < end) {
+        const char *semi = memchr(p, ';', end - p), *stop = semi ? semi : end;
+
+        while (p < stop && (*p == ' ' || *p == '\t')) p++;
+        if ((size_t)(stop - p) > nlen && memcmp(p, SESSION_COOKIE, nlen) == 0 && p[nlen] == '=') {
+            struct str_view v = {p + nlen + 1, stop - p - nlen - 1};
+
+            while (v.len && (v.p[v.len - 1] == ' ' || v.p[v.len - 1] == '\t')) v.len--;
+            return v;
+        }
+        p = semi ? semi + 1 : end;
+    }
+    return none;
+}
+
+/**
+ * Resolves the session a request presents and marks it as used. An
+ * expired session is dropped on the way.
+ * @param cn The client connection.
+ * @param username Receives the session's user, MAX_USERNAME_LEN bytes.
+ * @return 1 if the request carries a live session, 0 otherwise.
+ */
+int session_user(const struct conn *cn, char *username) {
+    struct str_view cookie = session_cookie(cn);
+    unsigned char id[SESSION_ID_LEN];
+    struct session_shard *sh;
+    time_t now;
+    int i, ok = 0;
+
+    if (sessions == NULL || cookie.p == NULL || !session_token_parse(cookie, id)) return 0;
+    now = now_sec();
+    sh = session_shard_lock(id);
+    i = session_find_locked(sh, id);
+    if (i >= 0 && session_expired(&sh->slots[i], now)) {
+        session_delete_locked(sh, i);
+    } else if (i >= 0) {
+        sh->slots[i].last_used = now;
+        strcpy(username, sh->slots[i].username);
+        ok = 1;
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return ok;
+}
+
+/**
+ * Ends the session a request presents, if any.
+ */
+void session_revoke(const struct conn *cn) {
+    struct str_view cookie = session_cookie(cn);
+    unsigned char id[SESSION_ID_LEN];
+    struct session_shard *sh;
+    int i;
+
+    if (sessions == NULL || cookie.p == NULL || !session_token_parse(cookie, id)) return;
+    sh = session_shard_lock(id);
+    i = session_find_locked(sh, id);
+    if (i >= 0) session_delete_locked(sh, i);
+    pthread_mutex_unlock(&sh->lock);
+}
+
+// A password to hash for a login or registration. Jobs of event-loop
+// connections live in the connection's arena; the connection sits in
+// CONN_WAITING until the loop picks the finished job up.
+enum kdf_op {
+    KDF_HASH,   // Hash a new password (registration)
+    KDF_VERIFY  // Check a password against the stored hash (login)
+};
+
+struct kdf_job {
+    enum kdf_op op;
+    int ok;              // Hashed, or the password matched
+    int finished;        // Set by the pool; a waiting submitter may return from then on
+    struct conn *cn;     // Connection to resume on the event loop, or NULL if the submitter waits
+    char username[MAX_USERNAME_LEN];
+    char password[MAX_PASSWORD_LEN];
+    char hash[HASH_LEN]; // KDF_VERIFY: the stored hash, "" for an unknown user; KDF_HASH: the result
+    struct kdf_job *next;
+};
+
+// Password hashing threads of this process, behind a bounded queue. They
+// run at a lower priority than request handling, so a burst of logins waits
+// in line (or gets 503 once the queue is full) instead of slowing down
+// static files. Started one at a time as logins find every thread busy, so
+// every prefork worker has its own and an idle one has none. Fork-mode
+// children hash on their only thread instead.
+struct kdf_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work;      // Jobs were queued
+    pthread_cond_t finished;  // Jobs of waiting submitters are done
+    struct kdf_job *head, *tail;
+    int queued;
+    int inflight;             // Queued or being hashed
+    int limit;                // Admission limit on inflight
+    int nthreads;             // Threads started so far, 0 until the first job
+    struct kdf_job *done;     // Finished event-loop jobs, newest first
+};
+
+struct kdf_pool kdf = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .finished = PTHREAD_COND_INITIALIZER,
+};
+
+/**
+ * Runs one job.
+ */
+void kdf_run(struct kdf_job *job) {
+    char dummy[HASH_LEN];
+
+    if (job->op == KDF_HASH) {
+        job->ok = hash_password(job->password, job->hash);
+    } else if (job->hash[0]) {
+        job->ok = password_verify(job->password, job->hash);
+        if (job->ok) user_upgrade(job->username, job->password, job->hash);
+    } else {
+        // Unknown user: spend the same time, so response times do not tell which names exist.
+        hash_password(job->password, dummy);
+        job->ok = 0;
+    }
+    OPENSSL_cleanse(job->password, sizeof(job->password));
+}
+
+/**
+ * KDF thread: takes a share of the queue (up to KDF_BATCH jobs), hashes
+ * them and hands them back together, so one wakeup and one event loop
+ * notification cover the whole batch.
+ */
+void *kdf_thread(void *arg) {
+    (void)arg;
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), KDF_NICE);
+
+    pthread_mutex_lock(&kdf.lock);
+    while (1) {
+        struct kdf_job *batch, *last, *job, *next;
+        int n, take, notify = 0, wake = 0;
+
+        while (kdf.head == NULL) pthread_cond_wait(&kdf.work, &kdf.lock);
+        take = (kdf.queued + kdf.nthreads - 1) / kdf.nthreads;
+        if (take > KDF_BATCH) take = KDF_BATCH;
+        batch = last = kdf.head;
+        for (n = 1; n < take; n++) last = last->next;
+        kdf.head = last->next;
+        if (kdf.head == NULL) kdf.tail = NULL;
+        last->next = NULL;
+        kdf.queued -= take;
+        pthread_mutex_unlock(&kdf.lock);
+
+        for (job = batch; job; job = job->next) kdf_run(job);
+
+        pthread_mutex_lock(&kdf.lock);
+        for (job = batch; job; job = next) {
+            next = job->next; // A waiting submitter may free the job once it is marked
+            kdf.inflight--;
+            if (job->cn) {
+                job->next = kdf.done;
+                kdf.done = job;
+                notify = 1;
+            } else {
+                wake = 1;
+            }
+            job->finished = 1;
+        }
+        if (wake) pthread_cond_broadcast(&kdf.finished);
+        if (notify) loop_done_signal();
+    }
+    return NULL;
+}
+
+/**
+ * Starts one more KDF thread. Caller holds kdf.lock.
+ * @return 1 if the thread was started, 0 otherwise.
+ */
+int kdf_start_locked(void) {
+    pthread_t tid;
+    int err = pthread_create(&tid, NULL, kdf_thread, NULL);
+
+    if (err) {
+        fprintf(stderr, "pthread_create() error for KDF thread: %s\n", strerror(err));
+        return 0;
+    }
+    pthread_detach(tid);
+    kdf.nthreads++;
+    return 1;
+}
+
+/**
+ * Queues a job. A job without a connection is waited for: it is finished
+ * when this returns 1. The pool grows by at most one thread per job, and
+ * only while every thread is busy, up to -t threads. A process without an
+ * event loop serves a single connection and hashes on the calling thread.
+ * @return 1 if the job was admitted, 0 if the queue is full.
+ */
+int kdf_submit(struct kdf_job *job) {
+    int max = config.kdf_threads > 0 ? config.kdf_threads : 1;
+
+    if (!event_loop) {
+        kdf_run(job);
+        job->finished = 1;
+        return 1;
+    }
+    pthread_mutex_lock(&kdf.lock);
+    kdf.limit = max * KDF_QUEUE_PER_THREAD;
+    if (kdf.inflight >= kdf.limit) {
+        pthread_mutex_unlock(&kdf.lock);
+        return 0;
+    }
+    if (kdf.inflight >= kdf.nthreads && kdf.nthreads < max) kdf_start_locked();
+    if (kdf.nthreads == 0) {
+        pthread_mutex_unlock(&kdf.lock);
+        return 0;
+    }
+    job->finished = 0;
+    job->next = NULL;
+    if (kdf.tail) kdf.tail->next = job;
+    else kdf.head = job;
+    kdf.tail = job;
+    kdf.queued++;
+    kdf.inflight++;
+    pthread_cond_signal(&kdf.work);
+    if (job->cn == NULL) {
+        while (!job->finished) pthread_cond_wait(&kdf.finished, &kdf.lock);
+    }
+    pthread_mutex_unlock(&kdf.lock);
+    return 1;
+}
+
+/**
+ * Takes the finished event-loop jobs, oldest first. The caller has already
+ * consumed the eventfd count.
+ */
+struct kdf_job *kdf_take_done(void) {
+    struct kdf_job *job, *next, *list = NULL;
+
+    pthread_mutex_lock(&kdf.lock);
+    job = kdf.done;
+    kdf.done = NULL;
+    pthread_mutex_unlock(&kdf.lock);
+    for (; job; job = next) {
+        next = job->next;
+        job->next = list;
+        list = job;
+    }
+    return list;
+}
+
+/**
+ * Answers a successful login, handing out a session cookie so the user's
+ * later requests are recognized without hashing the password again.
+ * @param cn The client connection.
+ * @param username The user who logged in.
+ */
+void http_login_ok(struct conn *cn, const char *username) {
+    char token[SESSION_TOKEN_LEN + 1], cookie[SESSION_TOKEN_LEN + 128];
+
+    if (!session_create(username, token)) {
+        http_send_fixed(cn, FIXED_LOGIN_OK); // Logged in, but every login will need the password
+        return;
+    }
+    snprintf(cookie, sizeof(cookie), "Set-Cookie: %s=%s; Path=/; HttpOnly; SameSite=Strict; Max-Age=%d\r\n",
+             SESSION_COOKIE, token, SESSION_MAX_AGE);
+    http_send_fixed_extra(cn, FIXED_LOGIN_OK, cookie);
+}
+
+/**
+ * Answers a login or registration once its password hash is done.
+ * @param cn The client connection.
+ * @param job The finished job.
+ */
+void auth_finish(struct conn *cn, struct kdf_job *job) {
+    if (job->op == KDF_VERIFY) {
+        if (job->ok) http_login_ok(cn, job->username);
+        else http_send_fixed(cn, FIXED_LOGIN_FAILED);
+        return;
+    }
+    if (!job->ok) {
+        fprintf(stderr, "Password hashing failed for a registration\n");
+        http_send_fixed(cn, FIXED_SERVER_ERROR);
+        return;
+    }
+    switch (user_add(job->username, job->hash)) {
+    case 1:
+        http_send_fixed(cn, FIXED_REGISTERED);
+        break;
+    case 0:
+        http_send_fixed(cn, FIXED_USER_EXISTS); // Another registration of the name won the race
+        break;
+    default:
+        fprintf(stderr, "Registration failed: %s", error_msg);
+        http_send_fixed(cn, FIXED_SERVER_ERROR);
+        break;
+    }
+}
+
+/**
+ * Handles POST /login and /register. The form is checked here; the password
+ * goes to the KDF pool. On an event loop the connection then waits in
+ * CONN_WAITING and the loop answers it through auth_finish(); in the
+ * blocking modes the handler waits for the hash itself. A login that
+ * presents a live session of the same user (or names no user) and posts no
+ * password is answered from the session table without hashing anything; a
+ * posted password is always checked.
+ * @param cn The client connection.
+ * @param op KDF_VERIFY for a login, KDF_HASH for a registration.
+ * @param form The parsed form; needs username and password.
+ */
+void http_auth(struct conn *cn, enum kdf_op op, struct FormData *form) {
+    struct kdf_job local, *job = &local;
+    const struct user_entry *e;
+    char session_name[MAX_USERNAME_LEN];
+
+    if (op == KDF_VERIFY && form->password[0] == '\0' && session_user(cn, session_name) &&
+        (form->username[0] == '\0' || strcmp(form->username, session_name) == 0)) {
+        http_send_fixed(cn, FIXED_LOGIN_OK);
+        return;
+    }
+    if (!username_valid(form->username) || form->password[0] == '\0') {
+        http_send_fixed(cn, FIXED_BAD_REQUEST);
+        return;
+    }
+    e = user_find(form->username);
+    if (op == KDF_HASH && e) {
+        http_send_fixed(cn, FIXED_USER_EXISTS); // Refused without spending a hash on it
+        return;
+    }
+    if (loop_done_fd >= 0 && (job = arena_alloc(&cn->arena, sizeof(*job))) == NULL) {
+        cn->state = CONN_CLOSED;
+        return;
+    }
+    job->op = op;
+    job->cn = loop_done_fd >= 0 ? cn : NULL;
+    strcpy(job->username, form->username);
+    strcpy(job->password, form->password);
+    if (op == KDF_VERIFY && e) user_read_hash(e, job->hash);
+    else job->hash[0] = '\0';
+    OPENSSL_cleanse(form->password, sizeof(form->password));
+
+    if (!kdf_submit(job)) {
+        OPENSSL_cleanse(job->password, sizeof(job->password));
+        http_send_fixed(cn, FIXED_BUSY);
+        return;
+    }
+    if (job->cn) cn->state = CONN_WAITING;
+    else auth_finish(cn, job);
+}
+
+// A form submission on its way to form_data.txt. Request handlers push
+// records onto a lock-free stack; the writer thread of the process takes
+// the whole stack at once and appends it with a single write().
+struct form_record {
+    struct form_record *next;
+    struct conn *cn;   // Connection parked until the record is on disk, or NULL
+    int wait;          // The submitter blocks until the record is on disk
+    int ok;            // Written (and synced, if asked for)
+    int finished;      // Set by the writer; a waiting submitter frees the record from then on
+    uint64_t queued;   // clock_ns() at submission
+    time_t when;
+    char name[MAX_USERNAME_LEN];
+    char message[512];
+};
+
+// The form writer of this process. Started on first use, like the KDF pool,
+// so every worker appends on its own; each batch is one O_APPEND write(), so
+// lines of different processes never interleave. Fork-mode children append
+// their records directly.
+struct form_writer {
+    _Atomic(struct form_record *) head; // Submitted records, newest first
+    atomic_int pending;        // Submitted and not yet finished
+    int fd;                    // form_data.txt, opened for appending
+    int wake_fd;               // eventfd the writer sleeps on while the stack is empty
+    pthread_mutex_t lock;
+    pthread_cond_t finished;   // Records of waiting submitters (or all of them) are done
+    int started;               // 1 running, -1 could not be started
+    struct form_record *done;  // Finished event-loop records, newest first
+};
+
+struct form_writer forms = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .finished = PTHREAD_COND_INITIALIZER,
+    .fd = -1,
+    .wake_fd = -1,
+};
+
+/**
+ * Formats one record as its form_data.txt line.
+ * @return The length of the line, at most size - 1.
+ */
+int form_format(char *buf, size_t size, const struct form_record *rec) {
+    static __thread char stamp[32];
+    static __thread time_t stamp_time = -1;
+    struct tm tm;
+    int n;
+
+    if (rec->when != stamp_time) {
+        if (localtime_r(&rec->when, &tm) == NULL) {
+            perror("localtime_r failed");
+            return snprintf(buf, size, "[Time Error] Name: %s, Message: %s\n", rec->name, rec->message);
+        }
+        strftime(stamp, sizeof(stamp), "[%Y-%m-%d %H:%M:%S]", &tm);
+        stamp_time = rec->when;
+    }
+    n = snprintf(buf, size, "%s Name: %s, Message: %s\n", stamp, rec->name, rec->message);
+    return n < (int)size ? n : (int)size - 1;
+}
+
+/**
+ * Appends a formatted batch to form_data.txt.
+ * @return 1 on success, 0 on error.
+ */
+int form_append(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(forms.fd, buf, len);
+
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            perror("form_data.txt write() failed");
+            return 0;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 1;
+}
+
+/**
+ * Writes a batch of records, oldest first, and syncs it as configured.
+ * Records are packed into FORM_BATCH_BYTES chunks, one write() each.
+ * @return 1 if every record reached the file, 0 otherwise.
+ */
+int form_write_batch(struct form_record *batch) {
+    static __thread char buf[FORM_BATCH_BYTES];
+    struct form_record *rec;
+    size_t len = 0;
+    int ok = 1;
+
+    for (rec = batch; rec; rec = rec->next) {
+        if (FORM_BATCH_BYTES - len < FORM_LINE_MAX) {
+            ok &= form_append(buf, len);
+            len = 0;
+        }
+        len += form_format(buf + len, FORM_LINE_MAX, rec);
+    }
+    ok &= form_append(buf, len);
+    if (config.form_sync != FORM_SYNC_OFF && fdatasync(forms.fd) < 0) {
+        perror("form_data.txt fdatasync() failed");
+        ok = 0;
+    }
+    return ok;
+}
+
+/**
+ * Writer thread: sleeps until the stack has records, takes all of them and
+ * writes them as one batch. Records arriving meanwhile form the next batch,
+ * so the batch grows with the load and one sync covers all of it.
+ */
+void *form_writer_thread(void *arg) {
+    (void)arg;
+
+    while (1) {
+        struct form_record *batch = NULL, *rec, *next;
+        uint64_t count, now;
+        int ok, notify = 0;
+
+        rec = atomic_exchange(&forms.head, NULL);
+        if (rec == NULL) {
+            if (read(forms.wake_fd, &count, sizeof(count)) < 0 && errno != EINTR) perror("eventfd read() failed");
+            continue;
+        }
+        for (; rec; rec = next) { // Oldest first
+            next = rec->next;
+            rec->next = batch;
+            batch = rec;
+        }
+        ok = form_write_batch(batch);
+        now = clock_ns();
+        for (rec = batch; rec; rec = rec->next) metric_time(PHASE_FORM, now - rec->queued);
+
+        pthread_mutex_lock(&forms.lock);
+        for (rec = batch; rec; rec = next) {
+            next = rec->next;
+            rec->ok = ok;
+            if (rec->cn) {
+                rec->next = forms.done;
+                forms.done = rec;
+                notify = 1;
+            } else if (rec->wait) {
+                rec->finished = 1;
+            } else {
+                free(rec);
+            }
+            atomic_fetch_sub(&forms.pending, 1);
+        }
+        pthread_cond_broadcast(&forms.finished);
+        pthread_mutex_unlock(&forms.lock);
+        if (notify) loop_done_signal();
+    }
+    return NULL;
+}
+
+/**
+ * Waits until every submitted record has been written. Runs at exit in
+ * processes with a writer thread: an event loop only returns when it fails,
+ * and the process then exits without losing records it already answered
+ * (with -f off or batch) as queued. A signal ends it without this.
+ */
+void form_writer_drain(void) {
+    pthread_mutex_lock(&forms.lock);
+    while (forms.started > 0 && atomic_load(&forms.pending) > 0) pthread_cond_wait(&forms.finished, &forms.lock);
+    pthread_mutex_unlock(&forms.lock);
+}
+
+/**
+ * Opens form_data.txt and starts the writer thread of this process. A
+ * process without an event loop gets no thread: it has a single connection
+ * to serve, and its records are written by the handler.
+ * @return 1 if the writer runs, 0 if records must be written by the caller.
+ */
+int form_writer_start(void) {
+    pthread_t tid;
+    int err;
+
+    pthread_mutex_lock(&forms.lock);
+    if (forms.started) goto out;
+    forms.started = -1;
+    forms.fd = open("form_data.txt", O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (forms.fd < 0) {
+        perror("open() failed for form_data.txt");
+        goto out;
+    }
+    if (!event_loop) goto out;
+    forms.wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (forms.wake_fd < 0) {
+        perror("eventfd() failed for the form writer");
+        goto out;
+    }
+    err = pthread_create(&tid, NULL, form_writer_thread, NULL);
+    if (err) {
+        fprintf(stderr, "pthread_create() error for the form writer: %s\n", strerror(err));
+        close(forms.wake_fd);
+        forms.wake_fd = -1;
+        goto out;
+    }
+    pthread_detach(tid);
+    atexit(form_writer_drain);
+    forms.started = 1;
+out:
+    pthread_mutex_unlock(&forms.lock);
+    return forms.started > 0;
+}
+
+/**
+ * Takes the finished event-loop records, oldest first. The caller has
+ * already consumed the eventfd count.
+ */
+struct form_record *form_take_done(void) {
+    struct form_record *rec, *next, *list = NULL;
+
+    pthread_mutex_lock(&forms.lock);
+    rec = forms.done;
+    forms.done = NULL;
+    pthread_mutex_unlock(&forms.lock);
+    for (; rec; rec = next) {
+        next = rec->next;
+        rec->next = list;
+        list = rec;
+    }
+    return list;
+}
+
+/**
+ * Answers a form submission whose record has been written.
+ * @param cn The client connection.
+ * @param rec The finished record; freed here.
+ */
+void form_finish(struct conn *cn, struct form_record *rec) {
+    http_send_fixed(cn, rec->ok ? FIXED_FORM_SUCCESS : FIXED_SERVER_ERROR);
+    free(rec);
+}
+
+/**
+ * Handles a form POST: hands the record to the writer and answers at once,
+ * or (with -f sync) once the record is on disk. On an event loop the
+ * connection waits in CONN_WAITING meanwhile; in the blocking modes the
+ * handler waits itself.
+ * @param cn The client connection.
+ * @param form The parsed form.
+ */
+void http_submit_form(struct conn *cn, const struct FormData *form) {
+    int durable = config.form_sync == FORM_SYNC_DURABLE;
+    struct form_record *rec, *head;
+
+    if (atomic_load(&forms.pending) >= FORM_QUEUE_MAX) {
+        http_send_fixed(cn, FIXED_FORM_BUSY); // The disk is not keeping up
+        return;
+    }
+    rec = malloc(sizeof(*rec));
+    if (rec == NULL) {
+        perror("malloc() error for form record");
+        http_send_fixed(cn, FIXED_SERVER_ERROR);
+        return;
+    }
+    rec->cn = durable && loop_done_fd >= 0 ? cn : NULL;
+    rec->wait = durable && rec->cn == NULL;
+    rec->finished = 0;
+    rec->queued = clock_ns();
+    rec->when = time(NULL);
+    strcpy(rec->name, form->name);
+    strcpy(rec->message, form->message);
+
+    if (!form_writer_start()) {
+        // No writer thread: append it here, as a batch of one.
+        rec->next = NULL;
+        rec->ok = forms.fd >= 0 && form_write_batch(rec);
+        metric_time(PHASE_FORM, clock_ns() - rec->queued);
+        form_finish(cn, rec);
+        return;
+    }
+    atomic_fetch_add(&forms.pending, 1);
+    head = atomic_load(&forms.head);
+    do {
+        rec->next = head;
+    } while (!atomic_compare_exchange_weak(&forms.head, &head, rec));
+    if (head == NULL) {
+        // The stack was empty, so the writer may be asleep. Later pushes ride along.
+        uint64_t one = 1;
+        if (write(forms.wake_fd, &one, sizeof(one)) < 0) perror("eventfd write() failed");
+    }
+
+    if (rec->cn) {
+        cn->state = CONN_WAITING;
+    } else if (rec->wait) {
+        pthread_mutex_lock(&forms.lock);
+        while (!rec->finished) pthread_cond_wait(&forms.finished, &forms.lock);
+        pthread_mutex_unlock(&forms.lock);
+        form_finish(cn, rec);
+    } else {
+        http_send_fixed(cn, FIXED_FORM_SUCCESS); // rec belongs to the writer now
+    }
+}
+
+// One served request, as handed from a request thread to the log flusher.
+// Copied into the ring as is; the flusher turns it into a JSON line.
+struct access_record {
+    struct timespec ts;   // Wall clock time the response was finished
+    struct in_addr client;
+    unsigned short port;
+    unsigned short status;
+    int worker;
+    unsigned read_us;     // First request bytes to complete request
+    unsigned handle_us;   // Complete request to queued response
+    unsigned send_us;     // Queued response to the last byte handed to the kernel
+    unsigned long long bytes;
+    char method[8];
+    char url[ACCESS_URL_MAX];
+};
+
+// Records of one request thread. Single producer (its thread) and single
+// consumer (the flusher): the producer only writes slots at head and the
+// flusher only reads them up to head, so neither ever waits. A full ring
+// drops the record and counts it.
+struct access_ring {
+    _Atomic unsigned long head __attribute__((aligned(64))); // Next slot to fill
+    _Atomic unsigned long tail __attribute__((aligned(64))); // Next slot to format
+    atomic_ulong dropped;
+    struct access_ring *next;
+    struct access_record slots[ACCESS_RING_SLOTS];
+};
+
+// The access log of this process: the rings of its threads and the flusher
+// thread that drains them. Started on first use; every worker appends to the
+// shared file with its own O_APPEND writes. Processes without an event loop
+// (fork-mode children) skip the rings and write each record directly.
+struct access_log {
+    pthread_mutex_t lock;     // Ring registration and flushing
+    struct access_ring *rings;
+    int started;              // 1 running, -1 could not be started
+    int fd;
+    time_t period;            // Rotation interval the open file belongs to
+};
+
+struct access_log alog = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .fd = -1,
+};
+
+__thread struct access_ring *alog_ring = NULL;
+__thread int worker_id = 0; // Prefork worker slot or pool thread index, for the log
+
+/**
+ * Opens the access log file, creating it if needed.
+ * @return 1 on success, 0 on error.
+ */
+int alog_open(void) {
+    int fd = open(config.access_log, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0640);
+
+    if (fd < 0) {
+        perror("open() failed for the access log");
+        return 0;
+    }
+    if (alog.fd >= 0) close(alog.fd);
+    alog.fd = fd;
+    alog.period = config.log_rotate_secs > 0 ? time(NULL) / config.log_rotate_secs : 0;
+    return 1;
+}
+
+/**
+ * Compresses a rotated log file to <file>.gz and removes the original.
+ * @param src The rotated file's path, malloc()ed; freed here.
+ */
+void alog_compress(char *src) {
+    char dst[PATH_MAX], buf[64 * 1024];
+    int fd = open(src, O_RDONLY | O_CLOEXEC);
+    gzFile gz;
+    ssize_t n = 0;
+
+    snprintf(dst, sizeof(dst), "%s.gz", src);
+    if (fd < 0 || (gz = gzopen(dst, "wb6")) == NULL) {
+        fprintf(stderr, "Cannot compress rotated access log %s\n", src);
+        if (fd >= 0) close(fd);
+        free(src);
+        return;
+    }
+    while ((n = read(fd, buf, sizeof(buf))) > 0 && gzwrite(gz, buf, n) == n)
+        ;
+    close(fd);
+    if (gzclose(gz) != Z_OK || n != 0) {
+        fprintf(stderr, "Cannot compress rotated access log %s\n", src);
+        unlink(dst); // Keep the uncompressed file
+    } else {
+        unlink(src);
+    }
+    free(src);
+}
+
+/**
+ * Runs alog_compress() on a thread of its own at low priority, so neither
+ * requests nor the flusher wait for it.
+ */
+void *alog_compress_thread(void *arg) {
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), KDF_NICE);
+    alog_compress(arg);
+    return NULL;
+}
+
+/**
+ * Rotates the access log if it is too large or its interval is over. The
+ * workers of a prefork server share the file: whoever gets the lock first
+ * renames it, the others find the new file in alog_follow().
+ */
+void alog_rotate(void) {
+    time_t now = time(NULL);
+    struct stat st, cur;
+    char *rotated;
+    pthread_t tid;
+
+    if (fstat(alog.fd, &st) < 0) return;
+    if (!(config.log_max_bytes > 0 && st.st_size >= config.log_max_bytes) &&
+        !(config.log_rotate_secs > 0 && now / config.log_rotate_secs != alog.period)) {
+        return;
+    }
+    if (st.st_size == 0) {
+        alog.period = config.log_rotate_secs > 0 ? now / config.log_rotate_secs : 0; // Nothing to keep
+        return;
+    }
+    flock(alog.fd, LOCK_EX);
+    if (stat(config.access_log, &cur) == 0 && cur.st_ino == st.st_ino && cur.st_dev == st.st_dev &&
+        (rotated = malloc(PATH_MAX)) != NULL) {
+        struct tm tm;
+        char stamp[32];
+
+        localtime_r(&now, &tm);
+        strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+        snprintf(rotated, PATH_MAX, "%s.%s.%d", config.access_log, stamp, (int)getpid());
+        if (rename(config.access_log, rotated) < 0) {
+            perror("rename() failed for the access log");
+            free(rotated);
+        } else if (!event_loop) {
+            alog_compress(rotated); // A thread would die with this short-lived process
+        } else if (pthread_create(&tid, NULL, alog_compress_thread, rotated) != 0) {
+            free(rotated); // Left uncompressed
+        } else {
+            pthread_detach(tid);
+        }
+    }
+    flock(alog.fd, LOCK_UN);
+    alog_open();
+}
+
+/**
+ * Reopens the access log if another process rotated it away.
+ */
+void alog_follow(void) {
+    struct stat st, cur;
+
+    if (fstat(alog.fd, &st) < 0) return;
+    if (stat(config.access_log, &cur) < 0 || cur.st_ino != st.st_ino || cur.st_dev != st.st_dev) alog_open();
+}
+
+/**
+ * Appends a JSON string, escaping quotes, backslashes and control bytes.
+ * @return The number of bytes written; buf needs room for 6 per input byte.
+ */
+size_t json_escape(char *buf, const char *s, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    size_t i, n = 0;
+
+    for (i = 0; i < len; i++) {
+        unsigned char c = s[i];
+
+        if (c == '"' || c == '\\') {
+            buf[n++] = '\\';
+            buf[n++] = c;
+        } else if (c < 0x20 || c >= 0x7f) {
+            memcpy(buf + n, "\\u00", 4);
+            buf[n + 4] = hex[c >> 4];
+            buf[n + 5] = hex[c & 15];
+            n += 6;
+        } else {
+            buf[n++] = c;
+        }
+    }
+    return n;
+}
+
+/**
+ * Formats one record as a JSON line.
+ * @return The length of the line; buf needs ACCESS_LINE_MAX bytes.
+ */
+size_t alog_format(char *buf, const struct access_record *r) {
+    static __thread char stamp[32];
+    static __thread time_t stamp_time = -1;
+    char client[INET_ADDRSTRLEN];
+    size_t n;
+
+    if (r->ts.tv_sec != stamp_time) {
+        struct tm tm;
+
+        gmtime_r(&r->ts.tv_sec, &tm);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+        stamp_time = r->ts.tv_sec;
+    }
+    inet_ntop(AF_INET, &r->client, client, sizeof(client));
+    n = sprintf(buf, "{\"ts\":\"%s.%06ldZ\",\"client\":\"%s:%u\",\"worker\":%d,\"method\":\"", stamp,
+                r->ts.tv_nsec / 1000, client, r->port, r->worker);
+    n += json_escape(buf + n, r->method, strnlen(r->method, sizeof(r->method)));
+    memcpy(buf + n, "\",\"url\":\"", 9);
+    n += 9;
+    n += json_escape(buf + n, r->url, strnlen(r->url, sizeof(r->url)));
+    n += sprintf(buf + n, "\",\"status\":%u,\"bytes\":%llu,\"read_us\":%u,\"handle_us\":%u,\"send_us\":%u}\n",
+                 r->status, r->bytes, r->read_us, r->handle_us, r->send_us);
+    return n;
+}
+
+/**
+ * Drains every ring into the log file, in ACCESS_BATCH_BYTES writes, and
+ * notes records that were dropped since the last flush. Caller holds
+ * alog.lock.
+ */
+void alog_flush_locked(void) {
+    static char buf[ACCESS_BATCH_BYTES];
+    struct access_ring *ring;
+    size_t len = 0;
+    int wrote = 0;
+
+    alog_follow();
+    for (ring = alog.rings; ring; ring = ring->next) {
+        unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        unsigned long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        unsigned long dropped = atomic_exchange(&ring->dropped, 0);
+
+        for (; tail != head; tail++) {
+            if (sizeof(buf) - len < ACCESS_LINE_MAX) {
+                if (write(alog.fd, buf, len) < 0) perror("access log write() failed");
+                len = 0;
+                wrote = 1;
+            }
+            len += alog_format(buf + len, &ring->slots[tail & (ACCESS_RING_SLOTS - 1)]);
+        }
+        // Release the slots only after they have been formatted.
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        if (dropped) {
+            time_t now = time(NULL);
+            struct tm tm;
+            size_t n;
+            int m;
+
+            if (sizeof(buf) - len < ACCESS_DROPPED_MAX) {
+                if (write(alog.fd, buf, len) < 0) perror("access log write() failed");
+                len = 0;
+                wrote = 1;
+            }
+            gmtime_r(&now, &tm);
+            n = strftime(buf + len, sizeof(buf) - len, "{\"ts\":\"%Y-%m-%dT%H:%M:%SZ\",", &tm);
+            if (n == 0) continue;
+            // Only keep the line if all of it fit.
+            m = snprintf(buf + len + n, sizeof(buf) - len - n, "\"dropped\":%lu}\n", dropped);
+            if (m > 0 && (size_t)m < sizeof(buf) - len - n) len += n + (size_t)m;
+        }
+    }
+    if (len > 0) {
+        if (write(alog.fd, buf, len) < 0) perror("access log write() failed");
+        wrote = 1;
+    }
+    if (wrote || config.log_rotate_secs > 0) alog_rotate();
+}
+
+/**
+ * Flusher thread: drains the rings every ACCESS_FLUSH_MS.
+ */
+void *alog_thread(void *arg) {
+    struct timespec pause = { .tv_nsec = ACCESS_FLUSH_MS * 1000000L };
+
+    (void)arg;
+    while (1) {
+        nanosleep(&pause, NULL);
+        pthread_mutex_lock(&alog.lock);
+        alog_flush_locked();
+        pthread_mutex_unlock(&alog.lock);
+    }
+    return NULL;
+}
+
+/**
+ * Writes out whatever is still buffered. Runs at exit in processes with a
+ * flusher thread, so the requests an event loop served before it failed
+ * still reach the log.
+ */
+void alog_drain(void) {
+    pthread_mutex_lock(&alog.lock);
+    if (alog.started > 0) alog_flush_locked();
+    pthread_mutex_unlock(&alog.lock);
+}
+
+/**
+ * Writes one record straight to the log file. Used by processes without an
+ * event loop, which would otherwise start a flusher thread for a single
+ * connection.
+ */
+void alog_write(const struct access_record *r) {
+    char buf[ACCESS_LINE_MAX];
+    size_t len;
+
+    pthread_mutex_lock(&alog.lock);
+    if (alog.started == 0) alog.started = alog_open() ? 1 : -1;
+    if (alog.started > 0) {
+        alog_follow();
+        len = alog_format(buf, r);
+        if (write(alog.fd, buf, len) < 0) perror("access log write() failed");
+        alog_rotate();
+    }
+    pthread_mutex_unlock(&alog.lock);
+}
+
+/**
+ * Gives the calling thread its ring, starting the flusher of this process
+ * on first use.
+ * @return The ring, or NULL if the access log is disabled or unavailable.
+ */
+struct access_ring *alog_ring_get(void) {
+    struct access_ring *ring;
+    pthread_t tid;
+    int err;
+
+    if (config.access_log == NULL) return NULL;
+    pthread_mutex_lock(&alog.lock);
+    if (alog.started == 0) {
+        alog.started = -1;
+        if (alog_open()) {
+            err = pthread_create(&tid, NULL, alog_thread, NULL);
+            if (err) {
+                fprintf(stderr, "pthread_create() error for the access log: %s\n", strerror(err));
+            } else {
+                pthread_detach(tid);
+                atexit(alog_drain);
+                alog.started = 1;
+            }
+        }
+    }
+    ring = alog.started > 0 ? calloc(1, sizeof(*ring)) : NULL;
+    if (ring) {
+        ring->next = alog.rings;
+        alog.rings = ring;
+    }
+    pthread_mutex_unlock(&alog.lock);
+    return ring;
+}
+
+/**
+ * Records a finished response in the calling thread's ring. Never blocks
+ * and makes no system call beyond the clock: if the ring is full, the
+ * record is dropped and counted. Without an event loop the record is
+ * written out at once instead.
+ * @param cn The connection, with the request and its response still in place.
+ * @param now clock_ns() when the response was finished.
+ * @param status The response status.
+ * @param bytes The response length.
+ */
+void conn_log(struct conn *cn, uint64_t now, int status, unsigned long long bytes) {
+    struct access_ring *ring = alog_ring;
+    struct str_view method = http_view(cn, cn->req.method), target = http_view(cn, cn->req.target);
+    struct access_record *r, local;
+    unsigned long head = 0;
+
+    if (config.access_log == NULL || alog.started < 0) return;
+    if (!event_loop) {
+        r = &local;
+    } else {
+        if (ring == NULL && (ring = alog_ring = alog_ring_get()) == NULL) return;
+        head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= ACCESS_RING_SLOTS) {
+            atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+            return;
+        }
+        r = &ring->slots[head & (ACCESS_RING_SLOTS - 1)];
+    }
+    if (!cn->have_peer) {
+        struct sockaddr_in addr;
+        socklen_t alen = sizeof(addr);
+
+        if (getpeername(cn->fd, (struct sockaddr *)&addr, &alen) == 0 && addr.sin_family == AF_INET) {
+            cn->peer = addr.sin_addr;
+            cn->peer_port = ntohs(addr.sin_port);
+        }
+        cn->have_peer = 1;
+    }
+
+    clock_gettime(CLOCK_REALTIME_COARSE, &r->ts);
+    r->client = cn->peer;
+    r->port = cn->peer_port;
+    r->worker = worker_id;
+    r->status = status;
+    r->bytes = bytes;
+    r->read_us = cn->t_start && cn->t_parsed ? (cn->t_parsed - cn->t_start) / 1000 : 0;
+    r->handle_us = cn->t_parsed && cn->t_queued ? (cn->t_queued - cn->t_parsed) / 1000 : 0;
+    r->send_us = cn->t_queued ? (now - cn->t_queued) / 1000 : 0;
+    if (method.len >= sizeof(r->method)) method.len = sizeof(r->method) - 1;
+    memcpy(r->method, method.p, method.len);
+    r->method[method.len] = '\0';
+    if (target.len >= sizeof(r->url)) target.len = sizeof(r->url) - 1;
+    memcpy(r->url, target.p, target.len);
+    r->url[target.len] = '\0';
+    if (r == &local) alog_write(r);
+    else atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/**
+ * Records a finished response: counters and phase latencies for /metrics,
+ * then the access log.
+ * @param cn The connection, with the request and its response still in place.
+ */
+void conn_done(struct conn *cn) {
+    uint64_t now = clock_ns();
+    int status = 0;
+    unsigned long long bytes = cn->wlen + cn->blen + (cn->file_end - cn->file_start);
+
+    if (cn->wlen >= 12) status = (cn->wbuf[9] - '0') * 100 + (cn->wbuf[10] - '0') * 10 + (cn->wbuf[11] - '0');
+    metric_add(M_REQUESTS, 1);
+    metric_add(M_BYTES, bytes);
+    if (status >= 100 && status < 600) metric_add(M_STATUS_1XX + status / 100 - 1, 1);
+    if (cn->t_start && cn->t_parsed) metric_time(PHASE_READ, cn->t_parsed - cn->t_start);
+    if (cn->parse_ns) metric_time(PHASE_PARSE, cn->parse_ns);
+    if (cn->lookup_ns) metric_time(PHASE_LOOKUP, cn->lookup_ns);
+    if (cn->t_queued) metric_time(PHASE_SEND, now - cn->t_queued);
+    conn_log(cn, now, status, bytes);
+}
+
+/**
+ * Appends to a metrics page being built.
+ */
+void metrics_printf(char *buf, size_t size, size_t *len, const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    if (*len >= size) return;
+    va_start(ap, fmt);
+    n = vsnprintf(buf + *len, size - *len, fmt, ap);
+    va_end(ap);
+    *len = n < 0 ? *len : *len + n < size ? *len + n : size;
+}
+
+/**
+ * Answers a request for the metrics path: every worker's counters and
+ * histograms, summed, in the Prometheus text format. Histograms are
+ * exported with a bucket per power of two nanoseconds, from 2^10 (about
+ * 1 us) to 2^36 (about 68.7 s).
+ * @param cn The client connection.
+ */
+void http_send_metrics(struct conn *cn) {
+    static const char *const status_names[5] = {"1xx", "2xx", "3xx", "4xx", "5xx"};
+    uint64_t counters[NCOUNTERS] = {0};
+    static __thread struct histogram phases[NPHASES];
+    size_t size = 64 * 1024, len = 0;
+    char *buf;
+    int i, p, k;
+
+    if (metrics == NULL) {
+        http_send_fixed(cn, FIXED_NOT_FOUND);
+        return;
+    }
+    buf = arena_alloc(&cn->arena, size);
+    if (buf == NULL) {
+        cn->state = CONN_CLOSED;
+        return;
+    }
+    memset(phases, 0, sizeof(phases));
+    for (i = 0; i < METRIC_BLOCKS; i++) {
+        struct metric_block *b = &metrics->blocks[i];
+        unsigned j;
+
+        for (j = 0; j < NCOUNTERS; j++) counters[j] += __atomic_load_n(&b->counters[j], __ATOMIC_RELAXED);
+        for (p = 0; p < NPHASES; p++) {
+            phases[p].count += __atomic_load_n(&b->phases[p].count, __ATOMIC_RELAXED);
+            phases[p].sum += __atomic_load_n(&b->phases[p].sum, __ATOMIC_RELAXED);
+            for (j = 0; j < HIST_BUCKETS; j++) {
+                phases[p].buckets[j] += __atomic_load_n(&b->phases[p].buckets[j], __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    metrics_printf(buf, size, &len,
+                   "# HELP httpd_requests_total Responses sent.\n"
+                   "# TYPE httpd_requests_total counter\n"
+                   "httpd_requests_total %" PRIu64 "\n"
+                   "# HELP httpd_responses_total Responses sent by status class.\n"
+                   "# TYPE httpd_responses_total counter\n",
+                   counters[M_REQUESTS]);
+    for (i = 0; i < 5; i++) {
+        metrics_printf(buf, size, &len, "httpd_responses_total{code=\"%s\"} %" PRIu64 "\n", status_names[i],
+                       counters[M_STATUS_1XX + i]);
+    }
+    metrics_printf(buf, size, &len,
+                   "# HELP httpd_sent_bytes_total Response bytes sent, headers included.\n"
+                   "# TYPE httpd_sent_bytes_total counter\n"
+                   "httpd_sent_bytes_total %" PRIu64 "\n"
+                   "# HELP httpd_cache_hits_total Static files served from the shared cache.\n"
+                   "# TYPE httpd_cache_hits_total counter\n"
+                   "httpd_cache_hits_total %" PRIu64 "\n"
+                   "# HELP httpd_cache_misses_total Cacheable static files that had to be read from the docroot.\n"
+                   "# TYPE httpd_cache_misses_total counter\n"
+                   "httpd_cache_misses_total %" PRIu64 "\n"
+                   "# HELP httpd_accept_errors_total Failed accept() calls.\n"
+                   "# TYPE httpd_accept_errors_total counter\n"
+                   "httpd_accept_errors_total %" PRIu64 "\n"
+                   "# HELP httpd_phase_seconds Time spent in each phase of request handling.\n"
+                   "# TYPE httpd_phase_seconds histogram\n",
+                   counters[M_BYTES], counters[M_CACHE_HITS], counters[M_CACHE_MISSES], counters[M_ACCEPT_ERRORS]);
+    for (p = 0; p < NPHASES; p++) {
+        uint64_t cum = 0;
+        unsigned j = 0;
+
+        // Buckets below index (k - 3) * HIST_SUB hold values under 2^k ns.
+        for (k = 10; k <= 36; k++) {
+            for (; j < (unsigned)(k - HIST_SUB_BITS + 1) * HIST_SUB; j++) cum += phases[p].buckets[j];
+            metrics_printf(buf, size, &len, "httpd_phase_seconds_bucket{phase=\"%s\",le=\"%.9g\"} %" PRIu64 "\n",
+                           phase_names[p], (double)((uint64_t)1 << k) / 1e9, cum);
+        }
+        metrics_printf(buf, size, &len,
+                       "httpd_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %" PRIu64 "\n"
+                       "httpd_phase_seconds_sum{phase=\"%s\"} %.9f\n"
+                       "httpd_phase_seconds_count{phase=\"%s\"} %" PRIu64 "\n",
+                       phase_names[p], phases[p].count, phase_names[p], phases[p].sum / 1e9, phase_names[p],
+                       phases[p].count);
+    }
+    http_send_response_ref(cn, 200, "text/plain; version=0.0.4; charset=utf-8", buf, len);
+}
+
+
+/**
+ * Handles a fully buffered request and queues its response on the connection.
+ * @param cn The client connection, with the complete request in cn->rbuf.
+ */
+void conn_handle(struct conn *cn) {
+    struct str_view method = http_view(cn, cn->req.method);
+    struct str_view target = http_view(cn, cn->req.target);
+
+    if (sv_eq(method, "GET")) {
         char file_path[256];
-        if (strcmp(req->url, "/") == 0) {
-            snprintf(file_path, sizeof(file_path), "index.html");
+        const char *query = memchr(target.p, '?', target.len);
+        size_t path_len = query ? (size_t)(query - target.p) : target.len;
+
+        if (config.metrics_path && path_len == strlen(config.metrics_path) &&
+            memcmp(target.p, config.metrics_path, path_len) == 0) {
+            http_send_metrics(cn);
+            return;
+        }
+        if (path_len + 2 > sizeof(file_path)) {
+            http_send_fixed(cn, FIXED_URI_TOO_LONG);
+            return;
+        }
+        if (!docroot_path(file_path, sizeof(file_path), target.p, path_len)) {
+            http_send_fixed(cn, FIXED_NOT_FOUND); // Climbs out of the docroot
+            return;
+        }
+
+        if (!http_send_static(cn, file_path, cache_url_ok(file_path + 1))) {
+            http_send_fixed(cn, FIXED_NOT_FOUND);
+        }
+    } else if (sv_eq(method, "POST")) {
+        // The body was decoded while it arrived.
+        struct FormData empty, *form_data = cn->form ? &cn->form->data : &empty;
+
+        if (cn->form == NULL) memset(&empty, 0, sizeof(empty));
+        if (sv_eq(target, "/login") || sv_eq(target, "/register")) {
+            http_auth(cn, sv_eq(target, "/login") ? KDF_VERIFY : KDF_HASH, form_data);
+            return; // Credentials are not echoed to the log
+        }
+        if (sv_eq(target, "/logout")) {
+            session_revoke(cn);
+            http_send_fixed(cn, FIXED_LOGGED_OUT);
+            return;
+        }
+        http_submit_form(cn, form_data);
+    } else {
+        http_send_fixed(cn, FIXED_NOT_ALLOWED);
+    }
+}
+
+/**
+ * Decides whether the connection may stay open after the current request:
+ * HTTP/1.1 defaults to keep-alive, HTTP/1.0 needs "Connection: keep-alive",
+ * and "Connection: close" or the per-connection request limit end it.
+ * @param cn The connection with a complete request buffered.
+ * @return 1 to keep the connection open, 0 to close it after the response.
+ */
+int http_wants_keep_alive(struct conn *cn) {
+    struct str_view value = http_header(cn, HDR_CONNECTION);
+    char token[32];
+    int keep;
+
+    if (cn->nrequests >= config.keepalive_max) return 0;
+    keep = sv_eq(http_view(cn, cn->req.version), "HTTP/1.1");
+
+    if (value.p) {
+        size_t vlen = value.len < sizeof(token) ? value.len : sizeof(token) - 1;
+        memcpy(token, value.p, vlen);
+        token[vlen] = '\0';
+        if (strcasestr(token, "close")) keep = 0;
+        else if (strcasestr(token, "keep-alive")) keep = 1;
+    }
+    return keep;
+}
+
+/**
+ * Handles the complete request at the start of cn->rbuf. Any pipelined bytes
+ * behind it are hidden from the handler for the duration of the call.
+ * @param cn The client connection.
+ */
+void conn_dispatch(struct conn *cn) {
+    char saved = cn->rbuf[cn->need];
+
+    cn->nrequests++;
+    cn->keep_alive = http_wants_keep_alive(cn);
+    cn->rbuf[cn->need] = '\0';
+    conn_handle(cn);
+    cn->rbuf[cn->need] = saved;
+}
+
+/**
+ * Answers a request that request_progress() refused with its error status
+ * and closes the connection afterwards: what follows it in the stream cannot
+ * be trusted to start a new request.
+ * @param cn The client connection, with cn->reject set.
+ */
+void conn_reject(struct conn *cn) {
+    cn->keep_alive = 0;
+    http_send_fixed(cn, cn->reject == 431   ? FIXED_HEADERS_TOO_LARGE
+                        : cn->reject == 413 ? FIXED_TOO_LARGE
+                                            : FIXED_BAD_REQUEST);
+}
+
+/**
+ * Drops the request that was just answered and gets the connection ready for
+ * the next one, keeping any pipelined bytes that already arrived.
+ * @param cn The client connection.
+ */
+void conn_next_request(struct conn *cn) {
+    size_t rest = cn->rlen - cn->need;
+
+    if (rest) {
+        memmove(cn->rbuf, cn->rbuf + cn->need, rest);
+        cn->rlen = rest;
+        cn->rbuf[cn->rlen] = '\0';
+    } else {
+        conn_drop_rbuf(cn);
+    }
+    http_request_init(&cn->req);
+    cn->header_len = 0;
+    cn->need = 0;
+    cn->body_left = 0;
+    cn->form = NULL;
+    cache_unpin(cn);
+    arena_release(&cn->arena);
+    cn->wbuf = NULL;
+    cn->wlen = 0;
+    cn->woff = 0;
+    cn->bbuf = NULL;
+    cn->blen = cn->boff = 0;
+    if (cn->file_fd >= 0) close(cn->file_fd);
+    cn->file_fd = -1;
+    cn->file_start = cn->file_off = 0;
+    cn->file_end = 0;
+    cn->use_splice = 0;
+    cn->t_start = cn->t_parsed = cn->t_queued = 0;
+    cn->parse_ns = cn->lookup_ns = 0;
+    cn->state = CONN_READING;
+}
+
+/**
+ * Advances a connection through read -> handle -> write as far as its socket
+ * allows, looping over further requests while the connection is kept alive.
+ * Requests are answered strictly one after another, so pipelined responses
+ * go out in request order.
+ * @param cn The client connection.
+ * @return 1 once the connection is finished and can be closed, 0 if it is waiting for I/O.
+ */
+int conn_step(struct conn *cn) {
+    while (1) {
+        if (cn->state == CONN_READING) {
+            int r = read_full_request(cn);
+            if (r == 0) return 0;
+            if (r < 0 && cn->reject) {
+                conn_reject(cn);
+            } else if (r < 0) {
+                cn->state = CONN_CLOSED;
+                return 1;
+            } else {
+                conn_dispatch(cn);
+            }
+        }
+
+        if (cn->state == CONN_WAITING) return 0; // Resumed once its password hash is done
+
+        if (cn->state == CONN_WRITING) {
+            int r = conn_flush(cn);
+            if (r == 0) return 0;
+            if (r > 0) conn_done(cn);
+            if (r < 0 || !cn->keep_alive) {
+                cn->state = CONN_CLOSED;
+                return 1;
+            }
+            conn_next_request(cn);
+            continue;
+        }
+
+        return 1;
+    }
+}
+
+/**
+ * The main handler for a client connection on a blocking socket.
+ * Idle keep-alive connections are closed through socket timeouts.
+ * @param c The client socket file descriptor.
+ */
+void cli_conn(int c) {
+    struct conn cn;
+    struct timeval tv = { .tv_sec = config.keepalive_timeout };
+
+    setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    conn_init(&cn, c);
+    // On a blocking socket conn_step() only stops early when a timeout expired.
+    conn_step(&cn);
+    conn_free(&cn);
+    close(c);
+}
+
+void conn_list_remove(struct conn_list *l, struct conn *cn) {
+    if (cn->idle_prev) cn->idle_prev->idle_next = cn->idle_next;
+    else if (l->head == cn) l->head = cn->idle_next;
+    if (cn->idle_next) cn->idle_next->idle_prev = cn->idle_prev;
+    else if (l->tail == cn) l->tail = cn->idle_prev;
+    cn->idle_prev = cn->idle_next = NULL;
+}
+
+/**
+ * Marks a connection as active now by moving it to the tail of the idle list.
+ */
+void conn_list_touch(struct conn_list *l, struct conn *cn, time_t now) {
+    cn->last_active = now;
+    if (l->tail == cn) return;
+    conn_list_remove(l, cn);
+    cn->idle_prev = l->tail;
+    if (l->tail) l->tail->idle_next = cn;
+    else l->head = cn;
+    l->tail = cn;
+}
+
+/**
+ * Raises the soft open file limit to the hard limit so the event loop can
+ * hold tens of thousands of connections.
+ */
+void raise_fd_limit(void) {
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) != 0) {
+            perror("setrlimit() failed");
+        }
+    }
+}
+
+/**
+ * Closes a connection owned by the event loop and frees its state.
+ * Closing the fd also removes it from the epoll set.
+ * @param l The idle list the connection is on.
+ * @param cn The connection to tear down.
+ */
+void conn_destroy(struct conn_list *l, struct conn *cn) {
+    conn_list_remove(l, cn);
+    close(cn->fd);
+    conn_free(cn);
+    free(cn);
+}
+
+/**
+ * Single-process, edge-triggered epoll server loop.
+ * Every socket is non-blocking and every connection is a struct conn that is
+ * advanced by conn_step() whenever epoll reports it ready.
+ * @param s The listening socket file descriptor.
+ * @return -1 on a fatal error; otherwise it never returns.
+ */
+int run_epoll(int s) {
+    struct epoll_event ev, events[MAX_EVENTS];
+    struct conn_list idle = { NULL, NULL };
+    int ep, dfd, n, i;
+    time_t now;
+
+    event_loop = 1;
+    raise_fd_limit();
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+
+    ep = epoll_create1(EPOLL_CLOEXEC);
+    if (ep < 0) {
+        snprintf(error_msg, sizeof(error_msg), "epoll_create1() error: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // The listening socket is tagged with a NULL pointer, connections with their state.
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, s, &ev) < 0) {
+        snprintf(error_msg, sizeof(error_msg), "epoll_ctl() error: %s\n", strerror(errno));
+        close(ep);
+        return -1;
+    }
+
+    // Finished password hashes and form syncs are announced on an eventfd, tagged with &loop_done_fd.
+    dfd = loop_done_attach(EFD_NONBLOCK);
+    if (dfd < 0) {
+        fprintf(stderr, "Warning: logins and synced form posts will block the event loop: %s", error_msg);
+    } else {
+        ev.events = EPOLLIN;
+        ev.data.ptr = &loop_done_fd;
+        if (epoll_ctl(ep, EPOLL_CTL_ADD, dfd, &ev) < 0) {
+            snprintf(error_msg, sizeof(error_msg), "epoll_ctl() error: %s\n", strerror(errno));
+            close(ep);
+            return -1;
+        }
+    }
+
+    while (1) {
+        // Wake up at least once a second to expire idle connections.
+        n = epoll_wait(ep, events, MAX_EVENTS, 1000);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            snprintf(error_msg, sizeof(error_msg), "epoll_wait() error: %s\n", strerror(errno));
+            close(ep);
+            return -1;
+        }
+        now = now_sec();
+
+        for (i = 0; i < n; i++) {
+            struct conn *cn = events[i].data.ptr;
+
+            if ((void *)cn == &loop_done_fd) {
+                struct kdf_job *job, *next;
+                struct form_record *rec, *rnext;
+                uint64_t count;
+
+                if (read(dfd, &count, sizeof(count)) < 0 && errno != EAGAIN) perror("eventfd read() failed");
+                for (job = kdf_take_done(); job; job = next) {
+                    next = job->next; // The job goes with the arena once the response is sent
+                    cn = job->cn;
+                    auth_finish(cn, job);
+                    conn_list_touch(&idle, cn, now);
+                    if (conn_step(cn)) conn_destroy(&idle, cn);
+                }
+                for (rec = form_take_done(); rec; rec = rnext) {
+                    rnext = rec->next;
+                    cn = rec->cn;
+                    form_finish(cn, rec);
+                    conn_list_touch(&idle, cn, now);
+                    if (conn_step(cn)) conn_destroy(&idle, cn);
+                }
+                continue;
+            }
+
+            if (cn == NULL) {
+                // Edge-triggered: drain the accept queue completely.
+                while (1) {
+                    int c = accept4(s, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if (c < 0) {
+                        if (errno == EINTR || errno == ECONNABORTED) continue;
+                        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                            metric_add(M_ACCEPT_ERRORS, 1);
+                            fprintf(stderr, "Accept() error: %s\n", strerror(errno));
+                        }
+                        break;
+                    }
+
+                    cn = malloc(sizeof(struct conn));
+                    if (cn == NULL) {
+                        perror("malloc() error for conn");
+                        close(c);
+                        continue;
+                    }
+                    conn_init(cn, c);
+                    conn_list_touch(&idle, cn, now);
+
+                    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                    ev.data.ptr = cn;
+                    if (epoll_ctl(ep, EPOLL_CTL_ADD, c, &ev) < 0) {
+                        perror("epoll_ctl() failed");
+                        conn_destroy(&idle, cn);
+                    }
+                }
+                continue;
+            }
+
+            conn_list_touch(&idle, cn, now);
+            if (conn_step(cn)) {
+                conn_destroy(&idle, cn);
+            }
+        }
+
+        // The list is ordered by activity, so stop at the first live connection.
+        while (idle.head && now - idle.head->last_active >= config.keepalive_timeout) {
+            if (idle.head->state == CONN_WAITING) conn_list_touch(&idle, idle.head, now); // Its job holds it
+            else conn_destroy(&idle, idle.head);
+        }
+    }
+}
+
+
+// Operation tags kept in the low bits of an SQE's user_data, next to the
+// (malloc-aligned) uring_conn pointer the operation belongs to.
+enum uring_op {
+    UOP_ACCEPT,    // Multishot accept on the listener (no connection)
+    UOP_RECV,      // Multishot recv into the provided buffer ring
+    UOP_SEND_HDR,  // Send of the queued headers (wbuf)
+    UOP_SEND_BODY, // Send of a file chunk, linked after UOP_SEND_HDR
+    UOP_READ,      // Read of the next file chunk
+    UOP_CANCEL,    // Cancellation of everything pending on a connection's socket
+    UOP_TIMER,     // Once-a-second tick for idle timeouts (no connection)
+    UOP_DONE       // Read of the loop's completion eventfd (no connection)
+};
+#define UOP_MASK 7
+
+// A raw io_uring instance plus its provided receive buffer ring.
+struct uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;           // SQEs queued since the last io_uring_enter()
+    struct io_uring_buf_ring *br; // Receive buffers handed to the kernel
+    char *bufs;
+    unsigned short br_tail;
+    struct conn_list idle;        // Live connections by last activity
+    struct __kernel_timespec tick;
+    int done_fd;                  // loop_done_fd: finished password hashes and form syncs, or -1
+    int recv_capped;              // The kernel stops multishot recvs after URING_PIPELINE_MAX bytes
+    uint64_t done_count;
+};
+
+// A connection driven by completions instead of readiness.
+struct uring_conn {
+    struct conn cn;
+    int inflight;     // Operations whose final completion has not arrived yet
+    int recv_armed;   // A multishot recv is active
+    int recv_stopping; // A cancel of that recv is in flight
+    int out_busy;     // Sends or a file read in flight for the response
+    int closing;
+    char *chunk;      // File bytes read but not yet sent
+    size_t chunk_len;
+    size_t chunk_off;
+};
+
+int uring_enter(struct uring *r, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, r->fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/**
+ * Hands a receive buffer (back) to the kernel.
+ * @param r The ring.
+ * @param bid The buffer id.
+ */
+void uring_buf_recycle(struct uring *r, unsigned short bid) {
+    struct io_uring_buf *buf = &r->br->bufs[r->br_tail & (URING_BUFS - 1)];
+
+    buf->addr = (unsigned long)(r->bufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    r->br_tail++;
+    __atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Sets up the submission/completion rings and the receive buffer ring.
+ * @param r The ring to initialize.
+ * @return 1 on success, 0 on error (error_msg is set).
+ */
+int uring_init(struct uring *r, unsigned entries) {
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    size_t sq_size, cq_size;
+    char *sq_ptr, *cq_ptr;
+    unsigned i;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4; // Multishot operations post many completions per submission
+
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        snprintf(error_msg, sizeof(error_msg), "io_uring_setup() error: %s\n", strerror(errno));
+        return 0;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        snprintf(error_msg, sizeof(error_msg), "io_uring: kernel too old (no single mmap)\n");
+        close(r->fd);
+        return 0;
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_size > sq_size) sq_size = cq_size;
+    sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (sq_ptr == MAP_FAILED || r->sqes == MAP_FAILED) {
+        snprintf(error_msg, sizeof(error_msg), "io_uring mmap() error: %s\n", strerror(errno));
+        close(r->fd);
+        return 0;
+    }
+    cq_ptr = sq_ptr;
+
+    r->sq_entries = p.sq_entries;
+    r->sq_head = (unsigned *)(sq_ptr + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq_ptr + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq_ptr + p.cq_off.cqes);
+
+    // Provided buffer ring: recv picks a free buffer only when data arrives,
+    // so idle connections do not pin any receive memory.
+    r->br = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    r->bufs = malloc((size_t)URING_BUFS * URING_BUF_SIZE);
+    if (r->br == MAP_FAILED || r->bufs == NULL) {
+        snprintf(error_msg, sizeof(error_msg), "io_uring: buffer ring allocation failed\n");
+        close(r->fd);
+        return 0;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)r->br;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = URING_BGID;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        snprintf(error_msg, sizeof(error_msg), "io_uring buffer ring error: %s\n", strerror(errno));
+        close(r->fd);
+        return 0;
+    }
+    for (i = 0; i < URING_BUFS; i++) {
+        uring_buf_recycle(r, i);
+    }
+    return 1;
+}
+
+/**
+ * Makes room for n more SQEs, flushing the queue to the kernel if it is full.
+ * Linked SQEs must reserve together so a flush cannot split the chain.
+ */
+void uring_reserve(struct uring *r, unsigned n) {
+    while (*r->sq_tail + n - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) > r->sq_entries) {
+        int done = uring_enter(r, r->to_submit, 0, 0);
+        if (done > 0) r->to_submit -= done;
+    }
+}
+
+/**
+ * Returns a zeroed SQE for the given connection and operation. SQEs are only
+ * handed to the kernel by the next io_uring_enter(), so a whole batch of them
+ * goes out with one system call.
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *r, struct uring_conn *ucn, enum uring_op op) {
+    struct io_uring_sqe *sqe;
+    unsigned tail, idx;
+
+    uring_reserve(r, 1);
+    tail = *r->sq_tail;
+    idx = tail & *r->sq_mask;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (unsigned long)ucn | op;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->to_submit++;
+    if (ucn) ucn->inflight++;
+    return sqe;
+}
+
+void uring_arm_accept(struct uring *r, int s) {
+    struct io_uring_sqe *sqe = uring_get_sqe(r, NULL, UOP_ACCEPT);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = s;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+void uring_arm_recv(struct uring *r, struct uring_conn *ucn) {
+    struct io_uring_sqe *sqe = uring_get_sqe(r, ucn, UOP_RECV);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = ucn->cn.fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    // sqe->optlen in newer headers: the total the recv may take in before it
+    // ends. Armed only in CONN_READING, so a response or job in flight never
+    // has more than that buffered behind it.
+    if (r->recv_capped) sqe->file_index = URING_PIPELINE_MAX;
+    ucn->recv_armed = 1;
+}
+
+void uring_prep_send(struct uring *r, struct uring_conn *ucn, enum uring_op op, const char *buf, size_t len) {
+    struct io_uring_sqe *sqe = uring_get_sqe(r, ucn, op);
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = ucn->cn.fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    // MSG_WAITALL makes a short send fail the link instead of letting the
+    // linked body overtake the rest of the headers.
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    ucn->out_busy++;
+}
+
+/**
+ * Cancels the connection's multishot recv once more than URING_PIPELINE_MAX
+ * bytes are buffered while a response or job is in flight. Only needed on
+ * kernels without the recv byte cap; either way the socket is then left
+ * alone, so a client that sends without reading is held back by TCP flow
+ * control instead of growing the request buffer. conn_next_request() puts
+ * the connection back into CONN_READING, and uring_conn_advance() re-arms
+ * the recv once its final completion has arrived.
+ */
+void uring_stop_recv(struct uring *r, struct uring_conn *ucn) {
+    struct io_uring_sqe *sqe;
+    int n;
+
+    if (!ucn->recv_armed || ucn->recv_stopping || ucn->cn.state == CONN_READING || ucn->cn.state == CONN_CLOSED ||
+        ucn->cn.rlen <= URING_PIPELINE_MAX) {
+        return;
+    }
+    sqe = uring_get_sqe(r, ucn, UOP_CANCEL);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (unsigned long)ucn | UOP_RECV;
+    ucn->recv_stopping = 1;
+    // Submit right away: until the cancel reaches the kernel the recv keeps
+    // posting whatever the client sends.
+    n = uring_enter(r, r->to_submit, 0, 0);
+    if (n > 0) r->to_submit -= n;
+}
+
+/**
+ * Frees a connection once no operation references it any more.
+ */
+void uring_conn_destroy(struct uring_conn *ucn) {
+    close(ucn->cn.fd);
+    conn_free(&ucn->cn);
+    free(ucn->chunk);
+    free(ucn);
+}
+
+/**
+ * Submits whatever operation the connection needs next: a recv while the
+ * request is incomplete, the next file read, or the headers linked with the
+ * next body chunk. Starts teardown once the connection is finished.
+ */
+void uring_conn_advance(struct uring *r, struct uring_conn *ucn) {
+    struct conn *cn = &ucn->cn;
+
+    if (ucn->closing) {
+        if (ucn->inflight == 0) uring_conn_destroy(ucn);
+        return;
+    }
+
+    // Answer pipelined requests that are already buffered, one at a time.
+    // While reading, the parser bounds rlen: headers are size-limited and
+    // bodies are consumed as they stream in.
+    while (cn->state == CONN_READING) {
+        int progress = request_progress(cn);
+        if (progress == 0) {
+            if (!ucn->recv_armed) uring_arm_recv(r, ucn);
+            return;
+        }
+        if (progress < 0 && cn->reject) conn_reject(cn);
+        else if (progress < 0) cn->state = CONN_CLOSED;
+        else conn_dispatch(cn);
+    }
+    uring_stop_recv(r, ucn);
+    if (cn->state == CONN_WAITING) return; // Resumed from the UOP_DONE completion
+
+    if (cn->state == CONN_WRITING) {
+        int have_chunk = ucn->chunk_off < ucn->chunk_len;
+        int have_body = cn->boff < cn->blen;
+        if (ucn->out_busy) return;
+
+        if (cn->file_fd >= 0 && !have_chunk && cn->file_off < cn->file_end) {
+            struct io_uring_sqe *sqe;
+            off_t left = cn->file_end - cn->file_off;
+
+            if (ucn->chunk == NULL && (ucn->chunk = malloc(URING_CHUNK)) == NULL) {
+                perror("malloc() error for file chunk");
+                cn->state = CONN_CLOSED;
+            } else {
+                sqe = uring_get_sqe(r, ucn, UOP_READ);
+                sqe->opcode = IORING_OP_READ;
+                sqe->fd = cn->file_fd;
+                sqe->addr = (unsigned long)ucn->chunk;
+                sqe->len = left < URING_CHUNK ? left : URING_CHUNK;
+                sqe->off = cn->file_off;
+                ucn->out_busy++;
+                return;
+            }
+        } else if (cn->woff < cn->wlen || have_chunk || have_body) {
+            uring_reserve(r, 2);
+            if (cn->woff < cn->wlen) {
+                uring_prep_send(r, ucn, UOP_SEND_HDR, cn->wbuf + cn->woff, cn->wlen - cn->woff);
+                if (have_chunk || have_body) {
+                    // Linked to the body, and corked so both leave in one segment.
+                    struct io_uring_sqe *hdr = &r->sqes[(*r->sq_tail - 1) & *r->sq_mask];
+                    hdr->flags |= IOSQE_IO_LINK;
+                    hdr->msg_flags |= MSG_MORE;
+                }
+            }
+            // A response has either a file body (read in chunks) or an in-memory one.
+            if (have_chunk) {
+                uring_prep_send(r, ucn, UOP_SEND_BODY, ucn->chunk + ucn->chunk_off,
+                                ucn->chunk_len - ucn->chunk_off);
+            } else if (have_body) {
+                uring_prep_send(r, ucn, UOP_SEND_BODY, cn->bbuf + cn->boff, cn->blen - cn->boff);
+            }
+            return;
+        } else if (cn->keep_alive) {
+            // Everything has been sent: move on to the next request.
+            conn_done(cn);
+            conn_next_request(cn);
+            ucn->chunk_len = ucn->chunk_off = 0;
+            uring_conn_advance(r, ucn);
+            return;
         } else {
-            snprintf(file_path, sizeof(file_path), ".%s", req->url);
+            conn_done(cn);
+            cn->state = CONN_CLOSED; // Everything has been sent
+        }
+    }
+
+    // CONN_CLOSED: cancel whatever is pending on the socket and free the
+    // connection once the last completion has arrived.
+    ucn->closing = 1;
+    conn_list_remove(&r->idle, cn);
+    if (ucn->inflight > 0) {
+        struct io_uring_sqe *sqe = uring_get_sqe(r, ucn, UOP_CANCEL);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = cn->fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    }
+    if (ucn->inflight == 0) uring_conn_destroy(ucn);
+}
+
+void uring_arm_timer(struct uring *r) {
+    struct io_uring_sqe *sqe = uring_get_sqe(r, NULL, UOP_TIMER);
+
+    r->tick.tv_sec = 1;
+    r->tick.tv_nsec = 0;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (unsigned long)&r->tick;
+    sqe->len = 1;
+}
+
+void uring_arm_done(struct uring *r) {
+    struct io_uring_sqe *sqe = uring_get_sqe(r, NULL, UOP_DONE);
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = r->done_fd;
+    sqe->addr = (unsigned long)&r->done_count;
+    sqe->len = sizeof(r->done_count);
+    sqe->off = -1; // Not seekable
+}
+
+/**
+ * Handles one completion.
+ */
+void uring_complete(struct uring *r, int s, unsigned long long user_data, int res, unsigned flags) {
+    enum uring_op op = user_data & UOP_MASK;
+    struct uring_conn *ucn = (struct uring_conn *)(unsigned long)(user_data & ~(unsigned long long)UOP_MASK);
+    struct conn *cn;
+
+    if (op == UOP_ACCEPT) {
+        if (res >= 0) {
+            ucn = calloc(1, sizeof(struct uring_conn));
+            if (ucn == NULL) {
+                perror("malloc() error for conn");
+                close(res);
+            } else {
+                conn_init(&ucn->cn, res);
+                conn_list_touch(&r->idle, &ucn->cn, now_sec());
+                uring_conn_advance(r, ucn);
+            }
+        } else if (res != -EINTR && res != -ECONNABORTED) {
+            metric_add(M_ACCEPT_ERRORS, 1);
+            fprintf(stderr, "Accept() error: %s\n", strerror(-res));
+        }
+        if (!(flags & IORING_CQE_F_MORE)) uring_arm_accept(r, s);
+        return;
+    }
+
+    if (op == UOP_TIMER) {
+        time_t now = now_sec();
+        // The list is ordered by activity, so stop at the first live connection.
+        while (r->idle.head && now - r->idle.head->last_active >= config.keepalive_timeout) {
+            ucn = (struct uring_conn *)r->idle.head; // cn is the first member
+            if (ucn->cn.state == CONN_WAITING) {
+                conn_list_touch(&r->idle, &ucn->cn, now); // Its job holds it
+                continue;
+            }
+            ucn->cn.state = CONN_CLOSED;
+            uring_conn_advance(r, ucn);
+        }
+        uring_arm_timer(r);
+        return;
+    }
+
+    if (op == UOP_DONE) {
+        struct kdf_job *job, *next;
+        struct form_record *rec, *rnext;
+
+        for (job = kdf_take_done(); job; job = next) {
+            next = job->next; // The job goes with the arena once the response is sent
+            ucn = (struct uring_conn *)job->cn;
+            auth_finish(&ucn->cn, job);
+            conn_list_touch(&r->idle, &ucn->cn, now_sec());
+            uring_conn_advance(r, ucn);
         }
-       
-        f = fileread(file_path);
-        if (!f) {
-            res = "File not found";
-            http_send_response(c, 404, "text/plain", res, strlen(res));
-        } else {
-            const char *content_type = get_content_type(file_path);
-            http_send_response(c, 200, content_type, f->fc, f->size);
-            free(f->fc);
-            free(f);
-        }
-    } else if (strcmp(req->method, "POST") == 0) {
-        // Correctly find the body data after the headers.
-        char *header_end = strstr(full_request_data, "\r\n\r\n");
-        char *body_data = NULL;
-        
-        if (header_end) {
-            body_data = header_end + 4;
-            printf("Received POST body: %s\n", body_data);
-
-            // 1. Parse the raw POST data into a structured format
-            struct FormData form_data = parse_user_data(body_data);
-     
-            // 2. Open the file in append mode ("a") and format the output
-            FILE *fp = fopen("form_data.txt", "a");
-            if (fp != NULL) {
-                time_t now = time(NULL);
-                struct tm time_info; // New local struct for time info
-                struct tm *t = localtime_r(&now, &time_info); // Use thread-safe version
-
-                if (t != NULL) { // Check for a valid return from localtime_r
-                    fprintf(fp, "[%d-%02d-%02d %02d:%02d:%02d] Name: %s, Message: %s\n",
-                            t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
-                            t->tm_hour, t->tm_min, t->tm_sec,
-                            form_data.name, form_data.message);
-                } else {
-                    fprintf(fp, "[Time Error] Name: %s, Message: %s\n",
-                            form_data.name, form_data.message);
-                    perror("localtime_r failed");
+        for (rec = form_take_done(); rec; rec = rnext) {
+            rnext = rec->next;
+            ucn = (struct uring_conn *)rec->cn;
+            form_finish(&ucn->cn, rec);
+            conn_list_touch(&r->idle, &ucn->cn, now_sec());
+            uring_conn_advance(r, ucn);
+        }
+        if (res < 0) fprintf(stderr, "eventfd read failed: %s\n", strerror(-res));
+        uring_arm_done(r);
+        return;
+    }
+
+    cn = &ucn->cn;
+    if (!(flags & IORING_CQE_F_MORE)) ucn->inflight--;
+    if (!ucn->closing) conn_list_touch(&r->idle, cn, now_sec());
+
+    switch (op) {
+    case UOP_RECV:
+        if (!(flags & IORING_CQE_F_MORE)) ucn->recv_armed = ucn->recv_stopping = 0;
+        if (res == -EINVAL && r->recv_capped) {
+            r->recv_capped = 0; // Older kernel: re-armed without the cap below
+            break;
+        }
+        if (flags & IORING_CQE_F_BUFFER) {
+            unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+            // Bytes that arrived before the recv was stopped belong to
+            // pipelined requests: keep them for later.
+            if (res > 0 && !ucn->closing) {
+                if (!conn_append(cn, r->bufs + (size_t)bid * URING_BUF_SIZE, res)) {
+                    cn->state = CONN_CLOSED;
                 }
-                fclose(fp); // CRITICAL FIX: Close the file handle
-            } else {
-                // This `else` block now correctly logs an error but does not send an incorrect response
-                perror("fopen failed to create form_data.txt");
+                uring_stop_recv(r, ucn);
+            }
+            uring_buf_recycle(r, bid);
+        }
+        if (cn->state == CONN_READING && !ucn->closing &&
+            (res == 0 || (res < 0 && res != -ENOBUFS && res != -ECANCELED))) {
+            cn->state = CONN_CLOSED; // Peer closed or failed before a full request
+        }
+        break;
+    case UOP_SEND_HDR:
+    case UOP_SEND_BODY:
+        ucn->out_busy--;
+        if (res > 0) {
+            if (op == UOP_SEND_HDR) cn->woff += res;
+            else if (ucn->chunk_off < ucn->chunk_len) ucn->chunk_off += res;
+            else cn->boff += res;
+        } else if (res < 0 && res != -ECANCELED) {
+            cn->state = CONN_CLOSED;
+        }
+        break;
+    case UOP_READ:
+        ucn->out_busy--;
+        if (res > 0) {
+            ucn->chunk_len = res;
+            ucn->chunk_off = 0;
+            cn->file_off += res;
+        } else {
+            cn->state = CONN_CLOSED; // Read error or file truncated underneath us
+        }
+        break;
+    default:
+        break;
+    }
+
+    uring_conn_advance(r, ucn);
+}
+
+/**
+ * Single-process io_uring server loop: multishot accept, multishot recv into a
+ * provided buffer ring, file reads and linked header+body sends, all submitted
+ * in batches with one io_uring_enter() per loop iteration. Connections go
+ * through the same request handling as the other modes.
+ * @param s The listening socket file descriptor.
+ * @return -2 if the kernel lacks the needed io_uring support, -1 on a fatal error;
+ *         otherwise it never returns.
+ */
+int run_uring(int s) {
+    struct uring r;
+
+    event_loop = 1;
+    raise_fd_limit();
+    if (!uring_init(&r, URING_ENTRIES)) {
+        return -2;
+    }
+    r.recv_capped = 1;
+    uring_arm_accept(&r, s);
+    uring_arm_timer(&r);
+    r.done_fd = loop_done_attach(0);
+    if (r.done_fd < 0) fprintf(stderr, "Warning: logins and synced form posts will block the event loop: %s", error_msg);
+    else uring_arm_done(&r);
+
+    while (1) {
+        unsigned head, tail;
+        int n = uring_enter(&r, r.to_submit, 1, IORING_ENTER_GETEVENTS);
+
+        if (n < 0) {
+            if (errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+                snprintf(error_msg, sizeof(error_msg), "io_uring_enter() error: %s\n", strerror(errno));
+                return -1;
             }
+        } else {
+            r.to_submit -= n;
+        }
 
-            // The success response is now sent after all file operations,
-            // regardless of whether the file was successfully opened.
-            // This ensures a 200 OK response is always sent for a valid POST request.
-            f = fileread("./success.html");
-            res = "<h2>Data Submitted Successfully!</h2><p>Check the form_data.txt file on the server.</p>";
-            // http_send_response(c, 200, "text/html", res, strlen(res));
-            http_send_response(c, 200, "text/html", f->fc, f->size);
+        head = *r.cq_head;
+        tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &r.cqes[head & *r.cq_mask];
+            unsigned long long user_data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+
+            // Release the slot before handling: handlers may queue new work.
+            head++;
+            __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+            uring_complete(&r, s, user_data, res, flags);
+            tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+        }
+    }
+}
+
+// A thread's queue of runnable connections. The owner takes the oldest one
+// from the front so its own connections are served in order; idle threads
+// steal from the back, the end the owner will reach last.
+struct work_deque {
+    pthread_mutex_t lock;
+    struct conn **conns; // Ring buffer of connections ready to be advanced
+    size_t head;         // Index of the front element
+    size_t len;
+    size_t cap;
+};
+
+// Connections only occupy a pool thread while they can make progress. A
+// connection that would block is parked in the epoll set `ep`, which the main
+// thread watches next to the listening socket; once its socket is ready it is
+// dealt onto a deque again.
+struct thread_pool {
+    int nthreads;
+    struct work_deque *deques;
+    atomic_int pending;        // Connections queued across all deques
+    pthread_mutex_t idle_lock; // Guards sleeping on idle_cond
+    pthread_cond_t idle_cond;
+    int ep;                    // epoll set of the listener and the parked connections
+    int next;                  // Deque the main thread deals onto next
+    pthread_mutex_t park_lock; // Guards the parked list
+    struct conn_list parked;   // Parked connections by last activity
+};
+
+struct pool_worker {
+    struct thread_pool *pool;
+    int id;
+};
+
+/**
+ * Appends a connection to the back of a deque, growing it if needed.
+ * @return 1 on success, 0 if memory allocation failed.
+ */
+int deque_push(struct work_deque *dq, struct conn *cn) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->len == dq->cap) {
+        size_t i, cap = dq->cap ? dq->cap * 2 : DEQUE_INIT_CAP;
+        struct conn **conns = malloc(cap * sizeof(*conns));
+        if (conns == NULL) {
+            pthread_mutex_unlock(&dq->lock);
+            return 0;
+        }
+        for (i = 0; i < dq->len; i++) {
+            conns[i] = dq->conns[(dq->head + i) % dq->cap];
+        }
+        free(dq->conns);
+        dq->conns = conns;
+        dq->head = 0;
+        dq->cap = cap;
+    }
+    dq->conns[(dq->head + dq->len) % dq->cap] = cn;
+    dq->len++;
+    pthread_mutex_unlock(&dq->lock);
+    return 1;
+}
+
+/**
+ * Takes a connection from the front (owner) or the back (thief) of a deque.
+ * @return The connection, or NULL if the deque is empty.
+ */
+struct conn *deque_take(struct work_deque *dq, int from_back) {
+    struct conn *cn = NULL;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->len > 0) {
+        if (from_back) {
+            cn = dq->conns[(dq->head + dq->len - 1) % dq->cap];
         } else {
-            fprintf(stderr, "Error: No header end found in POST request.\n");
-            res = "Bad Request";
-            http_send_response(c, 400, "text/plain", res, strlen(res));
+            cn = dq->conns[dq->head];
+            dq->head = (dq->head + 1) % dq->cap;
+        }
+        dq->len--;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return cn;
+}
+
+/**
+ * Deals a runnable connection onto the next deque and wakes a sleeping thread.
+ * Only called from the main thread.
+ */
+void pool_queue(struct thread_pool *pool, struct conn *cn) {
+    if (!deque_push(&pool->deques[pool->next], cn)) {
+        perror("deque_push() failed");
+        close(cn->fd);
+        conn_free(cn);
+        free(cn);
+        return;
+    }
+    pool->next = (pool->next + 1) % pool->nthreads;
+
+    // Publish the work before waking a sleeper so the wakeup cannot be lost.
+    atomic_fetch_add(&pool->pending, 1);
+    pthread_mutex_lock(&pool->idle_lock);
+    pthread_cond_signal(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+/**
+ * Advances a connection until its socket would block, then parks it in the
+ * pool's epoll set for the event it is waiting on. The thread is free for
+ * other connections as soon as this returns.
+ * @param pool The pool.
+ * @param cn The connection, owned by the calling thread.
+ */
+void pool_serve(struct thread_pool *pool, struct conn *cn) {
+    struct epoll_event ev;
+
+    if (conn_step(cn)) {
+        close(cn->fd);
+        conn_free(cn);
+        free(cn);
+        return;
+    }
+    if (cn->state == CONN_WAITING) {
+        // Requeued by the main thread once its job is done; neither parked
+        // nor swept until then, like on the other event loops.
+        __atomic_store_n(&cn->pool_released, 1, __ATOMIC_RELEASE);
+        return;
+    }
+
+    // One-shot: after the event fires the main thread owns the connection
+    // again until a pool thread parks it once more.
+    ev.events = (cn->state == CONN_WRITING ? EPOLLOUT : EPOLLIN) | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = cn;
+    pthread_mutex_lock(&pool->park_lock);
+    conn_list_touch(&pool->parked, cn, now_sec());
+    if (epoll_ctl(pool->ep, EPOLL_CTL_MOD, cn->fd, &ev) < 0
+        && (errno != ENOENT || epoll_ctl(pool->ep, EPOLL_CTL_ADD, cn->fd, &ev) < 0)) {
+        perror("epoll_ctl() failed");
+        conn_destroy(&pool->parked, cn);
+    }
+    pthread_mutex_unlock(&pool->park_lock);
+}
+
+/**
+ * Waits until the pool thread that left a connection in CONN_WAITING has let
+ * go of it. Its job may finish before that thread has returned from
+ * conn_step(), but the thread is already on its way out, so this is short.
+ * Only called from the main thread, before it answers the connection.
+ */
+void pool_resume(struct thread_pool *pool, struct conn *cn) {
+    while (!__atomic_load_n(&cn->pool_released, __ATOMIC_ACQUIRE)) sched_yield();
+    cn->pool_released = 0;
+}
+
+/**
+ * Pool thread: serve connections from the own deque, steal from the others
+ * when it runs dry, and sleep when there is no work anywhere.
+ */
+void *pool_thread(void *arg) {
+    struct pool_worker *w = arg;
+    struct thread_pool *pool = w->pool;
+    struct conn *cn;
+    int i;
+
+    worker_id = w->id;
+    while (1) {
+        cn = deque_take(&pool->deques[w->id], 0);
+        for (i = 1; cn == NULL && i < pool->nthreads; i++) {
+            cn = deque_take(&pool->deques[(w->id + i) % pool->nthreads], 1);
+        }
+
+        if (cn == NULL) {
+            pthread_mutex_lock(&pool->idle_lock);
+            while (atomic_load(&pool->pending) == 0) {
+                pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+            }
+            pthread_mutex_unlock(&pool->idle_lock);
+            continue;
         }
 
+        atomic_fetch_sub(&pool->pending, 1);
+        pool_serve(pool, cn);
+    }
+    return NULL;
+}
+
+/**
+ * Thread-pool server loop. The calling thread accepts connections and deals
+ * them round-robin onto the deques of a fixed set of pool threads, which
+ * balance the load among themselves by work stealing. Between requests, and
+ * whenever a socket would block, connections wait in an epoll set watched by
+ * the calling thread instead of holding a pool thread; it re-queues them once
+ * they are ready and closes those idle for longer than the keep-alive timeout.
+ * Logins and synced form posts wait the same way: the calling thread answers
+ * them when the loop's completion eventfd fires and re-queues them.
+ * @param s The listening socket file descriptor.
+ * @param nthreads The number of pool threads.
+ * @return -1 on a fatal error; otherwise it never returns.
+ */
+int run_thread_pool(int s, int nthreads) {
+    struct thread_pool pool;
+    struct pool_worker *workers;
+    struct epoll_event ev, events[MAX_EVENTS];
+    int i, n, dfd;
+    time_t now;
+
+    event_loop = 1;
+    raise_fd_limit();
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+
+    memset(&pool, 0, sizeof(pool));
+    pool.nthreads = nthreads;
+    pool.deques = calloc(nthreads, sizeof(struct work_deque));
+    workers = calloc(nthreads, sizeof(struct pool_worker));
+    if (pool.deques == NULL || workers == NULL) {
+        snprintf(error_msg, sizeof(error_msg), "run_thread_pool() error: memory allocation failed\n");
+        free(pool.deques);
+        free(workers);
+        return -1;
+    }
+    atomic_init(&pool.pending, 0);
+    pthread_mutex_init(&pool.idle_lock, NULL);
+    pthread_cond_init(&pool.idle_cond, NULL);
+    pthread_mutex_init(&pool.park_lock, NULL);
+
+    // The listening socket is tagged with a NULL pointer, parked connections with their state.
+    pool.ep = epoll_create1(EPOLL_CLOEXEC);
+    if (pool.ep < 0) {
+        snprintf(error_msg, sizeof(error_msg), "epoll_create1() error: %s\n", strerror(errno));
+        return -1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(pool.ep, EPOLL_CTL_ADD, s, &ev) < 0) {
+        snprintf(error_msg, sizeof(error_msg), "epoll_ctl() error: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // Finished password hashes and form syncs, tagged with &loop_done_fd.
+    dfd = loop_done_attach(EFD_NONBLOCK);
+    if (dfd < 0) {
+        fprintf(stderr, "Warning: logins and synced form posts will hold a pool thread: %s", error_msg);
     } else {
-        res = "Method not supported ";
-        http_send_response(c, 405, "text/plain", res, strlen(res));
+        ev.events = EPOLLIN;
+        ev.data.ptr = &loop_done_fd;
+        if (epoll_ctl(pool.ep, EPOLL_CTL_ADD, dfd, &ev) < 0) {
+            snprintf(error_msg, sizeof(error_msg), "epoll_ctl() error: %s\n", strerror(errno));
+            return -1;
+        }
     }
 
-    // Clean up allocated memory.
-    free(req);
-    free(full_request_data);
-    close(c);
+    for (i = 0; i < nthreads; i++) {
+        pthread_t tid;
+        int err;
+
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+        workers[i].pool = &pool;
+        workers[i].id = i;
+        err = pthread_create(&tid, NULL, pool_thread, &workers[i]);
+        if (err) {
+            snprintf(error_msg, sizeof(error_msg), "pthread_create() error: %s\n", strerror(err));
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+
+    while (1) {
+        // Wake up at least once a second to expire idle connections.
+        n = epoll_wait(pool.ep, events, MAX_EVENTS, 1000);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            snprintf(error_msg, sizeof(error_msg), "epoll_wait() error: %s\n", strerror(errno));
+            return -1;
+        }
+
+        for (i = 0; i < n; i++) {
+            struct conn *cn = events[i].data.ptr;
+
+            if ((void *)cn == &loop_done_fd) {
+                struct kdf_job *job, *next;
+                struct form_record *rec, *rnext;
+                uint64_t count;
+
+                if (read(dfd, &count, sizeof(count)) < 0 && errno != EAGAIN) perror("eventfd read() failed");
+                for (job = kdf_take_done(); job; job = next) {
+                    next = job->next; // The job goes with the arena once the response is sent
+                    cn = job->cn;
+                    pool_resume(&pool, cn);
+                    auth_finish(cn, job);
+                    pool_queue(&pool, cn);
+                }
+                for (rec = form_take_done(); rec; rec = rnext) {
+                    rnext = rec->next;
+                    cn = rec->cn;
+                    pool_resume(&pool, cn);
+                    form_finish(cn, rec);
+                    pool_queue(&pool, cn);
+                }
+                continue;
+            }
+
+            if (cn == NULL) {
+                while (1) {
+                    int c = accept4(s, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if (c < 0) {
+                        if (errno == EINTR || errno == ECONNABORTED) continue;
+                        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                            metric_add(M_ACCEPT_ERRORS, 1);
+                            fprintf(stderr, "Accept() error: %s\n", strerror(errno));
+                        }
+                        break;
+                    }
+
+                    cn = malloc(sizeof(struct conn));
+                    if (cn == NULL) {
+                        perror("malloc() error for conn");
+                        close(c);
+                        continue;
+                    }
+                    conn_init(cn, c);
+                    pool_queue(&pool, cn);
+                }
+                continue;
+            }
+
+            pthread_mutex_lock(&pool.park_lock);
+            conn_list_remove(&pool.parked, cn);
+            pthread_mutex_unlock(&pool.park_lock);
+            pool_queue(&pool, cn);
+        }
+
+        // The list is ordered by activity, so stop at the first live connection.
+        now = now_sec();
+        pthread_mutex_lock(&pool.park_lock);
+        while (pool.parked.head && now - pool.parked.head->last_active >= config.keepalive_timeout) {
+            conn_destroy(&pool.parked, pool.parked.head);
+        }
+        pthread_mutex_unlock(&pool.park_lock);
+    }
+}
+
+// Set by SIGINT/SIGTERM so the master stops supervising and shuts the workers down.
+volatile sig_atomic_t master_stop = 0;
+
+void master_on_signal(int sig) {
+    (void)sig;
+    master_stop = 1;
+}
+
+/**
+ * Pins the calling process to one CPU out of those it is allowed to run on.
+ * @param slot The worker index; workers are spread round-robin over the allowed CPUs.
+ */
+void pin_to_cpu(int slot) {
+    cpu_set_t allowed, one;
+    int ncpu, cpu, seen = 0;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        perror("sched_getaffinity() failed");
+        return;
+    }
+    ncpu = CPU_COUNT(&allowed);
+    if (ncpu == 0) return;
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) continue;
+        if (seen++ == slot % ncpu) break;
+    }
+
+    CPU_ZERO(&one);
+    CPU_SET(cpu, &one);
+    if (sched_setaffinity(0, sizeof(one), &one) != 0) {
+        perror("sched_setaffinity() failed");
+    }
+}
+
+/**
+ * Body of a pre-forked worker: pin to a CPU, open a private SO_REUSEPORT
+ * listener and serve connections with the event loop until something fails.
+ * @param portno The port number to listen on.
+ * @param slot The worker index.
+ */
+void worker_main(int portno, int slot) {
+    int s;
+
+    // Die with the master instead of lingering as an orphan.
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
+    pin_to_cpu(slot);
+    worker_id = slot;
+
+    s = serv_init(portno, 1);
+    if (!s) {
+        fprintf(stderr, "Worker %d: %s", slot, error_msg);
+        exit(1);
+    }
+
+    run_epoll(s);
+    fprintf(stderr, "Worker %d: %s", slot, error_msg);
+    exit(1);
+}
+
+/**
+ * Forks one worker for the given slot.
+ * @return The worker pid, or -1 if fork() failed.
+ */
+pid_t spawn_worker(int portno, int slot) {
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        perror("fork() failed");
+        return -1;
+    }
+    if (pid == 0) {
+        worker_main(portno, slot);
+    }
+    return pid;
 }
 
+/**
+ * Master process of the pre-forked mode. Starts one long-lived worker per
+ * slot, reaps workers as they exit and restarts any that died, until it is
+ * asked to stop with SIGINT or SIGTERM.
+ * @param portno The port number the workers listen on.
+ * @param nworkers The number of workers to keep running.
+ * @return 0 after a clean shutdown, -1 on error.
+ */
+int run_prefork(int portno, int nworkers) {
+    pid_t *pids;
+    time_t *started;
+    struct sigaction sa;
+    int i, status;
+
+    pids = calloc(nworkers, sizeof(pid_t));
+    started = calloc(nworkers, sizeof(time_t));
+    if (pids == NULL || started == NULL) {
+        snprintf(error_msg, sizeof(error_msg), "run_prefork() error: memory allocation failed\n");
+        free(pids);
+        free(started);
+        return -1;
+    }
+
+    // No SA_RESTART: a signal must interrupt waitpid() below.
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = master_on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    for (i = 0; i < nworkers; i++) {
+        pids[i] = spawn_worker(portno, i);
+        started[i] = time(NULL);
+    }
+
+    while (!master_stop) {
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            if (errno != ECHILD) perror("waitpid() failed");
+            // No children left (every fork failed): retry them after a pause.
+            sleep(1);
+        }
+
+        for (i = 0; i < nworkers; i++) {
+            if (pid > 0 && pids[i] != pid) continue;
+            if (pid < 0 && pids[i] != -1) continue;
+
+            if (pid > 0) {
+                if (WIFSIGNALED(status)) {
+                    fprintf(stderr, "Worker %d (pid %d) killed by signal %d, restarting.\n",
+                            i, pid, WTERMSIG(status));
+                } else {
+                    fprintf(stderr, "Worker %d (pid %d) exited with status %d, restarting.\n",
+                            i, pid, WEXITSTATUS(status));
+                }
+                // Throttle a worker that keeps dying right after start.
+                if (time(NULL) - started[i] < 1) sleep(1);
+            }
+            if (master_stop) break;
+            pids[i] = spawn_worker(portno, i);
+            started[i] = time(NULL);
+        }
+    }
+
+    for (i = 0; i < nworkers; i++) {
+        if (pids[i] > 0) kill(pids[i], SIGTERM);
+    }
+    while (waitpid(-1, NULL, 0) > 0 || errno == EINTR)
+        ;
+
+    free(pids);
+    free(started);
+    return 0;
+}
 
+// Benchmarks include this file for its request-path functions and bring their own main().
+#ifndef HTTP_NO_MAIN
 int main(int argc, char *argv[]) {
-    int s, nsockfd;
+    int s, nsockfd, opt;
     char *portno;
+    const char *mode = "fork";
+    const char *docroot_dir = NULL;
+    int nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+
+    simd_init();
+
+    while ((opt = getopt(argc, argv, "m:w:k:r:c:e:d:C:t:s:S:f:l:L:R:M:B:")) != -1) {
+        switch (opt) {
+        case 'm':
+            mode = optarg;
+            break;
+        case 'w':
+            nworkers = atoi(optarg);
+            break;
+        case 'k':
+            config.keepalive_timeout = atoi(optarg);
+            break;
+        case 'r':
+            config.keepalive_max = atoi(optarg);
+            break;
+        case 'c':
+            config.cache_bytes = (size_t)atol(optarg) * 1024 * 1024;
+            break;
+        case 'e':
+            if (!fixed_configure(optarg)) {
+                fprintf(stderr, "Error: %s", error_msg);
+                return -1;
+            }
+            break;
+        case 'd':
+            docroot_dir = optarg;
+            break;
+        case 'C':
+            if (!cache_rule_add(optarg)) {
+                fprintf(stderr, "Error: %s", error_msg);
+                return -1;
+            }
+            break;
+        case 'B':
+            if (!body_rule_add(optarg)) {
+                fprintf(stderr, "Error: %s", error_msg);
+                return -1;
+            }
+            break;
+        case 't':
+            config.kdf_threads = atoi(optarg);
+            break;
+        case 's':
+            config.kdf_cost = atoi(optarg);
+            if (config.kdf_cost < 10 || config.kdf_cost > 22) {
+                fprintf(stderr, "Error: scrypt cost must be between 10 and 22 (log2 N)\n");
+                return -1;
+            }
+            break;
+        case 'S':
+            config.session_idle = atoi(optarg);
+            break;
+        case 'f':
+            if (strcmp(optarg, "off") == 0) {
+                config.form_sync = FORM_SYNC_OFF;
+            } else if (strcmp(optarg, "batch") == 0) {
+                config.form_sync = FORM_SYNC_BATCH;
+            } else if (strcmp(optarg, "sync") == 0) {
+                config.form_sync = FORM_SYNC_DURABLE;
+            } else {
+                fprintf(stderr, "Error: form sync mode must be off, batch or sync\n");
+                return -1;
+            }
+            break;
+        case 'l':
+            config.access_log = strcmp(optarg, "off") == 0 ? NULL : optarg;
+            break;
+        case 'L':
+            config.log_max_bytes = (off_t)atol(optarg) * 1024 * 1024;
+            break;
+        case 'R':
+            config.log_rotate_secs = atoi(optarg);
+            break;
+        case 'M':
+            config.metrics_path = strcmp(optarg, "off") == 0 ? NULL : optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-m fork|epoll|prefork|threads|uring] [-w workers] [-k keepalive_secs] [-r max_requests] [-c cache_mb] [-e code=file] [-d docroot] [-C prefix=cache_control] [-t kdf_threads] [-s scrypt_cost] [-S session_idle_secs] [-f off|batch|sync] [-l access_log|off] [-L log_max_mb] [-R log_rotate_secs] [-M metrics_path|off] [-B [path=]max_body] <portno>\n", argv[0]);
+            return -1;
+        }
+    }
 
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <portno>\n", argv[0]);
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-m fork|epoll|prefork|threads|uring] [-w workers] [-k keepalive_secs] [-r max_requests] [-c cache_mb] [-e code=file] [-d docroot] [-C prefix=cache_control] [-t kdf_threads] [-s scrypt_cost] [-S session_idle_secs] [-f off|batch|sync] [-l access_log|off] [-L log_max_mb] [-R log_rotate_secs] [-M metrics_path|off] [-B [path=]max_body] <portno>\n", argv[0]);
         return -1;
     }
-    
-    portno = argv[1];
-    s = serv_init(atoi(portno));
+    if (strcmp(mode, "fork") != 0 && strcmp(mode, "epoll") != 0 && strcmp(mode, "prefork") != 0 &&
+        strcmp(mode, "threads") != 0 && strcmp(mode, "uring") != 0) {
+        fprintf(stderr, "Unknown mode '%s' (expected fork, epoll, prefork, threads or uring)\n", mode);
+        return -1;
+    }
+    if (nworkers < 1) nworkers = 1;
+    if (config.keepalive_timeout < 1) config.keepalive_timeout = 1;
+    if (config.session_idle < 1) config.session_idle = 1;
+    if (config.kdf_threads < 1) {
+        // Half the CPUs for password hashing, split across the prefork workers.
+        int procs = strcmp(mode, "prefork") == 0 ? nworkers : 1;
+        config.kdf_threads = sysconf(_SC_NPROCESSORS_ONLN) / 2 / procs;
+        if (config.kdf_threads < 1) config.kdf_threads = 1;
+    }
+
+    portno = argv[optind];
+
+    // Every path is resolved relative to the docroot from here on.
+    if (docroot_dir && chdir(docroot_dir) < 0) {
+        fprintf(stderr, "Error: cannot use docroot '%s': %s\n", docroot_dir, strerror(errno));
+        return -1;
+    }
+
+    if (config.access_log) {
+        char cwd[PATH_MAX];
+        const char *log = config.access_log;
+        size_t len;
+
+        // An absolute path is refused too if it points into the docroot.
+        if (log[0] == '/') {
+            if (getcwd(cwd, sizeof(cwd)) && (len = strlen(cwd)) > 1 && strncmp(log, cwd, len) == 0 && log[len] == '/') {
+                log += len;
+            } else {
+                log = NULL;
+            }
+        }
+        if (log == NULL || !docroot_path(access_log_path, sizeof(access_log_path), log, strlen(log))) {
+            access_log_path[0] = '\0'; // Outside the docroot
+        }
+    }
+
+    // The cache and the fixed responses are set up before any fork() so every worker shares them.
+    if (config.cache_bytes > 0 && !cache_init(config.cache_bytes)) {
+        fprintf(stderr, "Warning: static file cache disabled: %s", error_msg);
+    }
+    if (!index_init()) {
+        fprintf(stderr, "Warning: docroot index disabled: %s", error_msg);
+    }
+    if (!fixed_init()) {
+        fprintf(stderr, "Warning: fixed responses are built per process: %s", error_msg);
+    }
+    if (!user_store_init()) {
+        fprintf(stderr, "Warning: user store disabled, registration and login will fail: %s", error_msg);
+    }
+    if (!metrics_init()) {
+        fprintf(stderr, "Warning: metrics disabled: %s", error_msg);
+    }
+    if (!session_init()) {
+        fprintf(stderr, "Warning: sessions disabled, every login will hash the password: %s", error_msg);
+    }
+    if (!cache_watch_start()) {
+        fprintf(stderr, "Warning: docroot changes will not be picked up, static file cache disabled: %s",
+                error_msg);
+        cache = NULL;
+    }
+
+    if (strcmp(mode, "prefork") == 0) {
+        // Probe the address once so a bad port fails here rather than in every worker.
+        s = serv_init(atoi(portno), 1);
+        if (!s) {
+            fprintf(stderr, "Error: %s", error_msg);
+            return -1;
+        }
+        close(s);
+
+        printf("Listening on %s:%s (prefork mode, %d workers)\n", LISTENADDRESS, portno, nworkers);
+        fflush(stdout);
+        if (run_prefork(atoi(portno), nworkers) < 0) {
+            fprintf(stderr, "Error: %s", error_msg);
+            return -1;
+        }
+        return 0;
+    }
+
+    s = serv_init(atoi(portno), 0);
     if (!s) {
         fprintf(stderr, "Error: %s", error_msg);
         return -1;
     }
 
-    printf("Listening on %s:%s\n", LISTENADDRESS, portno);
+    printf("Listening on %s:%s (%s mode)\n", LISTENADDRESS, portno, mode);
+    fflush(stdout); // Forked children must not inherit and re-print this line
+
+    if (strcmp(mode, "uring") == 0) {
+        if (run_uring(s) == -2) {
+            fprintf(stderr, "%sio_uring unavailable, falling back to epoll mode.\n", error_msg);
+            mode = "epoll";
+        } else {
+            fprintf(stderr, "Error: %s", error_msg);
+            close(s);
+            return -1;
+        }
+    }
+
+    if (strcmp(mode, "epoll") == 0) {
+        run_epoll(s);
+        fprintf(stderr, "Error: %s", error_msg);
+        close(s);
+        return -1;
+    }
+
+    if (strcmp(mode, "threads") == 0) {
+        run_thread_pool(s, nworkers);
+        fprintf(stderr, "Error: %s", error_msg);
+        close(s);
+        return -1;
+    }
+
+    // Let the kernel reap finished children so they do not linger as zombies.
+    signal(SIGCHLD, SIG_IGN);
 
     while (1) {
         nsockfd = client_acpt(s);
@@ -663,20 +7677,17 @@ int main(int argc, char *argv[]) {
         }
 
         if (pid == 0) { // This is the child process.
-            printf("New connection accepted. Handling in child process %d.\n", getpid());
+            mblock = NULL; // The parent's metrics block is not ours to write
             close(s); // The child process doesn't need the server socket.
             cli_conn(nsockfd);
             exit(0); // Terminate the child process after handling the request.
         } else { // This is the parent process.
-            // FIX: The parent should not close the client socket. The child's close() call
-            // will handle the socket termination. Closing it here creates a race condition.
-            // close(nsockfd);
+            // The child holds its own reference to the socket; the parent must drop
+            // its copy or it leaks one descriptor per connection.
+            close(nsockfd);
         }
     }
     close(s);
     return 0; // The while loop prevents this from being reached.
 }
-
-
-
-
+#endif // HTTP_NO_MAIN
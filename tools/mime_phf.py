@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+"""Generates the perfect-hash MIME table used by get_content_type() in http.c.
+
+Searches for an FNV-1a seed under which every extension lands in its own slot
+of a power-of-two table, then prints the C block to paste between the
+"Generated by tools/mime_phf.py" markers in http.c. Extensions are hashed
+lowercased, so lookups are case-insensitive.
+
+Usage: python3 tools/mime_phf.py
+"""
+
+TYPES = [
+    ("html", "text/html"),
+    ("htm", "text/html"),
+    ("css", "text/css"),
+    ("js", "application/javascript"),
+    ("mjs", "application/javascript"),
+    ("json", "application/json"),
+    ("txt", "text/plain"),
+    ("xml", "application/xml"),
+    ("svg", "image/svg+xml"),
+    ("jpeg", "image/jpeg"),
+    ("jpg", "image/jpeg"),
+    ("png", "image/png"),
+    ("gif", "image/gif"),
+    ("webp", "image/webp"),
+    ("avif", "image/avif"),
+    ("ico", "image/x-icon"),
+    ("mp4", "video/mp4"),
+    ("webm", "video/webm"),
+    ("mp3", "audio/mpeg"),
+    ("ogg", "audio/ogg"),
+    ("wav", "audio/wav"),
+    ("woff", "font/woff"),
+    ("woff2", "font/woff2"),
+    ("pdf", "application/pdf"),
+    ("wasm", "application/wasm"),
+]
+
+SLOTS = 64
+MAX_EXT = 7
+
+
+def fnv1a(seed, s):
+    h = seed
+    for c in s.encode():
+        h ^= c
+        h = (h * 16777619) & 0xFFFFFFFF
+    return h ^ (h >> 16)  # The low bits alone barely depend on the seed
+
+
+def find_seed():
+    for seed in range(2166136261, 2166136261 + 1000000):
+        slots = {fnv1a(seed, ext) & (SLOTS - 1) for ext, _ in TYPES}
+        if len(slots) == len(TYPES):
+            return seed
+    raise SystemExit("no seed found, grow SLOTS")
+
+
+def main():
+    assert all(len(ext) <= MAX_EXT and ext == ext.lower() for ext, _ in TYPES)
+    seed = find_seed()
+    table = [None] * SLOTS
+    for ext, mime in TYPES:
+        table[fnv1a(seed, ext) & (SLOTS - 1)] = (ext, mime)
+
+    print("// Generated by tools/mime_phf.py; edit the list there and rerun.")
+    print("#define MIME_SLOTS %d" % SLOTS)
+    print("#define MIME_SEED %du" % seed)
+    print("static const struct mime_type mime_types[MIME_SLOTS] = {")
+    for i, e in enumerate(table):
+        if e:
+            print('    [%d] = {"%s", "%s"},' % (i, e[0], e[1]))
+    print("};")
+    print("// End of generated code.")
+
+
+if __name__ == "__main__":
+    main()